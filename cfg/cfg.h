@@ -18,4 +18,12 @@
 #define PP_USE_SDL_DATADIR 0
 #endif
 
+#ifndef PP_FIXED_POINT
+#define PP_FIXED_POINT 0
+#endif
+
+#ifndef PP_SIMD
+#define PP_SIMD 0
+#endif
+
 #endif
@@ -0,0 +1,76 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "bench.h"
+#include "kernel/kernel.h"
+#include "cbase/kassert.h"
+#include <float.h>
+
+int s_bench_mode;
+
+static void reset(struct bench *b)
+{
+	b->nsamples = 0;
+	b->total = 0;
+	b->min = DBL_MAX;
+	b->max = 0;
+}
+
+void bench_init(struct bench *b, const char *name)
+{
+	b->name = name;
+	b->t0 = 0;
+	reset(b);
+}
+
+void bench_start(struct bench *b)
+{
+	b->t0 = kernel_get_device()->get_time_ms();
+}
+
+/* Adds the time passed since bench_start() as a new sample. */
+void bench_stop(struct bench *b)
+{
+	double t;
+
+	t = kernel_get_device()->get_time_ms() - b->t0;
+	b->total += t;
+	if (t < b->min)
+		b->min = t;
+	if (t > b->max)
+		b->max = t;
+	b->nsamples++;
+}
+
+/* Traces the average, minimum and maximum time of the samples taken and
+ * starts again.
+ */
+void bench_report(struct bench *b)
+{
+	if (b->nsamples == 0)
+		return;
+
+	ktrace("bench %s: %d frames, avg %.3f ms, min %.3f ms, max %.3f ms",
+	       b->name, b->nsamples, b->total / b->nsamples, b->min, b->max);
+	reset(b);
+}
@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/* If not 0, we are running in benchmark mode (--bench). */
+extern int s_bench_mode;
+
+/* Accumulated timings of a piece of code measured over several frames. */
+struct bench {
+	const char *name;
+	int nsamples;
+	double t0;
+	double total;
+	double min;
+	double max;
+};
+
+void bench_init(struct bench *b, const char *name);
+void bench_start(struct bench *b);
+void bench_stop(struct bench *b);
+void bench_report(struct bench *b);
+
+#endif
@@ -35,6 +35,10 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <string.h>
 
+/* A line of data/bitmaps.txt: slot, name, use_key_color and key_color.
+ * A use_key_color of 2 also encodes the bitmap as runs (encode_bmp_runs),
+ * for the sprites that are mostly of the key color.
+ */
 struct bmp_file {
 	char name[9];
 	int sloti;
@@ -42,19 +46,219 @@ struct bmp_file {
 	unsigned int key_color;
 };
 
+/* pal_id is the id of the palette of pbmp in s_pals if it is managed,
+ * or 0 if it has none or it is not shared.
+ */
 struct bmp_slot {
 	struct bmp *pbmp;
 	int managed;
+	int pal_id;
+};
+
+/* Number of lists in s_pal_hash, a power of 2. */
+enum {
+	PAL_HASH_SIZE = 64,
 };
 
-static struct bmp_file s_bitmap_files[NBITMAPS];
+/* A palette shared by the managed bitmaps with the same colors, freed
+ * when 'refs' gets to 0. 'next' is the id of the next palette in the
+ * same list of s_pal_hash, or, if the entry is free, of the next free
+ * entry.
+ */
+struct pal_entry {
+	unsigned int *pal;
+	unsigned int hash;
+	int palsz;
+	int refs;
+	int next;
+};
+
+/* Both arrays grow as needed. */
+static struct bmp_file *s_bitmap_files;
+static int s_bitmap_files_cap;
 
 /* slot 0 is like NULL */
-static struct bmp_slot s_bitmap_slots[NBITMAPS];
+static struct bmp_slot *s_bitmap_slots;
+static int s_nbitmap_slots;
+
+/* The palette with id i is s_pals[i]; id 0 is not used. s_pal_free is
+ * the first free id, or 0. s_pal_hash has the first id of each list.
+ */
+static struct pal_entry *s_pals;
+static int s_npals;
+static int s_pals_cap;
+static int s_pal_free;
+static int s_pal_hash[PAL_HASH_SIZE];
 
 static int s_load_index;
 static int s_nbitmap_files;
 
+/* Makes room in s_bitmap_slots for slot i, which must be less than
+ * NBITMAPS. Returns 0 if no memory.
+ */
+static int grow_slots(int i)
+{
+	int n;
+	struct bmp_slot *p;
+
+	if (i < s_nbitmap_slots)
+		return 1;
+
+	n = s_nbitmap_slots == 0 ? 64 : s_nbitmap_slots;
+	while (n <= i)
+		n *= 2;
+
+	p = realloc(s_bitmap_slots, n * sizeof(*p));
+	if (p == NULL)
+		return 0;
+
+	memset(p + s_nbitmap_slots, 0, (n - s_nbitmap_slots) * sizeof(*p));
+	s_bitmap_slots = p;
+	s_nbitmap_slots = n;
+	return 1;
+}
+
+/* Makes room in s_bitmap_files for one more file.
+ * Returns 0 if no memory.
+ */
+static int grow_files(void)
+{
+	int n;
+	struct bmp_file *p;
+
+	if (s_nbitmap_files < s_bitmap_files_cap)
+		return 1;
+
+	n = s_bitmap_files_cap == 0 ? 64 : s_bitmap_files_cap * 2;
+	p = realloc(s_bitmap_files, n * sizeof(*p));
+	if (p == NULL)
+		return 0;
+
+	s_bitmap_files = p;
+	s_bitmap_files_cap = n;
+	return 1;
+}
+
+/* FNV-1a of the 'palsz' colors of 'pal'. */
+static unsigned int hash_pal(const unsigned int *pal, int palsz)
+{
+	int i;
+	unsigned int h, c;
+
+	h = 2166136261u;
+	for (i = 0; i < palsz; i++) {
+		c = pal[i];
+		h = (h ^ (c & 0xff)) * 16777619u;
+		h = (h ^ ((c >> 8) & 0xff)) * 16777619u;
+		h = (h ^ ((c >> 16) & 0xff)) * 16777619u;
+		h = (h ^ (c >> 24)) * 16777619u;
+	}
+
+	return h;
+}
+
+/* Returns the id of a free entry of s_pals, or 0 if no memory. */
+static int new_pal_id(void)
+{
+	int id, n;
+	struct pal_entry *p;
+
+	if (s_pal_free != 0) {
+		id = s_pal_free;
+		s_pal_free = s_pals[id].next;
+		return id;
+	}
+
+	if (s_npals == s_pals_cap) {
+		n = s_pals_cap == 0 ? 16 : s_pals_cap * 2;
+		p = realloc(s_pals, n * sizeof(*p));
+		if (p == NULL)
+			return 0;
+
+		s_pals = p;
+		s_pals_cap = n;
+		if (s_npals == 0)
+			s_npals = 1;
+	}
+
+	return s_npals++;
+}
+
+/* Makes 'pbmp' use the shared palette with its colors, freeing its own,
+ * or shares its palette if there is none yet.
+ * Returns the id of the palette, 0 if pbmp has no palette or there is no
+ * memory; then pbmp keeps its own palette.
+ */
+static int intern_pal(struct bmp *pbmp)
+{
+	int id, palsz;
+	unsigned int h, *pal;
+	struct pal_entry *pe;
+
+	pal = pbmp->pal;
+	if (pal == NULL)
+		return 0;
+
+	/* load_bmp_fp leaves the colors past palsz with garbage, but
+	 * there is room for 256. */
+	palsz = pbmp->palsz;
+	memset(pal + palsz, 0, (256 - palsz) * sizeof(*pal));
+
+	h = hash_pal(pal, palsz);
+	for (id = s_pal_hash[h & (PAL_HASH_SIZE - 1)]; id != 0;
+	     id = pe->next)
+	{
+		pe = &s_pals[id];
+		if (pe->hash == h && pe->palsz == palsz &&
+		    memcmp(pe->pal, pal, palsz * sizeof(*pal)) == 0)
+		{
+			free(pal);
+			pbmp->pal = pe->pal;
+			pe->refs++;
+			return id;
+		}
+	}
+
+	id = new_pal_id();
+	if (id == 0) {
+		ktrace("no memory to share palettes");
+		return 0;
+	}
+
+	pe = &s_pals[id];
+	pe->pal = pal;
+	pe->hash = h;
+	pe->palsz = palsz;
+	pe->refs = 1;
+	pe->next = s_pal_hash[h & (PAL_HASH_SIZE - 1)];
+	s_pal_hash[h & (PAL_HASH_SIZE - 1)] = id;
+	return id;
+}
+
+/* Drops a reference to the palette 'id', freeing it if it is the last. */
+static void release_pal(int id)
+{
+	int *pid;
+	struct pal_entry *pe;
+
+	if (kassert_fails(id > 0 && id < s_npals && s_pals[id].refs > 0))
+		return;
+
+	pe = &s_pals[id];
+	if (--pe->refs > 0)
+		return;
+
+	pid = &s_pal_hash[pe->hash & (PAL_HASH_SIZE - 1)];
+	while (*pid != id)
+		pid = &s_pals[*pid].next;
+	*pid = pe->next;
+
+	free(pe->pal);
+	pe->pal = NULL;
+	pe->next = s_pal_free;
+	s_pal_free = id;
+}
+
 /* Sets the bitmap at slot i to pbmp.
  * Does nothing if that slot contains a managed bitmap.
  */
@@ -62,6 +266,10 @@ void set_bitmap(int i, struct bmp *pbmp)
 {
 	if (kassert_fails(i > 0 && i < NBITMAPS))
 		return;
+	if (!grow_slots(i)) {
+		ktrace("no memory for bitmap slot %d", i);
+		return;
+	}
 	if (kassert_fails(!s_bitmap_slots[i].managed))
 		return;
 	s_bitmap_slots[i].pbmp = pbmp;
@@ -69,11 +277,32 @@ void set_bitmap(int i, struct bmp *pbmp)
 
 struct bmp *get_bitmap(int i)
 {
-	if (i < 0 || i >= NBITMAPS)
-		i = 0;
+	if (i <= 0 || i >= s_nbitmap_slots)
+		return NULL;
 	return s_bitmap_slots[i].pbmp;
 }
 
+int get_bitmap_pal_id(int i)
+{
+	if (i <= 0 || i >= s_nbitmap_slots)
+		return 0;
+	return s_bitmap_slots[i].pal_id;
+}
+
+const unsigned int *get_pal(int id, int *palsz)
+{
+	if (id <= 0 || id >= s_npals || s_pals[id].pal == NULL)
+		return NULL;
+	if (palsz != NULL)
+		*palsz = s_pals[id].palsz;
+	return s_pals[id].pal;
+}
+
+int get_npal_ids(void)
+{
+	return s_npals;
+}
+
 int load_bitmap_list(void)
 {
 	int i;
@@ -85,7 +314,12 @@ int load_bitmap_list(void)
 		return 0;
 
 	i = 0;
-	while (i < NBITMAPS && readlin(fp, line) != -1) {
+	s_nbitmap_files = 0;
+	while (readlin(fp, line) != -1) {
+		if (!grow_files()) {
+			ktrace("no memory for the bitmap list");
+			break;
+		}
 		if (tokscanf(line, "isii", &s_bitmap_files[i].sloti,
 			     s_bitmap_files[i].name,
 			     sizeof(s_bitmap_files[i].name),
@@ -93,10 +327,10 @@ int load_bitmap_list(void)
 			     &s_bitmap_files[i].key_color) == 4)
 		{
 			i++;
+			s_nbitmap_files = i;
 		}
 	}
 
-	s_nbitmap_files = i;
 	fclose(fp);
 	return i;
 }
@@ -104,7 +338,7 @@ int load_bitmap_list(void)
 static int load_bitmap_num(int i)
 {
 	FILE *fp;
-	int sloti;
+	int sloti, pal_id;
 	struct bmp *pbmp;
 	struct bmp_file *bmpf;
 	char path[24];
@@ -119,6 +353,12 @@ static int load_bitmap_num(int i)
 		return E_BITMAPS_LOAD_ERROR;
 	}
 
+	if (!grow_slots(bmpf->sloti)) {
+		ktrace("no memory for bitmap slot %d (%s)", bmpf->sloti,
+				bmpf->name);
+		return E_BITMAPS_LOAD_ERROR;
+	}
+
 	snprintf(path, sizeof(path), "data/%s.bmp", bmpf->name);
 	fp = open_file(path, NULL);
 	if (fp == NULL)
@@ -130,11 +370,16 @@ static int load_bitmap_num(int i)
 	if (pbmp == NULL)
 		return E_BITMAPS_LOAD_ERROR;
 
+	pal_id = intern_pal(pbmp);
 	pbmp->use_key_color = bmpf->use_key_color != 0;
 	pbmp->key_color = bmpf->key_color;
+	if (bmpf->use_key_color == 2 && encode_bmp_runs(pbmp) != E_BMP_OK) {
+		ktrace("cannot encode the runs of %s", bmpf->name);
+	}
 	sloti = s_bitmap_files[i].sloti;
 	s_bitmap_slots[sloti].pbmp = pbmp;
 	s_bitmap_slots[sloti].managed = 1;
+	s_bitmap_slots[sloti].pal_id = pal_id;
 
 	s_load_index++;
 	return E_BITMAPS_LOAD_OK;
@@ -158,17 +403,31 @@ void bitmaps_done(void)
 	int i;
 	struct bmp_slot *pbmp_slot;
 
-	for (i = 1; i < NBITMAPS; i++) {
+	for (i = 1; i < s_nbitmap_slots; i++) {
 		pbmp_slot = &s_bitmap_slots[i];
 		if (pbmp_slot->managed) {
 			if (kassert(pbmp_slot->pbmp != NULL)) {
-				free_bmp(pbmp_slot->pbmp, 1);
+				free_bmp(pbmp_slot->pbmp,
+					 pbmp_slot->pal_id == 0);
+				if (pbmp_slot->pal_id != 0)
+					release_pal(pbmp_slot->pal_id);
 				pbmp_slot->pbmp = NULL;
 				pbmp_slot->managed = 0;
+				pbmp_slot->pal_id = 0;
 			}
 		}
 	}
 
+	free(s_pals);
+	s_pals = NULL;
+	s_npals = 0;
+	s_pals_cap = 0;
+	s_pal_free = 0;
+	memset(s_pal_hash, 0, sizeof(s_pal_hash));
+
+	free(s_bitmap_files);
+	s_bitmap_files = NULL;
+	s_bitmap_files_cap = 0;
 	s_nbitmap_files = 0;
 	s_load_index = 0;
 }
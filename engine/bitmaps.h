@@ -31,8 +31,11 @@ enum {
 	E_BITMAPS_BIGFNAME,
 };
 
+/* Slots go from 1 to NBITMAPS - 1; memory is used only for the slots up
+ * to the highest one used.
+ */
 enum {
-	NBITMAPS = 64
+	NBITMAPS = 0x10000
 };
 
 struct bmp;
@@ -45,4 +48,15 @@ void bitmaps_done(void);
 void set_bitmap(int i, struct bmp *pbmp);
 struct bmp *get_bitmap(int i);
 
+/* The bitmaps loaded from the list that have the same palette share it,
+ * and it has an id, so we can make things once per palette. Ids are in
+ * [1, get_npal_ids()[ and are not reused while a bitmap uses them.
+ * get_bitmap_pal_id() returns 0 if the bitmap at slot i has no palette
+ * or does not share it (not from the list, or no memory); get_pal()
+ * returns NULL if the id is not used.
+ */
+int get_bitmap_pal_id(int i);
+const unsigned int *get_pal(int id, int *palsz);
+int get_npal_ids(void);
+
 #endif
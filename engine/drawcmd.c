@@ -0,0 +1,521 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "drawcmd.h"
+#include "engine.h"
+#include "kernel/kernel.h"
+#include "cbase/kassert.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/* Side of the tiles in pixels, and its log2. */
+	TILE_SHIFT = 6,
+	TILE_SIZE = 1 << TILE_SHIFT,
+	/* Number of commands we make room for the first time. */
+	INITIAL_CAP = 256,
+	MAX_HELPERS = 15,
+};
+
+enum {
+	CMD_BMP,
+	CMD_MASK_BMP,
+	CMD_LINE,
+};
+
+/* A recorded drawing.
+ * For the bitmaps, (x0, y0) is the position.
+ * For the lines, (x0, y0) and (x1, y1) are the points.
+ * box: the part of the destination that can be touched, to find the
+ * 	tiles.
+ */
+struct cmd {
+	unsigned char type;
+	unsigned char use_key_color;
+	unsigned char transform;
+	const struct bmp *src;
+	struct rect src_rect;
+	struct rect clip;
+	struct rect box;
+	int x0, y0, x1, y1;
+	unsigned int color;
+};
+
+/* The commands of the frame, kept from frame to frame. */
+static struct cmd *s_cmds;
+static int s_ncmds;
+static int s_cmds_cap;
+
+/* The commands of tile t are s_bins[s_tile_start[t]] to
+ * s_bins[s_tile_start[t + 1] - 1], in order.
+ */
+static int *s_bins;
+static int s_bins_cap;
+static int *s_tile_start;
+static int s_tiles_cap;
+static int s_ntiles_x;
+static int s_ntiles;
+
+static struct bmp *s_dst;
+
+/* Threads that help to draw the tiles. They are started when first
+ * needed and wait until drawcmd_done(), but we only count them as taken
+ * (engine_take_helpers()) while they draw.
+ * s_nworkers: the threads drawing the tiles, including the one that
+ * 	calls drawcmd_end(). Worker i draws the tiles i, i + s_nworkers,
+ * 	i + 2 * s_nworkers... The helper s_helpers[i] is the worker i + 1.
+ * s_helpers_done_sem: posted by each helper when it has drawn its tiles.
+ */
+struct helper {
+	struct kernel_thread *thread;
+	struct kernel_sem *sem;
+	int worker;
+};
+
+static struct helper s_helpers[MAX_HELPERS];
+static int s_nhelpers;
+static int s_nworkers;
+static int s_helpers_quit;
+static struct kernel_sem *s_helpers_done_sem;
+
+/* Returns a new command or NULL if no memory. */
+static struct cmd *add_cmd(void)
+{
+	int n;
+	struct cmd *p;
+
+	if (kassert_fails(s_dst != NULL))
+		return NULL;
+
+	if (s_ncmds == s_cmds_cap) {
+		n = s_cmds_cap == 0 ? INITIAL_CAP : s_cmds_cap * 2;
+		p = realloc(s_cmds, n * sizeof(*p));
+		if (p == NULL) {
+			ktrace("no memory for draw commands");
+			return NULL;
+		}
+		s_cmds = p;
+		s_cmds_cap = n;
+	}
+
+	return &s_cmds[s_ncmds++];
+}
+
+/* Sets the clip of 'cmd' to 'clip', and intersects 'cmd->box' with it
+ * and with the destination. Drops the command if nothing is left.
+ */
+static void clip_cmd(struct cmd *cmd, const struct rect *clip)
+{
+	struct rect r;
+
+	cmd->clip = *clip;
+	r.x = 0;
+	r.y = 0;
+	r.w = s_dst->w;
+	r.h = s_dst->h;
+	rect_intersect(&cmd->clip, &r, &r);
+	rect_intersect(&cmd->box, &r, &cmd->box);
+	if (cmd->box.w <= 0)
+		s_ncmds--;
+}
+
+static void add_bmp_cmd(int type, const struct bmp *src, int dx, int dy,
+			const struct rect *src_rect, int use_key_color,
+			int transform, const struct rect *clip)
+{
+	struct cmd *cmd;
+	struct rect r;
+
+	if (kassert_fails(src != NULL))
+		return;
+
+	cmd = add_cmd();
+	if (cmd == NULL)
+		return;
+
+	cmd->type = type;
+	cmd->use_key_color = use_key_color;
+	cmd->transform = transform;
+	cmd->src = src;
+	if (src_rect == NULL) {
+		cmd->src_rect.x = 0;
+		cmd->src_rect.y = 0;
+		cmd->src_rect.w = src->w;
+		cmd->src_rect.h = src->h;
+	} else {
+		cmd->src_rect = *src_rect;
+	}
+	cmd->x0 = dx;
+	cmd->y0 = dy;
+
+	r.x = 0;
+	r.y = 0;
+	r.w = src->w;
+	r.h = src->h;
+	rect_intersect(&cmd->src_rect, &r, &r);
+	cmd->box.x = dx;
+	cmd->box.y = dy;
+	cmd->box.w = r.w;
+	cmd->box.h = r.h;
+	clip_cmd(cmd, clip);
+}
+
+/* The recorder of draw_bmp_kct. */
+static void record_bmp(const struct bmp *src, int dx, int dy,
+		       const struct rect *src_rect, int use_key_color,
+		       int transform, const struct rect *clip)
+{
+	add_bmp_cmd(CMD_BMP, src, dx, dy, src_rect, use_key_color,
+		    transform, clip);
+}
+
+/* The recorder of draw_mask_bmp. */
+static void record_mask_bmp(const struct bmp *src, int dx, int dy,
+			    const struct rect *src_rect, int transform,
+			    const struct rect *clip)
+{
+	add_bmp_cmd(CMD_MASK_BMP, src, dx, dy, src_rect, 1, transform,
+		    clip);
+}
+
+/* The recorder of draw_line. */
+static void record_line(int x0, int y0, int x1, int y1, unsigned int color,
+			const struct rect *clip)
+{
+	struct cmd *cmd;
+
+	cmd = add_cmd();
+	if (cmd == NULL)
+		return;
+
+	cmd->type = CMD_LINE;
+	cmd->x0 = x0;
+	cmd->y0 = y0;
+	cmd->x1 = x1;
+	cmd->y1 = y1;
+	cmd->color = color;
+	cmd->box.x = x0 < x1 ? x0 : x1;
+	cmd->box.y = y0 < y1 ? y0 : y1;
+	cmd->box.w = abs(x1 - x0) + 1;
+	cmd->box.h = abs(y1 - y0) + 1;
+	clip_cmd(cmd, clip);
+}
+
+/* Grows the bins to 'nbins' commands and the tiles to s_ntiles.
+ * Returns 0 if no memory.
+ */
+static int grow_bins(int nbins)
+{
+	int n;
+	int *p;
+
+	if (nbins > s_bins_cap) {
+		n = s_bins_cap == 0 ? INITIAL_CAP : s_bins_cap;
+		while (n < nbins)
+			n *= 2;
+		p = realloc(s_bins, n * sizeof(*p));
+		if (p == NULL)
+			return 0;
+		s_bins = p;
+		s_bins_cap = n;
+	}
+
+	if (s_ntiles + 1 > s_tiles_cap) {
+		p = realloc(s_tile_start, (s_ntiles + 1) * sizeof(*p));
+		if (p == NULL)
+			return 0;
+		s_tile_start = p;
+		s_tiles_cap = s_ntiles + 1;
+	}
+
+	return 1;
+}
+
+/* Puts the index of each command in the bins of the tiles it touches, in
+ * order. Returns 0 if no memory.
+ */
+static int bin_cmds(void)
+{
+	int i, t, tx, ty, tx0, ty0, tx1, ty1, nbins;
+	const struct cmd *cmd;
+
+	s_ntiles_x = (s_dst->w + TILE_SIZE - 1) >> TILE_SHIFT;
+	s_ntiles = s_ntiles_x * ((s_dst->h + TILE_SIZE - 1) >> TILE_SHIFT);
+
+	/* Count. s_tile_start[t + 1] is the number of commands of t. */
+	nbins = 0;
+	for (i = 0; i < s_ncmds; i++) {
+		cmd = &s_cmds[i];
+		tx0 = cmd->box.x >> TILE_SHIFT;
+		ty0 = cmd->box.y >> TILE_SHIFT;
+		tx1 = (cmd->box.x + cmd->box.w - 1) >> TILE_SHIFT;
+		ty1 = (cmd->box.y + cmd->box.h - 1) >> TILE_SHIFT;
+		nbins += (tx1 - tx0 + 1) * (ty1 - ty0 + 1);
+	}
+
+	if (!grow_bins(nbins)) {
+		ktrace("no memory for draw command bins");
+		return 0;
+	}
+
+	memset(s_tile_start, 0, (s_ntiles + 1) * sizeof(*s_tile_start));
+	for (i = 0; i < s_ncmds; i++) {
+		cmd = &s_cmds[i];
+		tx0 = cmd->box.x >> TILE_SHIFT;
+		ty0 = cmd->box.y >> TILE_SHIFT;
+		tx1 = (cmd->box.x + cmd->box.w - 1) >> TILE_SHIFT;
+		ty1 = (cmd->box.y + cmd->box.h - 1) >> TILE_SHIFT;
+		for (ty = ty0; ty <= ty1; ty++) {
+			for (tx = tx0; tx <= tx1; tx++)
+				s_tile_start[ty * s_ntiles_x + tx + 1]++;
+		}
+	}
+
+	/* Where each tile starts, and then fill, moving the starts to the
+	 * next tile. s_tile_start[t] is where to put the next of t - 1.
+	 */
+	for (t = 1; t <= s_ntiles; t++)
+		s_tile_start[t] += s_tile_start[t - 1];
+	for (t = s_ntiles; t > 0; t--)
+		s_tile_start[t] = s_tile_start[t - 1];
+
+	for (i = 0; i < s_ncmds; i++) {
+		cmd = &s_cmds[i];
+		tx0 = cmd->box.x >> TILE_SHIFT;
+		ty0 = cmd->box.y >> TILE_SHIFT;
+		tx1 = (cmd->box.x + cmd->box.w - 1) >> TILE_SHIFT;
+		ty1 = (cmd->box.y + cmd->box.h - 1) >> TILE_SHIFT;
+		for (ty = ty0; ty <= ty1; ty++) {
+			for (tx = tx0; tx <= tx1; tx++) {
+				t = ty * s_ntiles_x + tx + 1;
+				s_bins[s_tile_start[t]++] = i;
+			}
+		}
+	}
+	s_tile_start[0] = 0;
+
+	return 1;
+}
+
+/* Draws the commands of tile 't'. */
+static void draw_tile(int t)
+{
+	int i, end;
+	const struct cmd *cmd;
+	struct rect tile, clip;
+
+	tile.x = (t % s_ntiles_x) << TILE_SHIFT;
+	tile.y = (t / s_ntiles_x) << TILE_SHIFT;
+	tile.w = TILE_SIZE;
+	tile.h = TILE_SIZE;
+	end = s_tile_start[t + 1];
+	for (i = s_tile_start[t]; i < end; i++) {
+		cmd = &s_cmds[s_bins[i]];
+		switch (cmd->type) {
+		case CMD_BMP:
+			rect_intersect(&cmd->clip, &tile, &clip);
+			draw_bmp_kct_clip(cmd->src, cmd->x0, cmd->y0, s_dst,
+					  &cmd->src_rect, cmd->use_key_color,
+					  cmd->transform, &clip);
+			break;
+		case CMD_MASK_BMP:
+			rect_intersect(&cmd->clip, &tile, &clip);
+			draw_mask_bmp_clip(cmd->src, cmd->x0, cmd->y0, s_dst,
+					   &cmd->src_rect, cmd->transform,
+					   &clip);
+			break;
+		case CMD_LINE:
+			draw_line_clip(s_dst, cmd->x0, cmd->y0, cmd->x1,
+				       cmd->y1, cmd->color, &cmd->clip,
+				       &tile);
+			break;
+		}
+	}
+}
+
+static void draw_tiles(int worker)
+{
+	int t;
+
+	for (t = worker; t < s_ntiles; t += s_nworkers) {
+		draw_tile(t);
+	}
+}
+
+static int help_draw(void *data)
+{
+	const struct kernel_device *kd;
+	const struct helper *h;
+
+	kd = kernel_get_device();
+	h = data;
+	for (;;) {
+		kd->sem_wait(h->sem);
+		if (s_helpers_quit)
+			break;
+		draw_tiles(h->worker);
+		kd->sem_post(s_helpers_done_sem);
+	}
+
+	return 0;
+}
+
+/* Starts helpers until there are 'n', if we can. Returns how many of
+ * them we can use, up to 'n'.
+ */
+static int start_helpers(int n)
+{
+	struct helper *h;
+	const struct kernel_device *kd;
+
+	kd = kernel_get_device();
+	if (s_helpers_done_sem == NULL) {
+		s_helpers_done_sem = kd->create_sem(0);
+		if (s_helpers_done_sem == NULL)
+			return 0;
+	}
+
+	s_helpers_quit = 0;
+	while (s_nhelpers < n) {
+		h = &s_helpers[s_nhelpers];
+		h->worker = s_nhelpers + 1;
+		h->sem = kd->create_sem(0);
+		if (h->sem == NULL)
+			break;
+		h->thread = kd->create_thread(help_draw, h, "draw helper");
+		if (h->thread == NULL) {
+			kd->destroy_sem(h->sem);
+			break;
+		}
+		s_nhelpers++;
+	}
+
+	return s_nhelpers < n ? s_nhelpers : n;
+}
+
+static void stop_helpers(void)
+{
+	int i;
+	const struct kernel_device *kd;
+
+	if (s_helpers_done_sem == NULL)
+		return;
+
+	kd = kernel_get_device();
+	s_helpers_quit = 1;
+	for (i = 0; i < s_nhelpers; i++) {
+		kd->sem_post(s_helpers[i].sem);
+		kd->wait_thread(s_helpers[i].thread);
+		kd->destroy_sem(s_helpers[i].sem);
+	}
+	s_nhelpers = 0;
+	kd->destroy_sem(s_helpers_done_sem);
+	s_helpers_done_sem = NULL;
+}
+
+/* Draws the commands recorded and forgets them. The helpers are taken
+ * only for this, so others can have them the rest of the time.
+ */
+static void flush_cmds(void)
+{
+	int i, ntaken, nhelpers;
+	const struct kernel_device *kd;
+
+	if (s_ncmds > 0 && bin_cmds()) {
+		ntaken = 0;
+		nhelpers = 0;
+		if (!s_serial_mode) {
+			ntaken = s_ntiles - 1;
+			if (ntaken > MAX_HELPERS) {
+				ntaken = MAX_HELPERS;
+			}
+			ntaken = engine_take_helpers(ntaken);
+			if (ntaken > 0) {
+				nhelpers = start_helpers(ntaken);
+			}
+		}
+		s_nworkers = nhelpers + 1;
+
+		kd = kernel_get_device();
+		for (i = 0; i < nhelpers; i++) {
+			kd->sem_post(s_helpers[i].sem);
+		}
+		draw_tiles(0);
+		for (i = 0; i < nhelpers; i++) {
+			kd->sem_wait(s_helpers_done_sem);
+		}
+		engine_give_helpers(ntaken);
+	}
+
+	s_ncmds = 0;
+}
+
+static const struct draw_recorder s_cmd_recorder = {
+	.bmp = record_bmp,
+	.mask_bmp = record_mask_bmp,
+	.line = record_line,
+	.flush = flush_cmds,
+};
+
+void drawcmd_begin(struct bmp *dst)
+{
+	if (kassert_fails(dst != NULL && s_dst == NULL))
+		return;
+
+	/*
+	 * Drawing to palettized bitmaps is not supported yet.
+	 */
+	if (kassert_fails(dst->pal == NULL))
+		return;
+
+	s_dst = dst;
+	s_ncmds = 0;
+	set_draw_recorder(dst, &s_cmd_recorder);
+}
+
+void drawcmd_end(void)
+{
+	if (kassert_fails(s_dst != NULL))
+		return;
+
+	set_draw_recorder(NULL, NULL);
+	flush_cmds();
+	s_dst = NULL;
+}
+
+void drawcmd_done(void)
+{
+	stop_helpers();
+
+	free(s_cmds);
+	s_cmds = NULL;
+	s_cmds_cap = 0;
+	s_ncmds = 0;
+	free(s_bins);
+	s_bins = NULL;
+	s_bins_cap = 0;
+	free(s_tile_start);
+	s_tile_start = NULL;
+	s_tiles_cap = 0;
+	s_dst = NULL;
+}
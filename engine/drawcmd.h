@@ -0,0 +1,47 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef DRAWCMD_H
+#define DRAWCMD_H
+
+#ifndef BMP_H
+#include "gamelib/bmp.h"
+#endif
+
+/* Recorded drawing.
+ *
+ * Between drawcmd_begin(dst) and drawcmd_end(), draw_bmp, draw_bmp_kct,
+ * draw_mask_bmp and draw_line to 'dst' are recorded instead of done, with
+ * the clipping of bmp.h at the time of the call (see set_draw_recorder).
+ * drawcmd_end() sorts the commands by the screen tiles they touch and
+ * draws tile by tile, in the order they were recorded, sharing the tiles
+ * with the helper threads engine_take_helpers() gives us for that. The
+ * bitmaps must not change until drawcmd_end(), and 'dst' must not be
+ * drawn in other ways in between. Only for 'dst' without palette.
+ */
+
+void drawcmd_begin(struct bmp *dst);
+void drawcmd_end(void);
+void drawcmd_done(void);
+
+#endif
@@ -45,6 +45,17 @@ struct bmp s_screen;
 
 int s_screen_valid;
 
+int s_indexed_mode;
+
+int s_serial_mode;
+
+int s_upscale_mode = KERNEL_UPSCALE_AUTO;
+
+double s_draw_alpha = 1;
+
+/* Helper threads started by all, see engine_take_helpers(). */
+static int s_nhelpers_taken;
+
 static void begin_draw(void)
 {
 	const struct kernel_device *d;
@@ -59,25 +70,39 @@ static void begin_draw(void)
 	s_screen.pitch = kcanvas->pitch;
 
 	reset_clip(s_screen.w, s_screen.h);
+	track_dirty(&s_screen);
 	s_screen_valid = 1;
 }
 
+/* Tells the kernel the parts of the screen we have changed. */
 static void end_draw(void)
 {
+	int i, n;
+	const struct rect *rects;
+	struct kernel_rect krects[MAX_DIRTY_RECTS];
+
 	if (kassert_fails(s_screen_valid))
 		return;
 
+	n = get_dirty_rects(&rects);
+	for (i = 0; i < n; i++) {
+		krects[i].x = rects[i].x;
+		krects[i].y = rects[i].y;
+		krects[i].w = rects[i].w;
+		krects[i].h = rects[i].h;
+	}
+	kernel_get_device()->set_dirty_rects(krects, n);
+	track_dirty(NULL);
 	s_screen_valid = 0;
 }
 
+/* Updates the game at FPS. */
 static void on_frame(void *data)
 {
 	const struct kernel_device *kd;
 
 	kd = kernel_get_device();
 
-	begin_draw();
-
 	/*
 	 * The first time, set the first state.
 	 */
@@ -93,7 +118,14 @@ static void on_frame(void *data)
 	if (!s_step_mode || kd->key_first_pressed(KERNEL_KSC_SPACE)) {
 		update_state();
 	}
+}
 
+/* Draws the game as often as the display allows. */
+static void on_draw(void *data, double alpha)
+{
+	begin_draw();
+	s_draw_alpha = alpha;
+	draw_state();
 	end_draw();
 }
 
@@ -110,17 +142,42 @@ static const struct kernel_config kcfg = {
 	.maximized = !PP_DEBUG,
 	.frames_per_second = FPS,
 	.on_frame = on_frame,
+	.on_draw = on_draw,
 	.on_sound = on_sound,
 	.hint_scale_quality = 0,
 	.hint_vsync = 1,
 };
 
+int engine_take_helpers(int n)
+{
+	int left;
+
+	left = kernel_get_device()->get_cpu_count() - 1 - s_nhelpers_taken;
+	if (n > left)
+		n = left;
+	if (n < 0)
+		n = 0;
+	s_nhelpers_taken += n;
+	return n;
+}
+
+void engine_give_helpers(int n)
+{
+	if (kassert_fails(n >= 0 && n <= s_nhelpers_taken))
+		return;
+
+	s_nhelpers_taken -= n;
+}
+
 int engine_run(void)
 {
 	int ret;
 	const struct kernel_device *d;
+	struct kernel_config cfg;
 
+	cfg = kcfg;
+	cfg.upscale = s_upscale_mode;
 	d = kernel_get_device();
-	ret = d->run(&kcfg, NULL);
+	ret = d->run(&cfg, NULL);
 	return ret;
 }
@@ -42,6 +42,36 @@ enum {
 extern struct bmp s_screen; 
 extern int s_screen_valid;
 
+/* If not 0, the game renders palette indexes into an 8 bpp buffer that is
+ * expanded to colors only when drawn on s_screen (--indexed).
+ */
+extern int s_indexed_mode;
+
+/* If not 0, the game draws in the main thread instead of in a render
+ * thread that draws the next frame while the last one is shown
+ * (--serial).
+ */
+extern int s_serial_mode;
+
+/* One of KERNEL_UPSCALE, how the screen is scaled to the window
+ * (--upscale).
+ */
+extern int s_upscale_mode;
+
+/* When drawing, the fraction of a frame passed since the last update, in
+ * range [0..1], to interpolate between the last two updates.
+ */
+extern double s_draw_alpha;
+
+/* The helper threads of the main and the render threads share the cores:
+ * all together they are one less than the cores. Call from the main
+ * thread before putting n helpers to work; returns how many we can use.
+ * Give them back with engine_give_helpers() when they are stopped, or
+ * idle until we take them again.
+ */
+int engine_take_helpers(int n);
+void engine_give_helpers(int n);
+
 int engine_run(void);
 
 #endif
@@ -95,6 +95,7 @@ static void draw(void)
 {
 	unsigned char *pb;
 	int y;
+	struct rect r;
 
 	pb = s_screen.pixels;
 	for (y = 0; y < s_screen.h; y++) {
@@ -102,6 +103,12 @@ static void draw(void)
 		pb += s_screen.pitch;
 	}
 
+	r.x = 0;
+	r.y = 0;
+	r.w = s_screen.w;
+	r.h = s_screen.h;
+	add_dirty_rect(&s_screen, &r);
+
 	draw_loading();
 }
 
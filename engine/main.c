@@ -27,6 +27,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "bitmaps.h"
 #include "sounds.h"
 #include "input.h"
+#include "bench.h"
+#include "drawcmd.h"
 #include "menu.h"
 #include "gamelib/bmp.h"
 #include "gamelib/mixer.h"
@@ -47,15 +49,37 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #endif
 
+#ifndef STRING_H
+#define STRING_H
+#include <string.h>
+#endif
+
 #ifndef TIME_H
 #define TIME_H
 #include <time.h>
 #endif
 
+static void set_upscale_mode(const char *name)
+{
+	if (strcmp(name, "off") == 0) {
+		s_upscale_mode = KERNEL_UPSCALE_OFF;
+	} else if (strcmp(name, "nearest") == 0) {
+		s_upscale_mode = KERNEL_UPSCALE_NEAREST;
+	} else if (strcmp(name, "scale2x") == 0) {
+		s_upscale_mode = KERNEL_UPSCALE_SCALE2X;
+	} else {
+		ktrace("unknown upscale mode %s", name);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	static struct ngetopt_opt ops[] = {
 		{ "editor", 0, 'e' },
+		{ "bench", 0, 'b' },
+		{ "indexed", 0, 'i' },
+		{ "serial", 0, 's' },
+		{ "upscale", 1, 'u' },
 		{ NULL, 0, 0 },
 	};
 
@@ -72,6 +96,18 @@ int main(int argc, char *argv[])
 	do {
 		c = ngetopt_next(&ngo);
 		switch (c) {
+		case 'b':
+			s_bench_mode = 1;
+			break;
+		case 'i':
+			s_indexed_mode = 1;
+			break;
+		case 's':
+			s_serial_mode = 1;
+			break;
+		case 'u':
+			set_upscale_mode(ngo.optarg);
+			break;
 		case '?':
 			ktrace("unrecognized option %s", ngo.optarg);
 			break;
@@ -112,6 +148,7 @@ int main(int argc, char *argv[])
 		s_game_if.done();
 	}
 
+	drawcmd_done();
 	bitmaps_done();
 	sounds_done();
 
@@ -0,0 +1,271 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "actors.h"
+#include "cbase/kassert.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of actors we make room for the first time. */
+enum {
+	INITIAL_CAP = 256,
+};
+
+void actorset_init(struct actorset *as,
+		   void (*move)(double *x, double *y, const double *vx,
+				const double *vy, const double *r, int n))
+{
+	memset(as, 0, sizeof(*as));
+	as->move = move;
+}
+
+void actorset_free(struct actorset *as)
+{
+	free(as->x);
+	free(as->y);
+	free(as->vx);
+	free(as->vy);
+	free(as->r);
+	free(as->sprite);
+	free(as->flags);
+	free(as->bytile);
+	free(as->start);
+	actorset_init(as, as->move);
+}
+
+/* Removes all the actors, but keeps the memory. */
+void actorset_clear(struct actorset *as)
+{
+	as->n = 0;
+	as->dirty = 1;
+}
+
+/* Sets the grid of the tile lists to w * h tiles.
+ * Returns 0 if no memory.
+ */
+int actorset_set_grid(struct actorset *as, int w, int h)
+{
+	int *p;
+
+	if (kassert_fails(w > 0 && h > 0))
+		return 0;
+
+	p = realloc(as->start, (w * h + 1) * sizeof(*as->start));
+	if (p == NULL) {
+		ktrace("no memory for actor tiles");
+		return 0;
+	}
+
+	as->start = p;
+	as->w = w;
+	as->h = h;
+	as->dirty = 1;
+	return 1;
+}
+
+/* Grows the arrays to 'cap' elements. Returns 0 if no memory. */
+static int grow(struct actorset *as, int cap)
+{
+	void *p;
+
+#define GROW(field) \
+	p = realloc(as->field, cap * sizeof(*as->field)); \
+	if (p == NULL) \
+		return 0; \
+	as->field = p;
+
+	GROW(x)
+	GROW(y)
+	GROW(vx)
+	GROW(vy)
+	GROW(r)
+	GROW(sprite)
+	GROW(flags)
+	GROW(bytile)
+
+#undef GROW
+
+	as->cap = cap;
+	return 1;
+}
+
+/* Adds an actor stopped at 'x', 'y', of radius 'r'.
+ * Returns its index, or -1 if no memory or 'r' is not in range (0, 0.5).
+ */
+int actorset_add(struct actorset *as, double x, double y, double r,
+		 int sprite, int flags)
+{
+	int i;
+
+	/* Less than half a tile, as raycast_move_circles() needs. */
+	if (kassert_fails(r > 0 && r < 0.5))
+		return -1;
+
+	if (as->n == as->cap &&
+	    !grow(as, as->cap == 0 ? INITIAL_CAP : as->cap * 2))
+	{
+		ktrace("no memory for actors");
+		return -1;
+	}
+
+	i = as->n++;
+	as->x[i] = x;
+	as->y[i] = y;
+	as->vx[i] = 0;
+	as->vy[i] = 0;
+	as->r[i] = r;
+	as->sprite[i] = sprite;
+	as->flags[i] = flags;
+	as->dirty = 1;
+	return i;
+}
+
+/* Removes actor 'i'. The last actor takes its index. */
+void actorset_remove(struct actorset *as, int i)
+{
+	int last;
+
+	if (kassert_fails(i >= 0 && i < as->n))
+		return;
+
+	last = --as->n;
+	as->x[i] = as->x[last];
+	as->y[i] = as->y[last];
+	as->vx[i] = as->vx[last];
+	as->vy[i] = as->vy[last];
+	as->r[i] = as->r[last];
+	as->sprite[i] = as->sprite[last];
+	as->flags[i] = as->flags[last];
+	as->dirty = 1;
+}
+
+/* Returns the tile of 'x', 'y', or the nearest one if out of the grid. */
+static int tile_at(const struct actorset *as, double x, double y)
+{
+	int tx, ty;
+
+	tx = (int) floor(x);
+	ty = (int) floor(y);
+	if (tx < 0) {
+		tx = 0;
+	} else if (tx >= as->w) {
+		tx = as->w - 1;
+	}
+	if (ty < 0) {
+		ty = 0;
+	} else if (ty >= as->h) {
+		ty = as->h - 1;
+	}
+	return ty * as->w + tx;
+}
+
+/* Makes the tile lists, sorting the actors by tile with a count per
+ * tile, so it costs the same however they are placed.
+ */
+static void sort_by_tile(struct actorset *as)
+{
+	int i, t, nt, sum;
+
+	if (as->start == NULL)
+		return;
+
+	nt = as->w * as->h;
+	memset(as->start, 0, (nt + 1) * sizeof(*as->start));
+	for (i = 0; i < as->n; i++) {
+		as->start[tile_at(as, as->x[i], as->y[i])]++;
+	}
+
+	/* start[t] is where tile t ends for now, and goes back to where
+	 * it starts as we put the actors.
+	 */
+	sum = 0;
+	for (t = 0; t < nt; t++) {
+		sum += as->start[t];
+		as->start[t] = sum;
+	}
+	as->start[nt] = sum;
+
+	for (i = as->n - 1; i >= 0; i--) {
+		t = tile_at(as, as->x[i], as->y[i]);
+		as->bytile[--as->start[t]] = i;
+	}
+
+	as->dirty = 0;
+}
+
+/* Moves the actors one tick and makes the tile lists again. */
+void actorset_update(struct actorset *as)
+{
+	int i;
+
+	if (as->move != NULL) {
+		as->move(as->x, as->y, as->vx, as->vy, as->r, as->n);
+	} else {
+		for (i = 0; i < as->n; i++) {
+			as->x[i] += as->vx[i];
+			as->y[i] += as->vy[i];
+		}
+	}
+
+	sort_by_tile(as);
+}
+
+/* Puts in 'found' the first 'max' actors in the tiles from (tx0, ty0) to
+ * (tx1, ty1), both included, by tile. Returns how many there are, which
+ * can be more than 'max'.
+ */
+int actorset_find(struct actorset *as, int tx0, int ty0, int tx1, int ty1,
+		  int *found, int max)
+{
+	int ty, t, k, n;
+
+	if (as->dirty) {
+		sort_by_tile(as);
+	}
+	if (as->start == NULL)
+		return 0;
+
+	if (tx0 < 0)
+		tx0 = 0;
+	if (ty0 < 0)
+		ty0 = 0;
+	if (tx1 >= as->w)
+		tx1 = as->w - 1;
+	if (ty1 >= as->h)
+		ty1 = as->h - 1;
+	if (tx0 > tx1 || ty0 > ty1)
+		return 0;
+
+	n = 0;
+	for (ty = ty0; ty <= ty1; ty++) {
+		t = ty * as->w;
+		for (k = as->start[t + tx0]; k < as->start[t + tx1 + 1]; k++) {
+			if (n < max) {
+				found[n] = as->bytile[k];
+			}
+			n++;
+		}
+	}
+	return n;
+}
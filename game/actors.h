@@ -0,0 +1,74 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef ACTORS_H
+#define ACTORS_H
+
+/* A set of actors, stored as a structure of arrays, and the ones in
+ * each tile of a grid of w * h tiles.
+ *
+ * Positions and sizes are in tiles. The tile lists are made again after
+ * each move, sorting the actors by tile: the actors of tile t, indexed
+ * y * w + x, are bytile[start[t]] to bytile[start[t + 1] - 1]. Actors out
+ * of the grid are in the nearest tile.
+ *
+ * x, y: position.
+ * vx, vy: what x, y move each tick.
+ * r: radius, for the collisions, in range (0, 0.5).
+ * sprite: bitmap to draw.
+ * flags: whatever the owner decides.
+ * move: if not NULL, moves the actors by vx, vy instead of just adding
+ *	 them, e.g. raycast_move_circles() to collide with the map.
+ */
+struct actorset {
+	int n;
+	int cap;
+	double *x;
+	double *y;
+	double *vx;
+	double *vy;
+	double *r;
+	unsigned short *sprite;
+	unsigned short *flags;
+	int *bytile;
+	int w, h;
+	int *start;
+	int dirty;
+	void (*move)(double *x, double *y, const double *vx,
+		     const double *vy, const double *r, int n);
+};
+
+void actorset_init(struct actorset *as,
+		   void (*move)(double *x, double *y, const double *vx,
+				const double *vy, const double *r, int n));
+void actorset_free(struct actorset *as);
+void actorset_clear(struct actorset *as);
+int actorset_set_grid(struct actorset *as, int w, int h);
+int actorset_add(struct actorset *as, double x, double y, double r,
+		 int sprite, int flags);
+void actorset_remove(struct actorset *as, int i);
+void actorset_update(struct actorset *as);
+int actorset_find(struct actorset *as, int tx0, int ty0, int tx1, int ty1,
+		  int *found, int max);
+
+#endif
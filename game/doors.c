@@ -0,0 +1,195 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "doors.h"
+#include "cbase/kassert.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of doors we make room for the first time. */
+enum {
+	INITIAL_CAP = 64,
+};
+
+void doorset_init(struct doorset *ds,
+		  void (*on_stop)(struct doorset *ds, int i),
+		  void (*on_move)(struct doorset *ds, int i, int xold),
+		  void *data)
+{
+	memset(ds, 0, sizeof(*ds));
+	ds->on_stop = on_stop;
+	ds->on_move = on_move;
+	ds->data = data;
+}
+
+void doorset_free(struct doorset *ds)
+{
+	free(ds->iwall);
+	free(ds->dir);
+	free(ds->xopen);
+	free(ds->target);
+	free(ds->speed);
+	free(ds->delay);
+	free(ds->slot);
+	free(ds->active);
+	doorset_init(ds, ds->on_stop, ds->on_move, ds->data);
+}
+
+/* Removes all the doors, but keeps the memory. */
+void doorset_clear(struct doorset *ds)
+{
+	ds->n = 0;
+	ds->nactive = 0;
+}
+
+/* Grows the arrays to 'cap' elements. Returns 0 if no memory. */
+static int grow(struct doorset *ds, int cap)
+{
+	void *p;
+
+#define GROW(field) \
+	p = realloc(ds->field, cap * sizeof(*ds->field)); \
+	if (p == NULL) \
+		return 0; \
+	ds->field = p;
+
+	GROW(iwall)
+	GROW(dir)
+	GROW(xopen)
+	GROW(target)
+	GROW(speed)
+	GROW(delay)
+	GROW(slot)
+	GROW(active)
+
+#undef GROW
+
+	ds->cap = cap;
+	return 1;
+}
+
+/* Adds a door stopped at 'xopen'.
+ * Returns its index or -1 if no memory.
+ */
+int doorset_add(struct doorset *ds, int iwall, int dir, int xopen)
+{
+	int i;
+
+	if (ds->n == ds->cap &&
+	    !grow(ds, ds->cap == 0 ? INITIAL_CAP : ds->cap * 2))
+	{
+		ktrace("no memory for doors");
+		return -1;
+	}
+
+	i = ds->n++;
+	ds->iwall[i] = iwall;
+	ds->dir[i] = dir;
+	ds->xopen[i] = xopen;
+	ds->target[i] = xopen;
+	ds->speed[i] = 0;
+	ds->delay[i] = 0;
+	ds->slot[i] = -1;
+	return i;
+}
+
+/* Starts moving door 'i' towards 'target' at 'speed' units per tick,
+ * after waiting 'delay' ticks. This is the trigger to open or close.
+ */
+void doorset_move(struct doorset *ds, int i, int target, int speed,
+		  int delay)
+{
+	if (kassert_fails(i >= 0 && i < ds->n && speed > 0))
+		return;
+
+	ds->target[i] = target;
+	ds->speed[i] = speed;
+	ds->delay[i] = delay;
+	if (ds->slot[i] < 0) {
+		ds->slot[i] = ds->nactive;
+		ds->active[ds->nactive++] = i;
+	}
+}
+
+/* Stops door 'i' where it is. */
+void doorset_stop(struct doorset *ds, int i)
+{
+	int last;
+
+	if (kassert_fails(i >= 0 && i < ds->n) || ds->slot[i] < 0)
+		return;
+
+	last = ds->active[--ds->nactive];
+	ds->active[ds->slot[i]] = last;
+	ds->slot[last] = ds->slot[i];
+	ds->slot[i] = -1;
+}
+
+/* Moves one step the active doors, calling on_move for the ones that
+ * move and on_stop for the ones that arrive. Returns the number of doors
+ * that have changed position.
+ */
+int doorset_update(struct doorset *ds)
+{
+	int k, i, x, xold, t, moved;
+
+	/* Backwards, so the doors stopped are replaced by ones already
+	 * updated, and the ones started by on_stop wait until the next
+	 * tick.
+	 */
+	moved = 0;
+	for (k = ds->nactive - 1; k >= 0; k--) {
+		i = ds->active[k];
+		if (ds->delay[i] > 0) {
+			ds->delay[i]--;
+			continue;
+		}
+
+		x = ds->xopen[i];
+		t = ds->target[i];
+		if (x < t) {
+			x += ds->speed[i];
+			if (x > t)
+				x = t;
+		} else if (x > t) {
+			x -= ds->speed[i];
+			if (x < t)
+				x = t;
+		}
+		xold = ds->xopen[i];
+		if (x != xold) {
+			ds->xopen[i] = x;
+			moved++;
+			if (ds->on_move != NULL)
+				ds->on_move(ds, i, xold);
+		}
+
+		if (x == t) {
+			doorset_stop(ds, i);
+			if (ds->on_stop != NULL)
+				ds->on_stop(ds, i);
+		}
+	}
+
+	return moved;
+}
@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef DOORS_H
+#define DOORS_H
+
+/* A set of doors or push walls, stored as a structure of arrays.
+ *
+ * Each one has a position 'xopen' that can be moved towards a target at
+ * some speed. Only the ones moving (the active set) are updated; each
+ * step 'on_move' is called with the old position, if not NULL, and when
+ * one arrives, 'on_stop' is called, which can start another move.
+ *
+ * iwall: index of the wall texture.
+ * dir: the direction, whatever the owner decides (DOOR_DIR_H, ...).
+ * xopen: position.
+ * target: where xopen moves to.
+ * speed: units per tick.
+ * delay: ticks to wait before starting to move.
+ * slot: index in active[], or -1 if not moving.
+ */
+struct doorset {
+	int n;
+	int cap;
+	unsigned short *iwall;
+	unsigned char *dir;
+	unsigned char *xopen;
+	unsigned char *target;
+	unsigned char *speed;
+	unsigned short *delay;
+	int *slot;
+	int *active;
+	int nactive;
+	void (*on_stop)(struct doorset *ds, int i);
+	void (*on_move)(struct doorset *ds, int i, int xold);
+	void *data;
+};
+
+void doorset_init(struct doorset *ds,
+		  void (*on_stop)(struct doorset *ds, int i),
+		  void (*on_move)(struct doorset *ds, int i, int xold),
+		  void *data);
+void doorset_free(struct doorset *ds);
+void doorset_clear(struct doorset *ds);
+int doorset_add(struct doorset *ds, int iwall, int dir, int xopen);
+void doorset_move(struct doorset *ds, int i, int target, int speed,
+		  int delay);
+void doorset_stop(struct doorset *ds, int i);
+int doorset_update(struct doorset *ds);
+
+#endif
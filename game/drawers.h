@@ -0,0 +1,350 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* Template for the wall column and floor span drawers of raycast.c, so
+ * we have one specialized version of each for every combination of flat
+ * or textured floor and ceiling, without testing flags inside the loops.
+ * It is included several times by raycast.c.
+ *
+ * Define always:
+ *
+ *	DRAW_INDEXED: 1 to draw palette indexes into s_buf8_bmps, using the
+ *		      textures remapped to s_frame_pal; 0 to draw colors
+ *		      into s_buf_bmps. It is not undefined at the end.
+ *
+ * To generate a column drawer define:
+ *
+ *	COLUMN_NAME: name of the function.
+ *	COLUMN_FLAT_CEIL: 1 if it must paint the flat ceiling color.
+ *	COLUMN_FLAT_FLOOR: 1 if it must paint the flat floor color.
+ *
+ * To generate a see-through column drawer define:
+ *
+ *	MASKED_NAME: name of the function.
+ *
+ * To generate a span drawer define:
+ *
+ *	SPAN_NAME: name of the function.
+ *	SPAN_CEIL: TEX_NONE or the format of s_ceil_pbmp (TEX_PAL8 or
+ *		   TEX_RGB32; only TEX_PAL8 if DRAW_INDEXED).
+ *	SPAN_FLOOR: TEX_NONE or the format of s_floor_pbmp.
+ *
+ * The macros are undefined at the end.
+ */
+
+#if DRAW_INDEXED
+#define DRAW_PIXEL unsigned char
+#define DRAW_CEIL_COLOR s_ceiling_index
+#define DRAW_FLOOR_COLOR s_floor_index
+#else
+#define DRAW_PIXEL unsigned int
+#define DRAW_CEIL_COLOR s_ceiling_color
+#define DRAW_FLOOR_COLOR s_floor_color
+#endif
+
+#ifdef COLUMN_NAME
+
+/* Draw the column 'col [0-63] of bitmap 'sbmp at column 'x of viewport 'v.
+ * Actually 'col is a bitmap row index, since we have the wall bitmaps
+ * rotated 90 degrees.
+ * 'wh is the desired height to paint the column, so it will be scaled as
+ * needed.
+ * Updates the floor-ceiling visplane.
+ */
+static void COLUMN_NAME(struct view *v, const struct bmp *sbmp, int col,
+			int wh, int x)
+{
+	int y, py, xinc, h;
+	DRAW_PIXEL *dpix;
+	const unsigned char *spix;
+#if !DRAW_INDEXED
+	const unsigned int *spal, *spix32;
+#endif
+	int dpitch;
+
+	if (sbmp == NULL) {
+		sbmp = s_textures[0];
+	}
+
+	h = v->h;
+	dpix = ((DRAW_PIXEL *) v->pixels) + x;
+	dpitch = v->pitch / sizeof(DRAW_PIXEL);
+       
+	if (wh & 1) {
+		wh--;
+	}
+
+	if (wh == 0) {
+		return;
+	}
+
+	xinc = (COLUMNH << COLUMN_FS) / wh;
+	if (wh <= h) {
+		y = (h - wh) >> 1;
+		add_visplane_column(v, x, h - y);
+		x = 0;
+	} else {
+		y = 0;
+		add_visplane_column(v, x, h - y);
+		x = ((wh - h) >> 1) * xinc;
+		wh = h;
+	}
+
+#if COLUMN_FLAT_CEIL
+	for (py = 0; py < y; py++) {
+		*dpix = DRAW_CEIL_COLOR;
+		dpix += dpitch;
+	}
+#else
+	py = y;
+	dpix += dpitch * y;
+#endif
+	py += wh;
+
+	if (sbmp == NULL) {
+		/* Color 0 is black, also in s_frame_pal. */
+		while (wh > 0) {
+			*dpix = 0;
+			dpix += dpitch;
+			wh--;
+		}
+	} else {
+		x = ((col * COLUMNH) << COLUMN_FS) + x;
+		spix = sbmp->pixels;
+#if DRAW_INDEXED
+		while (wh > 0) {
+			*dpix = spix[x >> COLUMN_FS];
+			dpix += dpitch;
+			x += xinc;
+			wh--;
+		}
+#else
+		spal = sbmp->pal;
+		spix32 = (const unsigned int *) spix;
+		if (spal != NULL) {
+			while (wh > 0) {
+				*dpix = spal[spix[x >> COLUMN_FS]];
+				dpix += dpitch;
+				x += xinc;
+				wh--;
+			}
+		} else {
+			while (wh > 0) {
+				*dpix = spix32[x >> COLUMN_FS];
+				dpix += dpitch;
+				x += xinc;
+				wh--;
+			}
+		}
+#endif
+	}
+
+#if COLUMN_FLAT_FLOOR
+	while (py < h) {
+		*dpix = DRAW_FLOOR_COLOR;
+		dpix += dpitch;
+		py++;
+	}
+#endif
+}
+
+#undef COLUMN_NAME
+#undef COLUMN_FLAT_CEIL
+#undef COLUMN_FLAT_FLOOR
+
+#endif
+
+#ifdef MASKED_NAME
+
+/* Like the column drawers, but for a see-through wall over what is
+ * already drawn: the pixels of the key color of 'sbmp are not painted,
+ * and the ceiling, the floor and the visplane are left as they are.
+ * 'sbmp must have a key color.
+ */
+static void MASKED_NAME(struct view *v, const struct bmp *sbmp, int col,
+			int wh, int x)
+{
+	int y, xinc, h;
+	DRAW_PIXEL *dpix;
+	const unsigned char *spix;
+	const unsigned int *spal;
+	unsigned int key;
+#if !DRAW_INDEXED
+	unsigned int c;
+	const unsigned int *spix32;
+#endif
+	int dpitch;
+
+	h = v->h;
+	dpix = ((DRAW_PIXEL *) v->pixels) + x;
+	dpitch = v->pitch / sizeof(DRAW_PIXEL);
+
+	if (wh & 1) {
+		wh--;
+	}
+
+	if (wh == 0) {
+		return;
+	}
+
+	xinc = (COLUMNH << COLUMN_FS) / wh;
+	if (wh <= h) {
+		y = (h - wh) >> 1;
+		x = 0;
+	} else {
+		y = 0;
+		x = ((wh - h) >> 1) * xinc;
+		wh = h;
+	}
+
+	dpix += dpitch * y;
+	x = ((col * COLUMNH) << COLUMN_FS) + x;
+	spix = sbmp->pixels;
+	spal = sbmp->pal;
+	key = sbmp->key_color;
+#if DRAW_INDEXED
+	/* The key color is a color, not an index. */
+	while (wh > 0) {
+		if (spal[spix[x >> COLUMN_FS]] != key) {
+			*dpix = spix[x >> COLUMN_FS];
+		}
+		dpix += dpitch;
+		x += xinc;
+		wh--;
+	}
+#else
+	spix32 = (const unsigned int *) spix;
+	if (spal != NULL) {
+		while (wh > 0) {
+			c = spal[spix[x >> COLUMN_FS]];
+			if (c != key) {
+				*dpix = c;
+			}
+			dpix += dpitch;
+			x += xinc;
+			wh--;
+		}
+	} else {
+		while (wh > 0) {
+			c = spix32[x >> COLUMN_FS];
+			if (c != key) {
+				*dpix = c;
+			}
+			dpix += dpitch;
+			x += xinc;
+			wh--;
+		}
+	}
+#endif
+}
+
+#undef MASKED_NAME
+
+#endif
+
+#ifdef SPAN_NAME
+
+/* Draws scan at (x=[ax, bx[, y) of viewport 'v */
+static void SPAN_NAME(const struct view *v, int ax, int bx, int y,
+		      real xp, real yp, real dx, real dy)
+{
+	int ui, vi, ti;
+#if SPAN_FLOOR != TEX_NONE
+	DRAW_PIXEL *fpix;
+#endif
+#if SPAN_FLOOR == TEX_PAL8
+	const unsigned char *fspix;
+#if !DRAW_INDEXED
+	const unsigned int *fspal;
+#endif
+#elif SPAN_FLOOR == TEX_RGB32
+	const unsigned int *fspix;
+#endif
+#if SPAN_CEIL != TEX_NONE
+	DRAW_PIXEL *cpix;
+#endif
+#if SPAN_CEIL == TEX_PAL8
+	const unsigned char *cspix;
+#if !DRAW_INDEXED
+	const unsigned int *cspal;
+#endif
+#elif SPAN_CEIL == TEX_RGB32
+	const unsigned int *cspix;
+#endif
+
+#if SPAN_FLOOR != TEX_NONE
+	fpix = (DRAW_PIXEL *) (v->pixels + y * v->pitch) + ax;
+#endif
+#if SPAN_FLOOR == TEX_PAL8
+	fspix = s_floor_pbmp->pixels;
+#if !DRAW_INDEXED
+	fspal = s_floor_pbmp->pal;
+#endif
+#elif SPAN_FLOOR == TEX_RGB32
+	fspix = (const unsigned int *) s_floor_pbmp->pixels;
+#endif
+#if SPAN_CEIL != TEX_NONE
+	cpix = (DRAW_PIXEL *) (v->pixels + (v->h - y - 1) * v->pitch) + ax;
+#endif
+#if SPAN_CEIL == TEX_PAL8
+	cspix = s_ceil_pbmp->pixels;
+#if !DRAW_INDEXED
+	cspal = s_ceil_pbmp->pal;
+#endif
+#elif SPAN_CEIL == TEX_RGB32
+	cspix = (const unsigned int *) s_ceil_pbmp->pixels;
+#endif
+
+	while (ax < bx) {
+		ui = rtoi(xp) & GRIDM; 
+		vi = rtoi(yp) & GRIDM; 
+		ti = (vi << GRIDS) + ui;
+#if SPAN_FLOOR == TEX_PAL8 && DRAW_INDEXED
+		*fpix++ = fspix[ti];
+#elif SPAN_FLOOR == TEX_PAL8
+		*fpix++ = fspal[fspix[ti]];
+#elif SPAN_FLOOR == TEX_RGB32
+		*fpix++ = fspix[ti];
+#endif
+#if SPAN_CEIL == TEX_PAL8 && DRAW_INDEXED
+		*cpix++ = cspix[ti];
+#elif SPAN_CEIL == TEX_PAL8
+		*cpix++ = cspal[cspix[ti]];
+#elif SPAN_CEIL == TEX_RGB32
+		*cpix++ = cspix[ti];
+#endif
+		xp += dx;
+		yp += dy;
+		ax++;
+	}
+}
+
+#undef SPAN_NAME
+#undef SPAN_CEIL
+#undef SPAN_FLOOR
+
+#endif
+
+#undef DRAW_PIXEL
+#undef DRAW_CEIL_COLOR
+#undef DRAW_FLOOR_COLOR
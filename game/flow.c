@@ -0,0 +1,237 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "flow.h"
+#include "cbase/kassert.h"
+#include <stdlib.h>
+#include <string.h>
+
+void flowmap_init(struct flowmap *fm)
+{
+	int f;
+
+	memset(fm, 0, sizeof(*fm));
+	for (f = 0; f < FLOW_NFIELDS; f++) {
+		fm->goal[f] = -1;
+	}
+}
+
+void flowmap_free(struct flowmap *fm)
+{
+	int f;
+
+	free(fm->pass);
+	free(fm->queue);
+	for (f = 0; f < FLOW_NFIELDS; f++) {
+		free(fm->dist[f]);
+		free(fm->dir[f]);
+	}
+	flowmap_init(fm);
+}
+
+/* Makes room for a grid of w * h tiles, all not passable, and forgets the
+ * fields. Returns 0 if no memory.
+ */
+int flowmap_reset(struct flowmap *fm, int w, int h)
+{
+	int f, n;
+
+	flowmap_free(fm);
+	n = w * h;
+	if (kassert_fails(w > 0 && h > 0 && n < FLOW_FAR))
+		return 0;
+
+	fm->w = w;
+	fm->h = h;
+	fm->pass = calloc(n, 1);
+	fm->queue = malloc(n * sizeof(*fm->queue));
+	if (fm->pass == NULL || fm->queue == NULL)
+		goto nomem;
+	for (f = 0; f < FLOW_NFIELDS; f++) {
+		fm->dist[f] = malloc(n * sizeof(*fm->dist[f]));
+		fm->dir[f] = malloc(n);
+		if (fm->dist[f] == NULL || fm->dir[f] == NULL)
+			goto nomem;
+	}
+	return 1;
+
+nomem:
+	ktrace("no memory for flow fields");
+	flowmap_free(fm);
+	return 0;
+}
+
+/* If 'v' is passable and can be reached in less than its steps by
+ * moving in 'dir' to a tile at 'd' - 1 steps, puts it in the queue.
+ */
+static void reach(struct flowmap *fm, int f, int v, int d, int dir,
+		  int *tail)
+{
+	if (fm->pass[v] && fm->dist[f][v] > d) {
+		fm->dist[f][v] = d;
+		fm->dir[f][v] = dir;
+		fm->queue[(*tail)++] = v;
+	}
+}
+
+/* Breadth first from the 'tail' tiles in the queue, which must have all
+ * the same steps, lowering the steps of the tiles around.
+ */
+static void spread(struct flowmap *fm, int f, int tail)
+{
+	int head, u, x, d, w, n;
+
+	w = fm->w;
+	n = w * fm->h;
+	head = 0;
+	while (head < tail) {
+		u = fm->queue[head++];
+		d = fm->dist[f][u] + 1;
+		x = u % w;
+		if (x > 0)
+			reach(fm, f, u - 1, d, FLOW_RIGHT, &tail);
+		if (x < w - 1)
+			reach(fm, f, u + 1, d, FLOW_LEFT, &tail);
+		if (u >= w)
+			reach(fm, f, u - w, d, FLOW_DOWN, &tail);
+		if (u + w < n)
+			reach(fm, f, u + w, d, FLOW_UP, &tail);
+	}
+}
+
+static void build(struct flowmap *fm, int f)
+{
+	int goal, n;
+
+	n = fm->w * fm->h;
+	memset(fm->dist[f], 0xff, n * sizeof(*fm->dist[f]));
+	memset(fm->dir[f], FLOW_NONE, n);
+	fm->dirty[f] = 0;
+	goal = fm->goal[f];
+	if (fm->pass[goal]) {
+		fm->dist[f][goal] = 0;
+		fm->queue[0] = goal;
+		spread(fm, f, 1);
+	}
+}
+
+/* Sets the steps of the tile 't', just opened, from its neighbours, and
+ * then of the tiles that are nearer the goal now.
+ */
+static void open_tile(struct flowmap *fm, int f, int t)
+{
+	int x, d, dir, w, n;
+	const unsigned short *dist;
+
+	if (t == fm->goal[f]) {
+		build(fm, f);
+		return;
+	}
+
+	w = fm->w;
+	n = w * fm->h;
+	x = t % w;
+	dist = fm->dist[f];
+	d = FLOW_FAR;
+	dir = FLOW_NONE;
+	if (x < w - 1 && dist[t + 1] < d) {
+		d = dist[t + 1];
+		dir = FLOW_RIGHT;
+	}
+	if (t >= w && dist[t - w] < d) {
+		d = dist[t - w];
+		dir = FLOW_UP;
+	}
+	if (x > 0 && dist[t - 1] < d) {
+		d = dist[t - 1];
+		dir = FLOW_LEFT;
+	}
+	if (t + w < n && dist[t + w] < d) {
+		d = dist[t + w];
+		dir = FLOW_DOWN;
+	}
+	if (dir != FLOW_NONE && d + 1 < dist[t]) {
+		fm->dist[f][t] = d + 1;
+		fm->dir[f][t] = dir;
+		fm->queue[0] = t;
+		spread(fm, f, 1);
+	}
+}
+
+/* Sets if tile 't' is passable and updates the fields. */
+void flowmap_set_passable(struct flowmap *fm, int t, int pass)
+{
+	int f;
+
+	if (kassert_fails(t >= 0 && t < fm->w * fm->h))
+		return;
+
+	pass = pass != 0;
+	if (fm->pass[t] == pass)
+		return;
+
+	fm->pass[t] = pass;
+	for (f = 0; f < FLOW_NFIELDS; f++) {
+		if (fm->goal[f] < 0 || fm->dirty[f])
+			continue;
+		if (pass) {
+			open_tile(fm, f, t);
+		} else if (fm->dist[f][t] != FLOW_FAR) {
+			/* Going around can be longer for many tiles. */
+			fm->dirty[f] = 1;
+		}
+	}
+}
+
+/* Returns the index of the field for tile 'goal' in dist[] and dir[],
+ * building it if needed. It is valid until the fields of other
+ * FLOW_NFIELDS goals are asked.
+ */
+int flowmap_get(struct flowmap *fm, int goal)
+{
+	int f, oldest;
+
+	kasserta(goal >= 0 && goal < fm->w * fm->h);
+
+	oldest = 0;
+	for (f = 0; f < FLOW_NFIELDS; f++) {
+		if (fm->goal[f] == goal)
+			break;
+		if (fm->goal[f] < 0 || (fm->goal[oldest] >= 0 &&
+					fm->used[f] < fm->used[oldest]))
+		{
+			oldest = f;
+		}
+	}
+
+	if (f == FLOW_NFIELDS) {
+		f = oldest;
+		fm->goal[f] = goal;
+		fm->dirty[f] = 1;
+	}
+	fm->used[f] = ++fm->clock;
+	if (fm->dirty[f]) {
+		build(fm, f);
+	}
+	return f;
+}
@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef FLOW_H
+#define FLOW_H
+
+enum {
+	/* Number of goals we keep the fields for. */
+	FLOW_NFIELDS = 8,
+	/* dist of a tile from where the goal cannot be reached. */
+	FLOW_FAR = 0xffff,
+};
+
+/* Where to move from a tile: to the tile on the right (x + 1), up
+ * (y - 1), left or down. FLOW_NONE on the goal or if it can't be reached.
+ */
+enum {
+	FLOW_NONE,
+	FLOW_RIGHT,
+	FLOW_UP,
+	FLOW_LEFT,
+	FLOW_DOWN,
+};
+
+/* Flow fields over a grid of w * h tiles, indexed as y * w + x, so any
+ * number of actors can find their way to the same goal for the cost of
+ * one search.
+ *
+ * The field of a goal tile has, for each tile, the steps to the goal
+ * along a shortest path through the passable tiles, moving to one of the
+ * 4 neighbours at each step, and the direction of that move. The fields of
+ * the last FLOW_NFIELDS goals asked are kept. When a tile opens they are
+ * updated from it at once; when a tile on the way closes they are built
+ * again the next time they are asked.
+ *
+ * pass: 1 for each passable tile.
+ * queue: room for the search.
+ * goal: goal tile of each field, or -1 if not used.
+ * dirty: 1 if the field must be built again.
+ * used: when the field was asked the last time, to reuse the oldest.
+ * dist: steps to the goal for each tile, FLOW_FAR if it can't be reached.
+ * dir: FLOW_RIGHT... for each tile.
+ */
+struct flowmap {
+	int w, h;
+	unsigned char *pass;
+	int *queue;
+	int goal[FLOW_NFIELDS];
+	unsigned char dirty[FLOW_NFIELDS];
+	unsigned int used[FLOW_NFIELDS];
+	unsigned short *dist[FLOW_NFIELDS];
+	unsigned char *dir[FLOW_NFIELDS];
+	unsigned int clock;
+};
+
+void flowmap_init(struct flowmap *fm);
+void flowmap_free(struct flowmap *fm);
+int flowmap_reset(struct flowmap *fm, int w, int h);
+void flowmap_set_passable(struct flowmap *fm, int tile, int pass);
+int flowmap_get(struct flowmap *fm, int goal);
+
+#endif
@@ -49,8 +49,14 @@ static void enter(const struct state *old_state)
 	raycast_init();
 }
 
+static void leave(const struct state *new_state)
+{
+	raycast_done();
+}
+
 const struct state gplay_st = {
 	.enter = enter,
+	.leave = leave,
 	.update = update,
 	.draw = draw,
 };
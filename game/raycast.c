@@ -22,35 +22,58 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #include "raycast.h"
+#include "real.h"
 #include "engine/engine.h"
 #include "engine/bitmaps.h"
 #include "engine/input.h"
+#include "engine/bench.h"
+#include "engine/drawcmd.h"
+#include "doors.h"
+#include "flow.h"
+#include "actors.h"
 #include "gamelib/bmp.h"
+#include "gamelib/font.h"
+#include "kernel/kernel.h"
 #include "cbase/cbase.h"
 #include "cbase/kassert.h"
-#include "cbase/floatint.h"
 #include "cfg/cfg.h"
 #include <math.h>
-#include <float.h>
-#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-/* Tiles in map:
+#if PP_SIMD && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define USE_X86_SIMD 0
+#endif
+
+/* Tiles in map (16 bits):
  *
- * Empty: 0000 0000
+ * Empty: 0000 0000 0000 0000
  *
- * Wall: 00ii iiii
+ * Wall: 00ii iiii iiii iiii
  *        i: wall index in s_walls[]. Note that this starts at 1, so
  *           s_walls[0] is never addressed.
  *
- * Doors: 10ii iiii
+ * Doors: 10ii iiii iiii iiii
  *        i: at map loading, contains index in s_walls[].
  *           When prepared in prepare_map_doors(), contains door index in
- *           s_doors[].
+ *           s_doors.
  *
- * Push walls: 01ii iiii
+ * Push walls: 01ii iiii iiii iiii
  *        i: index in s_walls[]. When prepared in prepare_map_pwalls(),
- *           contains push wall index in s_pwalls[].
+ *           contains push wall index in s_pwalls.
+ *
+ * Diagonal walls: 11rd iiii iiii iiii
+ *        A wall from one corner of the tile to the opposite one. The
+ *        half on the up (d = 0) or down (d = 1) side, and on the left
+ *        (r = 0) or right (r = 1) side, is solid.
+ *        i: index in s_walls[]. The diagonal has the FACE_H texture.
+ *
+ * Each wall has the texture of its horizontal and vertical faces, as
+ * indexes in s_textures[].
  */
 
 enum {
@@ -59,10 +82,7 @@ enum {
 	BMP_CEIL = 3,
 	BMP_FLOOR = 4,
 	BMP_DOOR = 5,
-	/* decimal bits */
-	FS = 14,
-	FONE = 1 << FS,
-	DOT5 = 1 << (FS - 1),
+	BMP_GRATE = 6,
 	FOV = 60,
 	FOV_D2 = FOV >> 1,
 	RAYS = SCRW,
@@ -91,101 +111,260 @@ enum {
 	DST_PLANE = 277,
 	WALK_SPEED = 3,
 	TURN_SPEED = 8,
-	NWALLS = 64,
-	NDOORS = 64,
-	NPWALLS = 64,
-
-	TILE_TYPE_MASK = 0xc0,
+	/* How near the player can get to the walls. */
+	PLAYER_RADIUS = GRIDW / 4,
+	/* As many as the tile index can address. */
+	NWALLS = 0x4000,
+	NDOORS = NWALLS,
+	NPWALLS = NWALLS,
+
+	TILE_TYPE_MASK = 0xc000,
 	EMPTY_TILE = 0,
-	WALL_TILE = 0x00,
-	DOOR_TILE = 0x80,
-	PWALL_TILE = 0x40,
-
-	WALL_INDEX = 0x3f,
+	WALL_TILE = 0x0000,
+	DOOR_TILE = 0x8000,
+	PWALL_TILE = 0x4000,
+	DIAG_TILE = 0xc000,
+	DIAG_RIGHT = 0x2000,
+	DIAG_DOWN = 0x1000,
+	DIAG_INDEX = 0x0fff,
+
+	WALL_INDEX = NWALLS - 1,
 	DOOR_DIR_H = 0,
 	DOOR_DIR_V = 1,
 	DOOR_INDEX = WALL_INDEX,
 	PWALL_INDEX = WALL_INDEX,
+
+	/* Faces of a wall. */
+	FACE_H = 0,
+	FACE_V = 1,
 };
 
-/* Image buffer pixels. */
-static unsigned int s_buf_pixels[SCRW * SCRH];
-
-/* Image buffer bmp. */
-static struct bmp s_buf_bmp = {
-	.w = SCRW,
-	.h = SCRH,
-	.pitch = SCRW * 4,
-	.palsz = 0,
-	.pal = NULL,
-	.use_key_color = 0,
-	.key_color = 0,
-	.pixels = (unsigned char *) s_buf_pixels
+/* We draw into one image buffer while the other is presented. */
+enum {
+	NBUFS = 2,
 };
 
+/* Image buffers pixels. */
+static unsigned int s_buf_pixels[NBUFS][SCRW * SCRH];
+
+/* Image buffers bmps, set in init_bufs(). */
+static struct bmp s_buf_bmps[NBUFS];
+
+/* Palette of s_buf8_bmps, shared by the textures remapped for it.
+ * Color 0 is black.
+ */
+static unsigned int s_frame_pal[256];
+static int s_frame_palsz;
+
+/* Image buffers pixels in indexed mode. */
+static unsigned char s_buf8_pixels[NBUFS][SCRW * SCRH];
+
+/* Image buffers bmps in indexed mode. */
+static struct bmp s_buf8_bmps[NBUFS];
+
+/* If we are drawing into s_buf8_bmps. */
+static int s_indexed;
+
+/* s_drawi: the buffer we draw into.
+ * s_showi: the buffer with the last frame drawn, the one we present.
+ * s_buf_indexed: for each buffer, if the frame is in s_buf8_bmps.
+ */
+static int s_drawi;
+static int s_showi;
+static unsigned char s_buf_indexed[NBUFS];
+
+/* The number of viewports drawn into each buffer, written by the render
+ * thread. The one of s_showi is 0 if they have changed since.
+ */
+static int s_buf_nviews[NBUFS];
+
+/* Unless in serial mode, frames are drawn by a render thread while the
+ * main thread presents the last one and runs the next update.
+ * s_frame_sem is posted to start a frame, s_done_sem when it is drawn.
+ * s_drawing: if the render thread is drawing a frame.
+ */
+static struct kernel_thread *s_render_thread;
+static struct kernel_sem *s_frame_sem;
+static struct kernel_sem *s_done_sem;
+static int s_drawing;
+static int s_render_quit;
+
 /* position and viewing angle of the player */
 static int view_angle;
-static float view_x, view_y;
+static real view_x, view_y;
+
+/* The same at the start of the last update, to interpolate. */
+static int s_prev_angle;
+static real s_prev_x, s_prev_y;
+
+/* Position and viewing angle we are drawing from. */
+struct camera {
+	real x, y;
+	int angle;
+};
 
-static struct visplane {
+/* The player camera we draw from. */
+static struct camera s_cam;
+
+struct visplane {
 	int xmin, xmax, ymin;
 	short ys[SCRW];
-} s_visplane;
+};
+
+/* See-through walls, those with a texture with a key color, do not stop
+ * the rays. Each column keeps the MAX_LAYERS nearest ones in front of
+ * the solid wall, to draw them over it from back to front.
+ */
+enum {
+	MAX_LAYERS = 4,
+};
+
+/* What a ray hits.
+ * d: distance along the view direction, as in zbuf.
+ * tx, ty: the tile.
+ * face: FACE_H if the ray entered the tile through an horizontal side,
+ * 	else FACE_V.
+ * tex: index in s_textures.
+ * col: column of the texture.
+ */
+struct hit {
+	real d;
+	int tx, ty;
+	int face;
+	int tex;
+	int col;
+};
+
+/* The layers of a column, nearest first. */
+struct layers {
+	int n;
+	struct hit l[MAX_LAYERS];
+};
+
+/* A viewport. Each one has its own zbuf, visplane, layers and hits, so
+ * they can be drawn at the same time.
+ * cam: s_cam if it follows the player.
+ * afov: field of view in angle units.
+ * dst_plane: distance to the projection plane, in pixels.
+ * x0, y0, w, h: rectangle in the image buffer.
+ * pixels, pitch: first pixel of the rectangle in the buffer we draw into,
+ * 	and its pitch, set when drawing.
+ * layers: the see-through walls of each column, set by draw_walls().
+ * hits: for each image buffer, the solid wall hit on each column when it
+ * 	was drawn, kept for raycast_get_hit().
+ */
+struct view {
+	struct camera cam;
+	int follow;
+	int afov;
+	int dst_plane;
+	int x0, y0, w, h;
+	unsigned char *pixels;
+	int pitch;
+	real zbuf[SCRW];
+	struct visplane visplane;
+	struct layers layers[SCRW];
+	struct hit hits[NBUFS][SCRW];
+};
+
+static struct view s_views[RAYCAST_MAX_VIEWPORTS];
+static int s_nviews;
+
+/* Threads that help the render thread to draw the viewports.
+ * s_nworkers: the threads drawing the current frame, including the one
+ * 	that calls draw(). Worker i draws the viewports i, i + s_nworkers,
+ * 	i + 2 * s_nworkers... The helper s_helpers[i] is the worker i + 1.
+ * s_helpers_done_sem: posted by each helper when it has drawn its part.
+ */
+struct helper {
+	struct kernel_thread *thread;
+	struct kernel_sem *sem;
+	int worker;
+};
 
-static float s_zbuf[SCRW];
+static struct helper s_helpers[RAYCAST_MAX_VIEWPORTS - 1];
+static int s_nhelpers;
+static int s_nworkers;
+static struct kernel_sem *s_helpers_done_sem;
+
+/* What the helpers do when posted: draw_views(), or check_los_part()
+ * when the render thread is not drawing.
+ */
+static void (*s_helpers_job)(int worker);
 
+/* tex: index in s_textures for each face (FACE_H, FACE_V). */
 struct wall {
-	struct bmp *pbmp;
+	unsigned short tex[2];
 };
 
-static struct wall s_walls[NWALLS];
+static struct wall *s_walls;
+static int s_nwalls;
 
-/* Door instance.
+/* Wall textures. There is always at least one. */
+static struct bmp **s_textures;
+static int s_ntextures;
+
+/* Doors.
  * iwall: s_wall index. iwall + 1: index for sides.
  * xopen: how much is open, 0 is fully open, GRIDW fully closed.
  * dir: DOOR_DIR_H or DOOR_DIR_V.
  */
-struct door {
-	unsigned char iwall;
-	unsigned char xopen;
-	unsigned char dir;
-};
+static struct doorset s_doors;
 
-static struct door s_doors[NDOORS];
-static int s_ndoors;
-
-/* Push wall instance.
+/* Push walls.
  * iwall: s_wall index.
  * xopen: how much is open, 0 is fully open, GRIDW fully closed.
  * dir: DOOR_DIR_H or DOOR_DIR_V.
  */
-struct pwall {
-	unsigned char iwall;
-	unsigned char xopen;
-	unsigned char dir;
-};
+static struct doorset s_pwalls;
 
-static struct pwall s_pwalls[NPWALLS];
-static int s_npwalls;
+/* xopen of s_doors and s_pwalls for the frame we draw, copied when the
+ * frame starts, because the updates move them while we draw.
+ */
+static unsigned char *s_door_xopen;
+static unsigned char *s_pwall_xopen;
+
+/* Tile index of each door of s_doors and push wall of s_pwalls. */
+static unsigned short s_door_tiles[MAPSZ];
+static unsigned short s_pwall_tiles[MAPSZ];
+
+/* Ways to the goals of the actors, see raycast_get_flow(). */
+static struct flowmap s_flow;
+
+/* The actors, moved by raycast_move_circles(). */
+static struct actorset s_actors;
 
 static struct bmp *s_ceil_pbmp;
 static struct bmp *s_floor_pbmp;
 
-static unsigned char s_map[] = {
+static const unsigned short s_demo_map[] = {
 	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 1,
-	1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 0x82, 1,
+	1, 0xc001, 0, 0, 0, 0, 0xe001, 1, 0, 0, 0, 0, 0, 0, 1,
+	1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 0x8002, 1,
 	1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0, 0, 0, 1,
-	1, 0, 0, 0, 0, 0, 0, 0x82, 0, 0, 0, 0, 0, 0, 1,
-	1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
-	1, 0, 0, 0, 0, 0, 0, 0x41, 0, 0, 1, 1, 1, 1, 1,
+	1, 0, 4, 0, 0, 0, 0, 0x8002, 0, 0, 0, 0, 0, 0, 1,
+	1, 0, 0, 0, 0, 0, 0, 1, 4, 4, 1, 1, 1, 1, 1,
+	1, 0xd001, 0, 0, 0, 0, 0, 0x4001, 0, 0, 1, 1, 1, 1, 1,
 	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
 };
 
-static float sintab[NANGLES];
-static float isintab[NANGLES];
-static float tantab[NANGLES];
-static float itantab[NANGLES];
+/* Bitmaps of the textures of the demo map. */
+static const unsigned char s_demo_textures[] = {
+	BMP_WALL, BMP_WALL2, BMP_DOOR, BMP_GRATE
+};
+
+/* Textures of the faces of the walls of the demo map. */
+static const struct wall s_demo_walls[] = {
+	{ { 0, 0 } }, { { 1, 1 } }, { { 2, 2 } }, { { 0, 0 } }, { { 3, 3 } }
+};
+
+/* The map, prepared from s_demo_map. */
+static unsigned short s_map[MAPSZ];
+
+static real sintab[NANGLES];
+static real isintab[NANGLES];
+static real tantab[NANGLES];
+static real itantab[NANGLES];
 
 enum {
 	STATE_IDLE,
@@ -210,14 +389,65 @@ static int s_flat_ceiling = 0;
 static int s_flat_floor = 0;
 static unsigned int s_ceiling_color = 0xff00;
 static unsigned int s_floor_color = 0xff;
+static unsigned char s_ceiling_index;
+static unsigned char s_floor_index;
+
+/* Sets of textures we can draw with: the textures as loaded (8 bpp with
+ * palette), 32 bpp copies of them, and 8 bpp copies remapped to
+ * s_frame_pal for the indexed mode.
+ *
+ * In benchmark mode we alternate between them on each full turn, to
+ * compare the palette indirection against the bigger texture footprint,
+ * and both against writing 8 bpp pixels.
+ */
+enum {
+	TEXSET_PAL8,
+	TEXSET_RGB32,
+	TEXSET_INDEXED,
+	NTEXSETS
+};
+
+/* textures: as many as s_textures when made, ntextures.
+ * ready: if it has been made.
+ * indexed: if it is for s_buf8_bmps.
+ */
+struct texset {
+	struct bmp **textures;
+	int ntextures;
+	struct bmp *ceil_pbmp;
+	struct bmp *floor_pbmp;
+	unsigned char ready;
+	unsigned char indexed;
+};
+
+static struct texset s_texsets[NTEXSETS];
+static struct bench s_draw_benches[NTEXSETS];
+static struct bench s_present_benches[NTEXSETS];
+static int s_texseti;
+
+/* Set by the update when the benchmark has made a full turn. */
+static int s_bench_turned;
+
+/* In benchmark mode, the frames per second are shown over the view,
+ * counted each BENCH_FPS_MS.
+ */
+enum {
+	BENCH_FPS_MS = 500
+};
 
-static float s_diaglen;
+static struct font *s_bench_font;
+static char s_bench_text[64];
+static double s_bench_t0;
+static int s_bench_frames;
 
 #define PI 0x1.921fb54442d18p+1 
 
 #define toradians(degrees) ((degrees) * PI / 180.0)
 
 static void draw(void);
+static int help_draw(void *data);
+static void set_los_tile(int i);
+static void set_los_tiles(void);
 
 static int fixangle(int a)
 {
@@ -230,36 +460,52 @@ static int fixangle(int a)
 	return a;
 }
 
-// fill the first quadrant of sintab [0-90]
-static void start_tables(void)
+// fill the first quadrant of dsin [0-90]
+static void start_tables(double *dsin)
 {
 	int i;
 	double step;
 
 	step = PI / A180;
 	for (i = 0; i < A90; i++) {
-		sintab[i] = sin(step * i);
+		dsin[i] = sin(step * i);
 	}
 
-	sintab[A90] = 1;
+	dsin[A90] = 1;
 }
 
 static void gen_tables(void)
 {
 	int i, tmp;
+	double dsin[NANGLES];
 
-	start_tables();
+	start_tables(dsin);
 
 	/* sin quadrant [91-180] */
 	for (i = 0; i < A90; i++) {
-		sintab[A180 - i] = sintab[i];
+		dsin[A180 - i] = dsin[i];
 	}
 
 	/* sin quadrant [181-359] */
 	for (i = 1; i < A180; i++) {
-		sintab[A360 - i] = -sintab[i];
+		dsin[A360 - i] = -dsin[i];
+	}
+
+	for (i = 0; i < NANGLES; i++) {
+		sintab[i] = dtor(dsin[i]);
 	}
 
+#if PP_FIXED_POINT
+	/* In fixed point, compute from the doubles to not accumulate the
+	 * rounding errors of sintab. Infinities saturate.
+	 */
+	for (i = 0; i < NANGLES; i++) {
+		tmp = fixangle(A90 - i);
+		isintab[i] = dtor(1 / dsin[i]);
+		tantab[i] = dtor(dsin[i] / dsin[tmp]);
+		itantab[i] = dtor(dsin[tmp] / dsin[i]);
+	}
+#else
 	/* 1 / sin */
 	for (i = 0; i < A360; i++) {
 		isintab[i] = 1 / sintab[i];
@@ -271,8 +517,7 @@ static void gen_tables(void)
 		tantab[i] = sintab[i] * isintab[tmp];
 		itantab[i] = sintab[tmp] * isintab[i];
 	}
-
-	s_diaglen = sqrt(GRIDW*GRIDW*2);
+#endif
 }
 
 static int is_wall(int wtype)
@@ -280,9 +525,18 @@ static int is_wall(int wtype)
 	return wtype != 0 && (wtype & TILE_TYPE_MASK) == WALL_TILE;
 }
 
+/* The index is checked against s_nwalls when preparing the map. */
 static int wall_index(int wtype)
 {
-	return (wtype & WALL_INDEX) & (NWALLS - 1);
+	return wtype & WALL_INDEX;
+}
+
+/* Returns the index in s_textures of the texture of the face 'face' of
+ * wall 'iwall'.
+ */
+static int wall_tex(int iwall, int face)
+{
+	return s_walls[iwall].tex[face];
 }
 
 static int is_door(int wtype)
@@ -293,13 +547,13 @@ static int is_door(int wtype)
 /* Returns the index into s_doors. */
 static int door_index(int wtype)
 {
-	return (wtype & DOOR_INDEX) & (NDOORS - 1);
+	return wtype & DOOR_INDEX;
 }
 
 /* is_door must be checked before. */
 static int is_hdoor(int wtype)
 {
-	return s_doors[door_index(wtype)].dir == DOOR_DIR_H;
+	return s_doors.dir[door_index(wtype)] == DOOR_DIR_H;
 }
 
 /* is_door must be checked before. */
@@ -308,6 +562,17 @@ static int is_vdoor(int wtype)
 	return !is_hdoor(wtype);
 }
 
+static int is_diag(int wtype)
+{
+	return (wtype & TILE_TYPE_MASK) == DIAG_TILE;
+}
+
+/* Returns the index in s_walls. */
+static int diag_index(int wtype)
+{
+	return wtype & DIAG_INDEX;
+}
+
 static int is_pwall(int wtype)
 {
 	return (wtype & TILE_TYPE_MASK) == PWALL_TILE;
@@ -316,13 +581,13 @@ static int is_pwall(int wtype)
 /* Returns the index in s_pwalls. */
 static int pwall_index(int wtype)
 {
-	return (wtype & PWALL_INDEX) & (NPWALLS - 1);
+	return wtype & PWALL_INDEX;
 }
 
 /* is_pwall must be checked before. */
 static int is_hpwall(int wtype)
 {
-	return s_pwalls[pwall_index(wtype)].dir == DOOR_DIR_H;
+	return s_pwalls.dir[pwall_index(wtype)] == DOOR_DIR_H;
 }
 
 /* is_pwall must be checked before. */
@@ -346,19 +611,103 @@ static int wall_at(int x, int y)
 	return wall_at_tile(x >> GRIDS, y >> GRIDS);
 }
 
+/* x, y are in world coordinates. */
+static int is_in_map(int x, int y)
+{
+	x >>= GRIDS;
+	y >>= GRIDS;
+	return x >= 0 && x < MAPW && y >= 0 && y < MAPH;
+}
+
 static void load_floors(void)
 {
 	s_ceil_pbmp = get_bitmap(BMP_CEIL);
 	s_floor_pbmp = get_bitmap(BMP_FLOOR);
 }
 
+/* Makes room for 'nwalls' walls and 'ntextures' textures.
+ * Returns 0 if no memory.
+ */
+static int alloc_walls(int nwalls, int ntextures)
+{
+	void *p;
+
+	p = realloc(s_walls, nwalls * sizeof(*s_walls));
+	if (p == NULL)
+		return 0;
+	s_walls = p;
+	s_nwalls = nwalls;
+
+	p = realloc(s_textures, ntextures * sizeof(*s_textures));
+	if (p == NULL)
+		return 0;
+	s_textures = p;
+	s_ntextures = ntextures;
+	return 1;
+}
+
+static void free_walls(void)
+{
+	free(s_walls);
+	free(s_textures);
+	s_walls = NULL;
+	s_textures = NULL;
+	s_nwalls = 0;
+	s_ntextures = 0;
+}
+
 static void load_walls(void)
 {
-	memset(s_walls, 0, sizeof(s_walls));
-	s_walls[0].pbmp = get_bitmap(BMP_WALL);
-	s_walls[1].pbmp = get_bitmap(BMP_WALL2);
-	s_walls[2].pbmp = get_bitmap(BMP_DOOR);
-	s_walls[3].pbmp = get_bitmap(BMP_WALL);
+	int i, nwalls, ntextures;
+
+	nwalls = sizeof(s_demo_walls) / sizeof(s_demo_walls[0]);
+	ntextures = sizeof(s_demo_textures) / sizeof(s_demo_textures[0]);
+	/* We cannot draw anything without them. */
+	kasserta(alloc_walls(nwalls, ntextures));
+
+	memcpy(s_walls, s_demo_walls, sizeof(s_demo_walls));
+	for (i = 0; i < ntextures; i++) {
+		s_textures[i] = get_bitmap(s_demo_textures[i]);
+	}
+}
+
+/* Empties the tiles that address walls or textures we do not have. */
+static void prepare_map_walls(void)
+{
+	int i, iwall, wtype, bad;
+
+	memcpy(s_map, s_demo_map, sizeof(s_map));
+	for (i = 0; i < s_nwalls; i++) {
+		if (s_walls[i].tex[FACE_H] >= s_ntextures ||
+		    s_walls[i].tex[FACE_V] >= s_ntextures)
+		{
+			ktrace("wall %d has no texture", i);
+			s_walls[i].tex[FACE_H] = 0;
+			s_walls[i].tex[FACE_V] = 0;
+		}
+	}
+
+	for (i = 0; i < MAPSZ; i++) {
+		wtype = s_map[i];
+		if (wtype == EMPTY_TILE)
+			continue;
+
+		iwall = wall_index(wtype);
+		if (is_diag(wtype)) {
+			iwall = diag_index(wtype);
+			bad = iwall >= s_nwalls;
+		} else if (is_door(wtype)) {
+			/* iwall + 1 is for the sides */
+			bad = iwall + 1 >= s_nwalls;
+		} else {
+			bad = iwall >= s_nwalls;
+		}
+
+		if (bad) {
+			ktrace("bad wall %d in map", iwall);
+			s_map[i] = EMPTY_TILE;
+		}
+	}
 }
 
 /* Links the s_push_walls with the tiles.
@@ -367,28 +716,31 @@ static void load_walls(void)
  */
 static void prepare_map_pwalls(void)
 {
-	int i, x, y, iwall;
+	int i, x, y, iwall, dir, ipwall;
 	int too_many;
 
-	s_npwalls = 0;
+	doorset_clear(&s_pwalls);
 	too_many = 0;
 	for (y = 0, i = 0; y < MAPH; y++) {
 		for (x = 0; x < MAPW; x++, i++) {
 			if (is_pwall(s_map[i])) {
 				iwall = wall_index(s_map[i]);
 				s_map[i] = PWALL_TILE;
+				dir = DOOR_DIR_H;
+				if (is_wall(wall_at_tile(x, y - 1)) &&
+				    is_wall(wall_at_tile(x, y + 1)))
+				{
+					dir = DOOR_DIR_V;
+				}
 				/* Link with push wall in s_pwalls */
-				if (s_npwalls < NPWALLS) {
-					s_pwalls[s_npwalls].iwall = iwall;
-					s_pwalls[s_npwalls].xopen = 0;
-					if (is_wall(wall_at_tile(x, y - 1)) &&
-					    is_wall(wall_at_tile(x, y + 1)))
-					{
-						s_pwalls[s_npwalls].dir =
-							DOOR_DIR_V;
-					}
-					s_map[i] |= s_npwalls;
-					s_npwalls++;
+				ipwall = -1;
+				if (s_pwalls.n < NPWALLS) {
+					ipwall = doorset_add(&s_pwalls, iwall,
+							     dir, 0);
+				}
+				if (ipwall >= 0) {
+					s_map[i] |= ipwall;
+					s_pwall_tiles[ipwall] = i;
 				} else {
 					/* Too many...  */
 					too_many = 1;
@@ -409,28 +761,31 @@ static void prepare_map_pwalls(void)
  */
 static void prepare_map_doors(void)
 {
-	int i, x, y, iwall;
+	int i, x, y, iwall, dir, idoor;
 	int too_many;
 
-	s_ndoors = 0;
+	doorset_clear(&s_doors);
 	too_many = 0;
 	for (y = 0, i = 0; y < MAPH; y++) {
 		for (x = 0; x < MAPW; x++, i++) {
 			if (is_door(s_map[i])) {
 				iwall = wall_index(s_map[i]);
 				s_map[i] = DOOR_TILE;
+				dir = DOOR_DIR_H;
+				if (is_wall(wall_at_tile(x, y - 1)) &&
+				    is_wall(wall_at_tile(x, y + 1)))
+				{
+					dir = DOOR_DIR_V;
+				}
 				/* Link with door in s_doors */
-				if (s_ndoors < NDOORS) {
-					s_doors[s_ndoors].iwall = iwall;
-					s_doors[s_ndoors].xopen = GRIDW;
-					if (is_wall(wall_at_tile(x, y - 1)) &&
-					    is_wall(wall_at_tile(x, y + 1)))
-					{
-						s_doors[s_ndoors].dir =
-							DOOR_DIR_V;
-					}
-					s_map[i] |= s_ndoors;
-					s_ndoors++;
+				idoor = -1;
+				if (s_doors.n < NDOORS) {
+					idoor = doorset_add(&s_doors, iwall,
+							    dir, GRIDW);
+				}
+				if (idoor >= 0) {
+					s_map[i] |= idoor;
+					s_door_tiles[idoor] = i;
 				} else {
 					/* Too many doors...  */
 					too_many = 1;
@@ -445,931 +800,3189 @@ static void prepare_map_doors(void)
 	}
 }
 
-static void reset(void)
+/* We have no triggers in the map yet, so when a door stops we open it
+ * again, or close it at once if it is open. The push walls move back and
+ * forth the same way.
+ */
+static void on_door_stop(struct doorset *ds, int i)
 {
-	load_floors();
-	load_walls();
-	prepare_map_doors();
-	prepare_map_pwalls();
-	s_changed = 1;
-	view_angle = 0;
-	view_x = GRIDW * 4 + (GRIDW >> 1);
-	view_y = GRIDW * 3 + (GRIDW >> 1);
+	if (ds->xopen[i] == 0) {
+		doorset_move(ds, i, GRIDW, GRIDW, 0);
+	} else {
+		doorset_move(ds, i, 0, 1, 0);
+	}
 }
 
-void init(void)
-{
-	gen_tables();
-	reset();
-};
-
-static void view_up(void)
+static void on_pwall_stop(struct doorset *ds, int i)
 {
-	walk_steps = WALK_STEPS;
-	walk_step = WALK_STEP;
-	state = STATE_WALK;
+	if (ds->xopen[i] == GRIDW) {
+		doorset_move(ds, i, 0, GRIDW, 0);
+	} else {
+		doorset_move(ds, i, GRIDW, 1, 0);
+	}
 }
 
-static void view_down(void)
+/* Actors can go through the empty tiles, the doors at least half open and
+ * the push walls pushed away.
+ */
+static int is_door_passable(int xopen)
 {
-	walk_steps = WALK_STEPS;
-	walk_step = -WALK_STEP;
-	state = STATE_WALK;
+	return xopen <= GRIDW / 2;
 }
 
-static void view_left(void)
+static int is_pwall_passable(int xopen)
 {
-	giro_step = GIRO_STEP;
-	state = STATE_GIRO;
+	return xopen == GRIDW;
 }
 
-static void view_right(void)
+static int is_tile_passable(int wtype)
 {
-	giro_step = -GIRO_STEP;
-	state = STATE_GIRO;
+	if (wtype == EMPTY_TILE) {
+		return 1;
+	} else if (is_door(wtype)) {
+		return is_door_passable(s_doors.xopen[door_index(wtype)]);
+	} else if (is_pwall(wtype)) {
+		return is_pwall_passable(s_pwalls.xopen[pwall_index(wtype)]);
+	} else {
+		return 0;
+	}
 }
 
-static void update_doors(void)
+/* Updates the flow fields and s_los_tiles when a door opens or closes
+ * enough.
+ */
+static void on_door_move(struct doorset *ds, int i, int xold)
 {
-	int i;
+	int pass;
 
-	for (i = 0; i < s_ndoors; i++) {
-		s_changed = 1;
-		if (s_doors[i].xopen == 0) {
-			s_doors[i].xopen = GRIDW;
-		} else {
-			s_doors[i].xopen--;
-		}
+	pass = is_door_passable(ds->xopen[i]);
+	if (pass != is_door_passable(xold)) {
+		flowmap_set_passable(&s_flow, s_door_tiles[i], pass);
+	}
+	if ((ds->xopen[i] == 0) != (xold == 0)) {
+		set_los_tile(s_door_tiles[i]);
 	}
 }
 
-static void update_pwalls(void)
+static void on_pwall_move(struct doorset *ds, int i, int xold)
 {
-	int i;
+	int pass;
 
-	for (i = 0; i < s_npwalls; i++) {
-		s_changed = 1;
-		s_pwalls[i].xopen = (s_pwalls[i].xopen + 1) % (GRIDW + 1);
+	pass = is_pwall_passable(ds->xopen[i]);
+	if (pass != is_pwall_passable(xold)) {
+		flowmap_set_passable(&s_flow, s_pwall_tiles[i], pass);
+	}
+	if ((ds->xopen[i] >= GRIDW) != (xold >= GRIDW)) {
+		set_los_tile(s_pwall_tiles[i]);
 	}
 }
 
-void raycast_update(void)
+static void prepare_flow(void)
 {
-	if (state == STATE_GIRO) {
-		s_changed = 1;
-		view_angle = view_angle + giro_step;
-		if (view_angle < 0) {
-			view_angle += A360;
-		} else if (view_angle >= A360) {
-			view_angle -= A360;
-		}
-
-		// System.out.println(view_angle);
-		if (view_angle == 0 || view_angle == A90 ||
-		    view_angle == A180 || view_angle == A270)
-	       	{
-			state = STATE_IDLE;
-		}
-	} else if (state == STATE_WALK) {
-		s_changed = 1;
-		if (view_angle == 0) {
-			view_x += walk_step;
-		} else if (view_angle == A90) {
-			view_y -= walk_step;
-		} else if (view_angle == A180) {
-			view_x -= walk_step;
-		} else if (view_angle == A270) {
-			view_y += walk_step;
-		}
-
-		walk_steps--;
-		if (walk_steps == 0) {
-			state = STATE_IDLE;
-		}
-	} else {
-		if (is_key_down(KLEFT)) {
-			s_changed = 1;
-			view_angle += TURN_SPEED;
-			if (view_angle >= A360) {
-				view_angle -= A360;
-			}
-			// view_left();
-		} else if (is_key_down(KRIGHT)) {
-			s_changed = 1;
-			view_angle -= TURN_SPEED;
-			if (view_angle < 0) {
-				view_angle += A360;
-			}
-			// view_right();
-		}
-		
-		if (is_key_down(KUP)) {
-			s_changed = 1;
-			view_x += sintab[fixangle(A90 + view_angle)] *
-			       	  WALK_SPEED;
-			view_y -= sintab[view_angle] * WALK_SPEED;
-			// view_up();
-		} else if (is_key_down(KDOWN)) {
-			s_changed = 1;
-			view_x += sintab[fixangle(A90 + view_angle)] *
-			       	  -WALK_SPEED;
-			view_y -= sintab[view_angle] * -WALK_SPEED;
-			// view_down();
-		}
-	}
+	int i, ok;
 
-	update_doors();
-	update_pwalls();
-
-	if (s_changed) {
-		draw();
-		s_changed = 0;
+	ok = flowmap_reset(&s_flow, MAPW, MAPH);
+	kasserta(ok);
+	for (i = 0; i < MAPSZ; i++) {
+		flowmap_set_passable(&s_flow, i, is_tile_passable(s_map[i]));
 	}
 }
 
-void raycast_draw()
+static void prepare_actors(void)
 {
-	draw_bmp_kct(&s_buf_bmp, 0, 0, &s_screen, NULL, 0, 0);
-}
+	int ok;
 
-enum {
-	COLUMNH = 64,
-	COLUMNH_F = 64 << 8,
-	COLUMN_FS = 16,
-};
+	actorset_clear(&s_actors);
+	ok = actorset_set_grid(&s_actors, MAPW, MAPH);
+	kasserta(ok);
+}
 
-static void reset_visplane(void)
+static void start_doors(void)
 {
-	int x;
+	int i;
 
-	for (x = 0; x < SCRW; x++) {
-		s_visplane.ys[x] = SCRH;
+	for (i = 0; i < s_doors.n; i++) {
+		on_door_stop(&s_doors, i);
+	}
+	for (i = 0; i < s_pwalls.n; i++) {
+		on_pwall_stop(&s_pwalls, i);
 	}
-	s_visplane.ymin = SCRH;
-	s_visplane.xmin = SCRW;
-	s_visplane.xmax = 0;
 }
 
-/* x is screen column, y where floor starts... */
-static void add_visplane_column(int x, int y)
+/* Makes room for the copies of the door positions (one byte more, as
+ * there can be no doors).
+ */
+static void alloc_xopen_copies(void)
 {
-	s_visplane.ys[x] = y;
-	if (y < s_visplane.ymin) {
-		s_visplane.ymin = y;
-	}
+	free(s_door_xopen);
+	free(s_pwall_xopen);
+	s_door_xopen = malloc(s_doors.n + 1);
+	s_pwall_xopen = malloc(s_pwalls.n + 1);
+	kasserta(s_door_xopen != NULL && s_pwall_xopen != NULL);
 }
 
-/* Sets the xminx and xmax of the visplane. */
-static void set_visplane_bbox(void)
+static void copy_xopen(void)
 {
-	int x;
-
-	for (x = 0; x < SCRW; x++) {
-		if (s_visplane.ys[x] < SCRH) {
-			s_visplane.xmin = x;
-			break;
-		}
+	if (s_doors.n > 0) {
+		memcpy(s_door_xopen, s_doors.xopen, s_doors.n);
 	}
-
-	for (x = SCRW - 1; x >= s_visplane.xmin; x--) {
-		if (s_visplane.ys[x] < SCRH) {
-			s_visplane.xmax = x + 1;
-			break;
-		}
+	if (s_pwalls.n > 0) {
+		memcpy(s_pwall_xopen, s_pwalls.xopen, s_pwalls.n);
 	}
 }
 
-static void draw_visplane_bbox(void)
+static void reset(void)
 {
-	struct bmp *bp;
-
-	bp = &s_buf_bmp;
-	set_draw_color(0xff0000);
-	draw_line(bp, s_visplane.xmin, s_visplane.ymin,
-		       	s_visplane.xmin, SCRH);
-	draw_line(bp, s_visplane.xmax - 1, s_visplane.ymin,
-		  s_visplane.xmax - 1, SCRH);
-	draw_line(bp, s_visplane.xmin, s_visplane.ymin,
-		       	s_visplane.xmax -1, s_visplane.ymin);
+	load_floors();
+	load_walls();
+	prepare_map_walls();
+	prepare_map_doors();
+	prepare_map_pwalls();
+	prepare_flow();
+	prepare_actors();
+	alloc_xopen_copies();
+	start_doors();
+	set_los_tiles();
+	s_changed = 1;
+	view_angle = 0;
+	view_x = itor(GRIDW * 4 + (GRIDW >> 1));
+	view_y = itor(GRIDW * 3 + (GRIDW >> 1));
+	s_prev_angle = view_angle;
+	s_prev_x = view_x;
+	s_prev_y = view_y;
 }
 
-/* Draw the column 'col [0-63] of bitmap 'ibmp at screen column 'x.
- * Actually 'col is a bitmap row index, since we have the wall bitmaps
- * rotated 90 degrees.
- * 'wh is the desired height to paint the column, so it will be scaled as
- * needed.
- * Updates the floor-ceiling visplane.
- */
-static void draw_wall_column(struct bmp *sbmp, int col, int wh, int x)
+static struct bmp *expand_texture(struct bmp *pbmp)
 {
-	int y, py, xinc;
-	struct bmp *dbmp;
-	unsigned int *dpix;
-	int dpitch;
+	int ecode;
+	struct bmp *r;
 
-	if (sbmp == NULL) {
-		sbmp = s_walls[0].pbmp;
-	}
+	if (pbmp == NULL)
+		return NULL;
 
-	dbmp = &s_buf_bmp;
-	dpix = ((unsigned int *) dbmp->pixels) + x;
-	dpitch = dbmp->pitch >> 2;
-       
-	if (wh & 1) {
-		wh--;
-	}
+	r = expand_bmp32(pbmp, &ecode);
+	if (r == NULL)
+		ktrace("cannot expand texture to 32 bpp (%d)", ecode);
 
-	if (wh == 0) {
-		return;
-	}
+	return r;
+}
 
-	xinc = (COLUMNH << COLUMN_FS) / wh;
-	if (wh <= SCRH) {
-		y = (SCRH - wh) >> 1;
-		add_visplane_column(x, SCRH - y);
-		x = 0;
-	} else {
-		y = 0;
-		add_visplane_column(x, SCRH - y);
-		x = ((wh - SCRH) >> 1) * xinc;
-		wh = SCRH;
-	}
+/* Returns a copy of 'pbmp' remapped to s_frame_pal, in 'ppbmp'.
+ * Returns 0 if we cannot make it.
+ */
+static int remap_texture(struct bmp *pbmp, struct bmp **ppbmp)
+{
+	int ecode;
 
-#if 0
-	for (x = 0; x < SCRH; x++) {
-		*dpix = 0;
-		dpix += dpitch;
-	}
-	return;
-#endif
+	*ppbmp = NULL;
+	if (pbmp == NULL)
+		return 1;
 
-	if (s_flat_ceiling) {
-		py = 0;
-		while (py < y) {
-			*dpix = s_ceiling_color;
-			dpix += dpitch;
-			py++;
-		}
-	} else {
-		py = y;
-		dpix += dpitch * y;
+	*ppbmp = remap_bmp8(pbmp, s_frame_pal, &s_frame_palsz, &ecode);
+	if (*ppbmp == NULL) {
+		ktrace("cannot remap texture to the frame palette (%d)",
+		       ecode);
+		return 0;
 	}
-	py += wh;
 
-	if (sbmp == NULL) {
-		while (wh > 0) {
-			*dpix = 0;
-			dpix += dpitch;
-			wh--;
-		}
-	} else {
-		x = ((col * COLUMNH) << COLUMN_FS) + x;
-		while (wh > 0) {
-			*dpix = sbmp->pal[sbmp->pixels[x >> COLUMN_FS]];
-			dpix += dpitch;
-			x += xinc;
-			wh--;
-		}
-	}
+	return 1;
+}
+
+/* Frees the textures we have made for the texture set 'i'. */
+static void free_texset(int i)
+{
+	int j;
+	struct texset *ts;
 
-	if (s_flat_floor) {
-		while (py < SCRH) {
-			*dpix = s_floor_color;
-			dpix += dpitch;
-			py++;
+	ts = &s_texsets[i];
+	if (i != TEXSET_PAL8) {
+		for (j = 0; j < ts->ntextures; j++) {
+			free_bmp(ts->textures[j], 0);
 		}
+		free_bmp(ts->ceil_pbmp, 0);
+		free_bmp(ts->floor_pbmp, 0);
 	}
+	free(ts->textures);
+	memset(ts, 0, sizeof(*ts));
 }
 
-/* Returns 1 if hit and ax, ay will be the point hit.
- * Returns 0 if not hit and ax, ay will be left untouched.
- * a is angle, ax, ay point on tile side hit.
+/* Makes room for the textures of texture set 'ts'.
+ * Returns 0 if no memory.
  */
-static int uldwall_hhit(int a, float *ax, float *ay, int *tex_x)
+static int alloc_texset(struct texset *ts)
 {
-	int alfa, beta, tx;
-	float d;
-
-	if (a <= A45 || a >= A180)
-		return 0;
-
-	alfa = fixangle(A180 - a);
-	beta = fixangle(a - A45);
-	tx = float_to_int(*ax) & NOT_GRIDM;
-	d = (*ax - tx) * sintab[alfa] * isintab[beta];
-	if (d < 0 || d >= s_diaglen) {
+	ts->textures = calloc(s_ntextures, sizeof(*ts->textures));
+	if (ts->textures == NULL) {
+		ktrace("no memory for textures");
 		return 0;
 	}
-	*tex_x = float_to_int(d * GRIDW / s_diaglen);
-	*ax = tx + sintab[fixangle(A90 + A45)] * d;
-	*ay -= sintab[A45] * d;
+	ts->ntextures = s_ntextures;
 	return 1;
 }
 
-static int uldwall_vhit(int a, float *ax, float *ay, int *tex_x)
+static void make_rgb32_texset(void)
 {
-	int alfa, beta, ty;
-	float d;
+	int i;
+	struct texset *ts;
 
-	if (a <= A45 || a >= A225)
-		return 0;
+	ts = &s_texsets[TEXSET_RGB32];
+	if (!alloc_texset(ts))
+		return;
 
-	alfa = fixangle(a - A90);
-	beta = fixangle(A225 - a);
-	ty = float_to_int(*ay) & NOT_GRIDM;
-	d = (*ay - ty) * sintab[alfa] * isintab[beta];
-	if (d < 0 || d >= s_diaglen) {
-		return 0;
+	for (i = 0; i < s_ntextures; i++) {
+		ts->textures[i] = expand_texture(s_textures[i]);
 	}
-	*tex_x = float_to_int((s_diaglen - d) * GRIDW / s_diaglen);
-	*ax -= sintab[A45] * d;
-	*ay = ty + sintab[fixangle(A90 + A45)] * d;
-	return 1;
+	ts->ceil_pbmp = expand_texture(s_ceil_pbmp);
+	ts->floor_pbmp = expand_texture(s_floor_pbmp);
+	ts->ready = 1;
 }
 
-/* Draws scan at (x=[ax, bx[, y) */
-static void draw_floor_scan(int ax, int bx, int y, float xp, float yp,
-	       		     float dx, float dy)
+/* Builds s_frame_pal with the colors of all the textures, which must fit
+ * in 256, and the textures remapped to it.
+ */
+static void make_indexed_texset(void)
 {
-	int ui, vi, ti, dfloor, dceil;
-	struct bmp *dbmp;
-	unsigned int *fpix, *cpix;
-
-	dbmp = &s_buf_bmp;
-	fpix = cpix = NULL;
-
-	dfloor = !s_flat_floor && s_floor_pbmp;
-	dceil = !s_flat_ceiling && s_ceil_pbmp;
+	int i, ok;
+	struct texset *ts;
+
+	s_frame_palsz = 3;
+	s_frame_pal[0] = 0;
+	s_frame_pal[1] = s_ceiling_color;
+	s_frame_pal[2] = s_floor_color;
+	s_ceiling_index = 1;
+	s_floor_index = 2;
+
+	ts = &s_texsets[TEXSET_INDEXED];
+	if (!alloc_texset(ts))
+		return;
 
-	if (dfloor) {
-		fpix = (unsigned int *) (dbmp->pixels + y * dbmp->pitch) + ax;
+	ok = 1;
+	for (i = 0; ok && i < s_ntextures; i++) {
+		ok = remap_texture(s_textures[i], &ts->textures[i]);
 	}
-
-	if (dceil) {
-		cpix = (unsigned int *) (dbmp->pixels +
-			       	         (SCRH - y - 1) * dbmp->pitch) + ax;
+	if (ok) {
+		ok = remap_texture(s_ceil_pbmp, &ts->ceil_pbmp);
+	}
+	if (ok) {
+		ok = remap_texture(s_floor_pbmp, &ts->floor_pbmp);
 	}
 
-	if (fpix == NULL && cpix == NULL) {
+	if (!ok) {
+		free_texset(TEXSET_INDEXED);
 		return;
 	}
 
-	while (ax < bx) {
-		ui = float_to_int(xp) & GRIDM; 
-		vi = float_to_int(yp) & GRIDM; 
-		ti = (vi << GRIDS) + ui;
-		if (fpix) {
-			*fpix++ = s_floor_pbmp->pal[s_floor_pbmp->pixels[ti]];
-		}
-		if (cpix) {
-			*cpix++ = s_ceil_pbmp->pal[s_ceil_pbmp->pixels[ti]];
-		}
-		xp += dx;
-		yp += dy;
-		ax++;
-	}
+	ts->indexed = 1;
+	ts->ready = 1;
+}
 
-#if 0
-	// .9 fixed point
-	ui = (int) (xp * 512); 
-	vi = (int) (yp * 512);
-	deltax = (int) (dx * 512);
-	deltay = (int) (dy * 512);
-	for (x = 0; x < RAYS; x++) {
-		ti = ((vi>>3) & 0x0fc0) | ((ui>>9) & GRIDM);
-		*dpix++ = floor_bmp->pal[floor_bmp->pixels[ti]];
-		*dpix2++ = ceil_bmp->pal[ceil_bmp->pixels[ti]];
-		ui += deltax;
-		vi += deltay;
+/* Sets the palette size of 'pbmp', if any, to the current one of
+ * s_frame_pal. remap_bmp8() gives each texture the size when it was
+ * remapped, but the ones remapped later have added colors.
+ */
+static void set_frame_palsz(struct bmp *pbmp)
+{
+	if (pbmp != NULL) {
+		pbmp->palsz = s_frame_palsz;
 	}
-#endif
 }
 
-/* y where floor starts on screen */
-static void draw_floor_scans(int y, float xp, float yp, float dx, float dy)
+static void use_texset(int i)
 {
-	int a, b;
+	int j;
+	const struct texset *ts;
 
-	a = -1;
-	for (b = s_visplane.xmin; b < s_visplane.xmax; b++) {
-		if (a == -1) {
-		       if (s_visplane.ys[b] <= y) {
-			       a = b;
-		       }
-		} else if (s_visplane.ys[b] > y) {
-			draw_floor_scan(a, b, y, xp + dx*a, yp + dy*a, dx, dy);
-			a = -1;
+	ts = &s_texsets[i];
+	if (ts->indexed) {
+		for (j = 0; j < ts->ntextures; j++) {
+			set_frame_palsz(ts->textures[j]);
 		}
+		set_frame_palsz(ts->ceil_pbmp);
+		set_frame_palsz(ts->floor_pbmp);
 	}
-
-	if (a != -1) {
-		draw_floor_scan(a, b, y, xp + dx * a, yp + dy * a, dx, dy);
-	}
+	memcpy(s_textures, ts->textures, s_ntextures * sizeof(*s_textures));
+	s_ceil_pbmp = ts->ceil_pbmp;
+	s_floor_pbmp = ts->floor_pbmp;
+	s_indexed = ts->indexed;
+	s_texseti = i;
+	set_los_tiles();
 }
 
-/* y is where the floor line starts on screen, that is, it is in range
- * [SCRHMID + 1, SCRH[.
+/* Keeps the loaded textures and makes the copies we need for the
+ * indexed mode or the benchmark.
  */
-static void draw_floor_line(int y)
+static void init_texsets(void)
 {
-	int a, b;
-	float xp, yp, d, dp, dx, dy;
-	float xp2, yp2;
-	enum { PLAYERH = SLICEH >> 1 };
-
-	a = view_angle + AFOV_D2;
-	b = iabs(a - view_angle);
-	a = fixangle(a);
+	int i;
+	struct texset *ts;
 
-	/* perpendicular distance to point on floor */
-	dp = (float) DST_PLANE * PLAYERH / (y - SCRHMID);
+	for (i = 0; i < NTEXSETS; i++) {
+		free_texset(i);
+	}
 
-	/* distance to point on floor (projected on floor) */
-	d = dp * isintab[fixangle(A90 + b)];
+	ts = &s_texsets[TEXSET_PAL8];
+	kasserta(alloc_texset(ts));
+	memcpy(ts->textures, s_textures, s_ntextures * sizeof(*s_textures));
+	ts->ceil_pbmp = s_ceil_pbmp;
+	ts->floor_pbmp = s_floor_pbmp;
+	ts->ready = 1;
 
-	/* position on floor */
-	xp = view_x + d * sintab[fixangle(A90 + a)];
-	yp = view_y - d * sintab[a];
+	if (s_bench_mode) {
+		make_rgb32_texset();
+	}
+	if (s_bench_mode || s_indexed_mode) {
+		make_indexed_texset();
+	}
 
-	/* position on floor of opposite side of the view */
-	xp2 = view_x + d * sintab[fixangle(A90 + a - AFOV)];
-	yp2 = view_y - d * sintab[fixangle(a - AFOV)];
+	bench_init(&s_draw_benches[TEXSET_PAL8],
+		   "draw (" REAL_NAME ", 8 bpp)");
+	bench_init(&s_draw_benches[TEXSET_RGB32],
+		   "draw (" REAL_NAME ", 32 bpp)");
+	bench_init(&s_draw_benches[TEXSET_INDEXED],
+		   "draw (" REAL_NAME ", 8 bpp indexed)");
+	bench_init(&s_present_benches[TEXSET_PAL8], "present (32 bpp)");
+	bench_init(&s_present_benches[TEXSET_RGB32], "present (32 bpp)");
+	bench_init(&s_present_benches[TEXSET_INDEXED],
+		   "present (8 bpp indexed)");
+
+	if (s_indexed_mode && !s_bench_mode &&
+	    s_texsets[TEXSET_INDEXED].ready)
+	{
+		use_texset(TEXSET_INDEXED);
+	} else {
+		use_texset(TEXSET_PAL8);
+	}
+}
 
-	dx = (xp2 - xp) / RAYS;
-	dy = (yp2 - yp) / RAYS;
+static void init_bufs(void)
+{
+	int i;
+	struct bmp *bp;
 
-#if 0
-	ktrace("a %f", sqrt((xp2 - xp) * (xp2 - xp) +
-		 	    (yp2 - yp) * (yp2 - yp)));
+	for (i = 0; i < NBUFS; i++) {
+		bp = &s_buf_bmps[i];
+		bp->w = SCRW;
+		bp->h = SCRH;
+		bp->pitch = SCRW * 4;
+		bp->palsz = 0;
+		bp->pal = NULL;
+		bp->use_key_color = 0;
+		bp->key_color = 0;
+		bp->use_alpha = 0;
+		bp->runs = NULL;
+		bp->pixels = (unsigned char *) s_buf_pixels[i];
+
+		bp = &s_buf8_bmps[i];
+		bp->w = SCRW;
+		bp->h = SCRH;
+		bp->pitch = SCRW;
+		bp->palsz = 256;
+		bp->pal = s_frame_pal;
+		bp->use_key_color = 0;
+		bp->key_color = 0;
+		bp->use_alpha = 0;
+		bp->runs = NULL;
+		bp->pixels = s_buf8_pixels[i];
+	}
+}
 
-	ktrace("xp2 yp2 %f %f", xp2, yp2);
+void init(void)
+{
+	gen_tables();
+	init_bufs();
+	doorset_init(&s_doors, on_door_stop, on_door_move, NULL);
+	doorset_init(&s_pwalls, on_pwall_stop, on_pwall_move, NULL);
+	flowmap_init(&s_flow);
+	actorset_init(&s_actors, raycast_move_circles);
+	reset();
+	init_texsets();
+};
 
-	/* vector perpendicular to view vector */
-	dx = sintab[view_angle];
-	dy = -sintab[fixangle(A90 + view_angle)];
-	k = RAYS * dp / DST_PLANE;
-	ktrace("k %f", k);
-	dx *= k;
-	dy *= k;
-	xp2 = xp + dx;
-	yp2 = yp - dy;
-	ktrace("xp2 yp2 %f %f", xp2, yp2);
+static void view_up(void)
+{
+	walk_steps = WALK_STEPS;
+	walk_step = WALK_STEP;
+	state = STATE_WALK;
+}
 
-	ktrace("b %f", sqrt((xp2 - xp) * (xp2 - xp) +
-		 	    (yp2 - yp) * (yp2 - yp)));
+static void view_down(void)
+{
+	walk_steps = WALK_STEPS;
+	walk_step = -WALK_STEP;
+	state = STATE_WALK;
+}
 
-	dx /= RAYS;
-	dy /= -RAYS;
-#endif
+static void view_left(void)
+{
+	giro_step = GIRO_STEP;
+	state = STATE_GIRO;
+}
 
-	draw_floor_scans(y, xp, yp, dx, dy);
+static void view_right(void)
+{
+	giro_step = -GIRO_STEP;
+	state = STATE_GIRO;
 }
 
-static void draw_floor(void)
+static void update_doors(void)
 {
-	int y;
+	if (doorset_update(&s_doors) > 0) {
+		s_changed = 1;
+	}
+}
 
-	for (y = s_visplane.ymin; y < SCRH; y++) {
-		draw_floor_line(y);
+static void update_pwalls(void)
+{
+	if (doorset_update(&s_pwalls) > 0) {
+		s_changed = 1;
 	}
 }
 
-/* Returns the column hit or -1.
- * ax and ay will contain the point hit if column >= 0.
- * is_door and is_hdoor must be checked before.
+/* In benchmark mode we turn around at constant speed and report the
+ * drawing times after each full turn, then switch the texture set (see
+ * next_bench_texset()).
  */
-static int hit_hdoor(int wtype, float xinc, float yinc, float *ax, float *ay,
-		     struct bmp **ppbmp)
+static void update_bench(void)
 {
-	float ix;
-	int idoor, tx;
-	struct door *pdoor;
-
-	idoor = door_index(wtype);
-	pdoor = &s_doors[idoor];
-	if (pdoor->xopen == 0) {
-		/* Fully open. */
-		return -1;
+	s_changed = 1;
+	view_angle = fixangle(view_angle + TURN_SPEED);
+	if (view_angle == 0) {
+		s_bench_turned = 1;
 	}
+}
 
-	ix = *ax;
-	tx = float_to_int(ix) & NOT_GRIDM;
-	ix += xinc / 2;
-	if ((float_to_int(ix) & NOT_GRIDM) != tx) {
-		/* Not in the same tile, no hit. */
-		return -1;
-	}
-	
-	tx = float_to_int(ix) & GRIDM;
-	if (pdoor->xopen > tx) {
-		/* We hit the visible zone of the door... */
-		*ax = ix;
-		*ay += yinc / 2;
-		*ppbmp = s_walls[wall_index(pdoor->iwall)].pbmp;
-		return GRIDW - pdoor->xopen + tx;
-	}
+/* Called when the render thread is not drawing, as it uses the benches
+ * and the textures.
+ */
+static void next_bench_texset(void)
+{
+	int i;
 
-	return -1;
+	bench_report(&s_draw_benches[s_texseti]);
+	bench_report(&s_present_benches[s_texseti]);
+	i = s_texseti;
+	do {
+		i = (i + 1) % NTEXSETS;
+	} while (!s_texsets[i].ready);
+	use_texset(i);
 }
 
-/* Returns the column hit or -1.
- * ax and ay will contain the point hit if column >= 0.
- * is_door and is_vdoor must be checked before.
+/* Moves the player by (dx, dy), in world units, sliding along the walls.
  */
-static int hit_vdoor(int wtype, float xinc, float yinc, float *ax, float *ay,
-		     struct bmp **ppbmp)
+static void move_player(real dx, real dy)
 {
-	float iy;
-	int idoor, ty;
-	struct door *pdoor;
+	double x, y, ddx, ddy, r;
+
+	x = rtod(view_x) / GRIDW;
+	y = rtod(view_y) / GRIDW;
+	ddx = rtod(dx) / GRIDW;
+	ddy = rtod(dy) / GRIDW;
+	r = (double) PLAYER_RADIUS / GRIDW;
+	raycast_move_circles(&x, &y, &ddx, &ddy, &r, 1);
+	view_x = dtor(x * GRIDW);
+	view_y = dtor(y * GRIDW);
+}
 
-	idoor = door_index(wtype);
-	pdoor = &s_doors[idoor];
-	if (pdoor->xopen == 0) {
-		/* Fully open. */
-		return -1;
-	}
+void raycast_update(void)
+{
+	s_prev_angle = view_angle;
+	s_prev_x = view_x;
+	s_prev_y = view_y;
 
-	iy = *ay;
-	ty = float_to_int(iy) & NOT_GRIDM;
-	iy += yinc / 2;
-	if ((float_to_int(iy) & NOT_GRIDM) != ty) {
-		/* Not in the same tile, no hit. */
-		return -1;
-	}
-	
-	ty = float_to_int(iy) & GRIDM;
-	if (pdoor->xopen > ty) {
-		/* We hit the visible zone of the door... */
-		*ax += xinc / 2;
-		*ay = iy;
-		*ppbmp = s_walls[wall_index(pdoor->iwall)].pbmp;
-		return GRIDW - pdoor->xopen + ty;
+	if (s_bench_mode) {
+		update_bench();
+	} else if (state == STATE_GIRO) {
+		s_changed = 1;
+		view_angle = view_angle + giro_step;
+		if (view_angle < 0) {
+			view_angle += A360;
+		} else if (view_angle >= A360) {
+			view_angle -= A360;
+		}
+
+		// System.out.println(view_angle);
+		if (view_angle == 0 || view_angle == A90 ||
+		    view_angle == A180 || view_angle == A270)
+	       	{
+			state = STATE_IDLE;
+		}
+	} else if (state == STATE_WALK) {
+		s_changed = 1;
+		if (view_angle == 0) {
+			move_player(itor(walk_step), 0);
+		} else if (view_angle == A90) {
+			move_player(0, -itor(walk_step));
+		} else if (view_angle == A180) {
+			move_player(-itor(walk_step), 0);
+		} else if (view_angle == A270) {
+			move_player(0, itor(walk_step));
+		}
+
+		walk_steps--;
+		if (walk_steps == 0) {
+			state = STATE_IDLE;
+		}
+	} else {
+		if (is_key_down(KLEFT)) {
+			s_changed = 1;
+			view_angle += TURN_SPEED;
+			if (view_angle >= A360) {
+				view_angle -= A360;
+			}
+			// view_left();
+		} else if (is_key_down(KRIGHT)) {
+			s_changed = 1;
+			view_angle -= TURN_SPEED;
+			if (view_angle < 0) {
+				view_angle += A360;
+			}
+			// view_right();
+		}
+		
+		if (is_key_down(KUP)) {
+			s_changed = 1;
+			move_player(sintab[fixangle(A90 + view_angle)] *
+				    WALK_SPEED,
+				    sintab[view_angle] * -WALK_SPEED);
+			// view_up();
+		} else if (is_key_down(KDOWN)) {
+			s_changed = 1;
+			move_player(sintab[fixangle(A90 + view_angle)] *
+				    -WALK_SPEED,
+				    sintab[view_angle] * WALK_SPEED);
+			// view_down();
+		}
 	}
 
-	return -1;
+	actorset_update(&s_actors);
+	update_doors();
+	update_pwalls();
 }
 
-/* Returns the column hit or -1.
- * ax and ay will contain the point hit if column >= 0.
- * is_pwall and is_hwall must be checked before.
+/* Sets 'cam' between the view of the last update and the current one,
+ * 'alpha' in [0..1].
  */
-static int hit_hpwall(int wtype, float xinc, float yinc, float *ax, float *ay,
-		      struct bmp **ppbmp)
+static void interpolate_camera(struct camera *cam, double alpha)
 {
-	float ix;
-	int ipwall, tx;
-	struct pwall *pwall;
+	int da;
 
-	ipwall = pwall_index(wtype);
-	pwall = &s_pwalls[ipwall];
-	if (pwall->xopen == GRIDW) {
-		/* Fully open. */
-		return -1;
+	if (alpha >= 1) {
+		cam->x = view_x;
+		cam->y = view_y;
+		cam->angle = view_angle;
+		return;
 	}
 
-	ix = *ax;
-	tx = float_to_int(ix) & NOT_GRIDM;
-	ix += (xinc / GRIDW) * pwall->xopen;
-	if ((float_to_int(ix) & NOT_GRIDM) != tx) {
-		/* Not in the same tile, no hit. */
-		return -1;
+	/* Turn the short way. */
+	da = view_angle - s_prev_angle;
+	if (da > A180) {
+		da -= A360;
+	} else if (da < -A180) {
+		da += A360;
 	}
-	
-	tx = float_to_int(ix) & GRIDM;
-	*ax = ix;
-	*ay += (yinc / GRIDW) * pwall->xopen;
-	*ppbmp = s_walls[wall_index(pwall->iwall)].pbmp;
-	return tx;
+
+	cam->x = s_prev_x + rmul(view_x - s_prev_x, dtor(alpha));
+	cam->y = s_prev_y + rmul(view_y - s_prev_y, dtor(alpha));
+	cam->angle = fixangle(s_prev_angle + (int) floor(da * alpha + 0.5));
 }
 
-/* Returns the column hit or -1.
- * ax and ay will contain the point hit if column >= 0.
- * is_pwall and is_vpwall must be checked before.
+/* Presents the buffer s_showi. In indexed mode, the palette is expanded
+ * here. It is recorded, so the tiles of the screen are shared among the
+ * draw helpers.
  */
-static int hit_vpwall(int wtype, float xinc, float yinc, float *ax, float *ay,
-		      struct bmp **ppbmp)
+static void present(void)
 {
-	float iy;
-	int ipwall, ty;
-	struct pwall *pwall;
-
-	ipwall = pwall_index(wtype);
-	pwall = &s_pwalls[ipwall];
-	if (pwall->xopen == GRIDW) {
-		/* Fully open. */
-		return -1;
+	drawcmd_begin(&s_screen);
+	if (s_buf_indexed[s_showi]) {
+		set_frame_palsz(&s_buf8_bmps[s_showi]);
+		draw_bmp_kct(&s_buf8_bmps[s_showi], 0, 0, &s_screen, NULL, 0, 0);
+	} else {
+		draw_bmp_kct(&s_buf_bmps[s_showi], 0, 0, &s_screen, NULL, 0, 0);
 	}
+	drawcmd_end();
+}
 
-	iy = *ay;
-	ty = float_to_int(iy) & NOT_GRIDM;
-	iy += (yinc / GRIDW) * pwall->xopen;
-	if ((float_to_int(iy) & NOT_GRIDM) != ty) {
+/* Shows the frames per second and the texture set in use. */
+static void draw_bench_text(void)
+{
+	double t;
+
+	if (s_bench_font == NULL)
+		return;
+
+	t = kernel_get_device()->get_time_ms();
+	if (s_bench_frames == 0) {
+		s_bench_t0 = t;
+	} else if (t - s_bench_t0 >= BENCH_FPS_MS) {
+		snprintf(s_bench_text, sizeof(s_bench_text), "%.1f FPS\n%s",
+			 s_bench_frames * 1000 / (t - s_bench_t0),
+			 s_draw_benches[s_texseti].name);
+		s_bench_t0 = t;
+		s_bench_frames = 0;
+	}
+	s_bench_frames++;
+	draw_text(s_bench_font, &s_screen, 2, 2, s_bench_text);
+}
+
+/* Draws the viewports into the buffer s_drawi. */
+static void draw_frame(void)
+{
+	if (s_bench_mode) {
+		bench_start(&s_draw_benches[s_texseti]);
+		draw();
+		bench_stop(&s_draw_benches[s_texseti]);
+	} else {
+		draw();
+	}
+	s_buf_indexed[s_drawi] = s_indexed;
+	s_buf_nviews[s_drawi] = s_nviews;
+}
+
+static int render_frames(void *data)
+{
+	const struct kernel_device *kd;
+
+	kd = kernel_get_device();
+	for (;;) {
+		kd->sem_wait(s_frame_sem);
+		if (s_render_quit)
+			break;
+		draw_frame();
+		kd->sem_post(s_done_sem);
+	}
+
+	return 0;
+}
+
+/* Must be called with s_render_quit set. */
+static void stop_helpers(void)
+{
+	int i;
+	const struct kernel_device *kd;
+
+	kd = kernel_get_device();
+	for (i = 0; i < s_nhelpers; i++) {
+		kd->sem_post(s_helpers[i].sem);
+		kd->wait_thread(s_helpers[i].thread);
+		kd->destroy_sem(s_helpers[i].sem);
+	}
+	engine_give_helpers(s_nhelpers);
+	s_nhelpers = 0;
+	kd->destroy_sem(s_helpers_done_sem);
+	s_helpers_done_sem = NULL;
+}
+
+/* Starts the helpers the cores have left, as many as we can. */
+static void start_helpers(void)
+{
+	int n;
+	struct helper *h;
+	const struct kernel_device *kd;
+
+	n = engine_take_helpers(RAYCAST_MAX_VIEWPORTS - 1);
+	if (n <= 0)
+		return;
+
+	kd = kernel_get_device();
+	s_helpers_done_sem = kd->create_sem(0);
+	if (s_helpers_done_sem == NULL) {
+		engine_give_helpers(n);
+		return;
+	}
+
+	while (s_nhelpers < n) {
+		h = &s_helpers[s_nhelpers];
+		h->worker = s_nhelpers + 1;
+		h->sem = kd->create_sem(0);
+		if (h->sem == NULL)
+			break;
+		h->thread = kd->create_thread(help_draw, h, "render helper");
+		if (h->thread == NULL) {
+			kd->destroy_sem(h->sem);
+			break;
+		}
+		s_nhelpers++;
+	}
+	engine_give_helpers(n - s_nhelpers);
+}
+
+static void stop_render_thread(void)
+{
+	const struct kernel_device *kd;
+
+	kd = kernel_get_device();
+	s_render_quit = 1;
+	if (s_render_thread != NULL) {
+		kd->sem_post(s_frame_sem);
+		kd->wait_thread(s_render_thread);
+		s_render_thread = NULL;
+	}
+	kd->destroy_sem(s_frame_sem);
+	kd->destroy_sem(s_done_sem);
+	s_frame_sem = NULL;
+	s_done_sem = NULL;
+	stop_helpers();
+}
+
+/* If we cannot start the render thread, we draw in the main thread.
+ * The helpers are started with it.
+ */
+static void start_render_thread(void)
+{
+	const struct kernel_device *kd;
+
+	s_drawing = 0;
+	s_render_quit = 0;
+	if (s_serial_mode)
+		return;
+
+	kd = kernel_get_device();
+	s_frame_sem = kd->create_sem(0);
+	s_done_sem = kd->create_sem(0);
+	if (s_frame_sem != NULL && s_done_sem != NULL) {
+		s_render_thread = kd->create_thread(render_frames, NULL,
+						    "render");
+	}
+	if (s_render_thread == NULL) {
+		ktrace("drawing in the main thread");
+		stop_render_thread();
+		return;
+	}
+
+	start_helpers();
+}
+
+/* Waits for the frame the render thread is drawing, and shows it. */
+static void wait_frame(void)
+{
+	if (!s_drawing)
+		return;
+
+	kernel_get_device()->sem_wait(s_done_sem);
+	s_drawing = 0;
+	s_showi = s_drawi;
+}
+
+/* Draws the frame, in the render thread into the buffer we are
+ * not showing, if we have the thread. Else into the one we show.
+ */
+static void start_frame(void)
+{
+	int i;
+
+	copy_xopen();
+	for (i = 0; i < s_nviews; i++) {
+		if (s_views[i].follow) {
+			s_views[i].cam = s_cam;
+		}
+	}
+	if (s_render_thread != NULL) {
+		s_drawi = (s_showi + 1) % NBUFS;
+		s_drawing = 1;
+		kernel_get_device()->sem_post(s_frame_sem);
+	} else {
+		s_drawi = s_showi;
+		draw_frame();
+	}
+}
+
+/* With the render thread, we present the frame drawn during the last
+ * call while the frame for this one is drawn. Nothing the render thread
+ * reads can change between wait_frame() and start_frame().
+ */
+void raycast_draw()
+{
+	struct camera cam;
+
+	wait_frame();
+	if (s_bench_turned) {
+		next_bench_texset();
+		s_bench_turned = 0;
+	}
+
+	interpolate_camera(&cam, s_draw_alpha);
+	if (cam.x != s_cam.x || cam.y != s_cam.y || cam.angle != s_cam.angle) {
+		s_cam = cam;
+		s_changed = 1;
+	}
+
+	if (s_changed) {
+		start_frame();
+		s_changed = 0;
+	}
+
+	if (s_bench_mode) {
+		bench_start(&s_present_benches[s_texseti]);
+		present();
+		bench_stop(&s_present_benches[s_texseti]);
+		draw_bench_text();
+	} else {
+		present();
+	}
+}
+
+enum {
+	COLUMNH = 64,
+	COLUMNH_F = 64 << 8,
+	COLUMN_FS = 16,
+};
+
+static void reset_visplane(struct view *v)
+{
+	int x;
+	struct visplane *vp;
+
+	vp = &v->visplane;
+	for (x = 0; x < v->w; x++) {
+		vp->ys[x] = v->h;
+	}
+	vp->ymin = v->h;
+	vp->xmin = v->w;
+	vp->xmax = 0;
+}
+
+/* x is viewport column, y where floor starts... */
+static void add_visplane_column(struct view *v, int x, int y)
+{
+	v->visplane.ys[x] = y;
+	if (y < v->visplane.ymin) {
+		v->visplane.ymin = y;
+	}
+}
+
+/* Sets the xminx and xmax of the visplane. */
+static void set_visplane_bbox(struct view *v)
+{
+	int x;
+	struct visplane *vp;
+
+	vp = &v->visplane;
+	for (x = 0; x < v->w; x++) {
+		if (vp->ys[x] < v->h) {
+			vp->xmin = x;
+			break;
+		}
+	}
+
+	for (x = v->w - 1; x >= vp->xmin; x--) {
+		if (vp->ys[x] < v->h) {
+			vp->xmax = x + 1;
+			break;
+		}
+	}
+}
+
+static void draw_visplane_bbox(const struct view *v)
+{
+	struct bmp *bp;
+	const struct visplane *vp;
+	int x0, y0;
+
+	bp = &s_buf_bmps[s_drawi];
+	vp = &v->visplane;
+	x0 = v->x0;
+	y0 = v->y0;
+	set_draw_color(0xff0000);
+	draw_line(bp, x0 + vp->xmin, y0 + vp->ymin,
+		       	x0 + vp->xmin, y0 + v->h);
+	draw_line(bp, x0 + vp->xmax - 1, y0 + vp->ymin,
+		  x0 + vp->xmax - 1, y0 + v->h);
+	draw_line(bp, x0 + vp->xmin, y0 + vp->ymin,
+		       	x0 + vp->xmax -1, y0 + vp->ymin);
+}
+
+/* Texture formats for the drawers. These are macros because drawers.h
+ * tests them with #if.
+ */
+#define TEX_NONE	0
+#define TEX_PAL8	1
+#define TEX_RGB32	2
+#define NTEXFORMATS	3
+
+#define DRAW_INDEXED 0
+
+#define COLUMN_NAME draw_wall_column_tt
+#define COLUMN_FLAT_CEIL 0
+#define COLUMN_FLAT_FLOOR 0
+#include "drawers.h"
+
+#define COLUMN_NAME draw_wall_column_tf
+#define COLUMN_FLAT_CEIL 0
+#define COLUMN_FLAT_FLOOR 1
+#include "drawers.h"
+
+#define COLUMN_NAME draw_wall_column_ft
+#define COLUMN_FLAT_CEIL 1
+#define COLUMN_FLAT_FLOOR 0
+#include "drawers.h"
+
+#define COLUMN_NAME draw_wall_column_ff
+#define COLUMN_FLAT_CEIL 1
+#define COLUMN_FLAT_FLOOR 1
+#include "drawers.h"
+
+#define MASKED_NAME draw_masked_column_32
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_n_8
+#define SPAN_CEIL TEX_NONE
+#define SPAN_FLOOR TEX_PAL8
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_n_32
+#define SPAN_CEIL TEX_NONE
+#define SPAN_FLOOR TEX_RGB32
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_8_n
+#define SPAN_CEIL TEX_PAL8
+#define SPAN_FLOOR TEX_NONE
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_8_8
+#define SPAN_CEIL TEX_PAL8
+#define SPAN_FLOOR TEX_PAL8
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_8_32
+#define SPAN_CEIL TEX_PAL8
+#define SPAN_FLOOR TEX_RGB32
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_32_n
+#define SPAN_CEIL TEX_RGB32
+#define SPAN_FLOOR TEX_NONE
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_32_8
+#define SPAN_CEIL TEX_RGB32
+#define SPAN_FLOOR TEX_PAL8
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_32_32
+#define SPAN_CEIL TEX_RGB32
+#define SPAN_FLOOR TEX_RGB32
+#include "drawers.h"
+
+#undef DRAW_INDEXED
+#define DRAW_INDEXED 1
+
+#define COLUMN_NAME draw_wall_column_tt_i
+#define COLUMN_FLAT_CEIL 0
+#define COLUMN_FLAT_FLOOR 0
+#include "drawers.h"
+
+#define COLUMN_NAME draw_wall_column_tf_i
+#define COLUMN_FLAT_CEIL 0
+#define COLUMN_FLAT_FLOOR 1
+#include "drawers.h"
+
+#define COLUMN_NAME draw_wall_column_ft_i
+#define COLUMN_FLAT_CEIL 1
+#define COLUMN_FLAT_FLOOR 0
+#include "drawers.h"
+
+#define COLUMN_NAME draw_wall_column_ff_i
+#define COLUMN_FLAT_CEIL 1
+#define COLUMN_FLAT_FLOOR 1
+#include "drawers.h"
+
+#define MASKED_NAME draw_masked_column_i
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_n_8_i
+#define SPAN_CEIL TEX_NONE
+#define SPAN_FLOOR TEX_PAL8
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_8_n_i
+#define SPAN_CEIL TEX_PAL8
+#define SPAN_FLOOR TEX_NONE
+#include "drawers.h"
+
+#define SPAN_NAME draw_floor_scan_8_8_i
+#define SPAN_CEIL TEX_PAL8
+#define SPAN_FLOOR TEX_PAL8
+#include "drawers.h"
+
+#undef DRAW_INDEXED
+
+typedef void (*draw_column_fn)(struct view *v, const struct bmp *sbmp,
+			       int col, int wh, int x);
+typedef void (*draw_span_fn)(const struct view *v, int ax, int bx, int y,
+			     real xp, real yp, real dx, real dy);
+
+/* Indexed by [indexed][flat ceiling][flat floor]. */
+static const draw_column_fn s_column_drawers[2][2][2] = {
+	{
+		{ draw_wall_column_tt, draw_wall_column_tf },
+		{ draw_wall_column_ft, draw_wall_column_ff },
+	},
+	{
+		{ draw_wall_column_tt_i, draw_wall_column_tf_i },
+		{ draw_wall_column_ft_i, draw_wall_column_ff_i },
+	},
+};
+
+/* Indexed by [indexed]. */
+static const draw_column_fn s_masked_drawers[2] = {
+	draw_masked_column_32, draw_masked_column_i
+};
+
+/* Indexed by [indexed][ceiling format][floor format].
+ * The indexed textures are always TEX_PAL8.
+ */
+static const draw_span_fn s_span_drawers[2][NTEXFORMATS][NTEXFORMATS] = {
+	{
+		{ NULL, draw_floor_scan_n_8, draw_floor_scan_n_32 },
+		{ draw_floor_scan_8_n, draw_floor_scan_8_8,
+		  draw_floor_scan_8_32 },
+		{ draw_floor_scan_32_n, draw_floor_scan_32_8,
+		  draw_floor_scan_32_32 },
+	},
+	{
+		{ NULL, draw_floor_scan_n_8_i, NULL },
+		{ draw_floor_scan_8_n_i, draw_floor_scan_8_8_i, NULL },
+		{ NULL, NULL, NULL },
+	},
+};
+
+/* Drawers selected for the current frame. */
+static draw_column_fn draw_wall_column;
+static draw_column_fn draw_masked_column;
+static draw_span_fn draw_floor_scan;
+
+/* Returns the format to use for a floor or ceiling bitmap. */
+static int flat_tex_format(const struct bmp *pbmp, int flat)
+{
+	if (flat || pbmp == NULL) {
+		return TEX_NONE;
+	} else if (pbmp->pal == NULL) {
+		return TEX_RGB32;
+	} else {
+		return TEX_PAL8;
+	}
+}
+
+/* Selects the drawers for the current flags and textures. */
+static void select_drawers(void)
+{
+	int ceil_fmt, floor_fmt;
+
+	draw_wall_column = s_column_drawers[s_indexed]
+					   [s_flat_ceiling != 0]
+					   [s_flat_floor != 0];
+	draw_masked_column = s_masked_drawers[s_indexed];
+	ceil_fmt = flat_tex_format(s_ceil_pbmp, s_flat_ceiling);
+	floor_fmt = flat_tex_format(s_floor_pbmp, s_flat_floor);
+	draw_floor_scan = s_span_drawers[s_indexed][ceil_fmt][floor_fmt];
+}
+
+/* y where floor starts on the viewport */
+static void draw_floor_scans(const struct view *v, int y, real xp, real yp,
+			     real dx, real dy)
+{
+	int a, b;
+	const struct visplane *vp;
+
+	vp = &v->visplane;
+	a = -1;
+	for (b = vp->xmin; b < vp->xmax; b++) {
+		if (a == -1) {
+		       if (vp->ys[b] <= y) {
+			       a = b;
+		       }
+		} else if (vp->ys[b] > y) {
+			draw_floor_scan(v, a, b, y, xp + dx*a, yp + dy*a,
+					dx, dy);
+			a = -1;
+		}
+	}
+
+	if (a != -1) {
+		draw_floor_scan(v, a, b, y, xp + dx * a, yp + dy * a, dx, dy);
+	}
+}
+
+/* y is where the floor line starts on the viewport, that is, it is in
+ * range [v->h / 2 + 1, v->h[.
+ */
+static void draw_floor_line(const struct view *v, int y)
+{
+	int a, b;
+	real xp, yp, d, dp, dx, dy;
+	real xp2, yp2;
+	const struct camera *cam;
+	enum { PLAYERH = SLICEH >> 1 };
+
+	cam = &v->cam;
+	a = cam->angle + (v->afov >> 1);
+	b = iabs(a - cam->angle);
+	a = fixangle(a);
+
+	/* perpendicular distance to point on floor */
+	dp = itor(v->dst_plane * PLAYERH) / (y - (v->h >> 1));
+
+	/* distance to point on floor (projected on floor) */
+	d = rmul(dp, isintab[fixangle(A90 + b)]);
+
+	/* position on floor */
+	xp = cam->x + rmul(d, sintab[fixangle(A90 + a)]);
+	yp = cam->y - rmul(d, sintab[a]);
+
+	/* position on floor of opposite side of the view */
+	xp2 = cam->x + rmul(d, sintab[fixangle(A90 + a - v->afov)]);
+	yp2 = cam->y - rmul(d, sintab[fixangle(a - v->afov)]);
+
+	dx = (xp2 - xp) / v->w;
+	dy = (yp2 - yp) / v->w;
+
+#if 0
+	ktrace("a %f", sqrt((xp2 - xp) * (xp2 - xp) +
+		 	    (yp2 - yp) * (yp2 - yp)));
+
+	ktrace("xp2 yp2 %f %f", xp2, yp2);
+
+	/* vector perpendicular to view vector */
+	dx = sintab[s_cam.angle];
+	dy = -sintab[fixangle(A90 + s_cam.angle)];
+	k = RAYS * dp / DST_PLANE;
+	ktrace("k %f", k);
+	dx *= k;
+	dy *= k;
+	xp2 = xp + dx;
+	yp2 = yp - dy;
+	ktrace("xp2 yp2 %f %f", xp2, yp2);
+
+	ktrace("b %f", sqrt((xp2 - xp) * (xp2 - xp) +
+		 	    (yp2 - yp) * (yp2 - yp)));
+
+	dx /= RAYS;
+	dy /= -RAYS;
+#endif
+
+	draw_floor_scans(v, y, xp, yp, dx, dy);
+}
+
+static void draw_floor(const struct view *v)
+{
+	int y;
+
+	if (draw_floor_scan == NULL) {
+		return;
+	}
+
+	for (y = v->visplane.ymin; y < v->h; y++) {
+		draw_floor_line(v, y);
+	}
+}
+
+/* Returns the column hit or -1.
+ * ax and ay will contain the point hit if column >= 0.
+ * is_door and is_hdoor must be checked before.
+ */
+static int hit_hdoor(int wtype, real xinc, real yinc, real *ax, real *ay,
+		     int *ptex)
+{
+	real ix;
+	int idoor, tx, xopen;
+
+	idoor = door_index(wtype);
+	xopen = s_door_xopen[idoor];
+	if (xopen == 0) {
+		/* Fully open. */
+		return -1;
+	}
+
+	ix = *ax;
+	tx = rtoi(ix) & NOT_GRIDM;
+	ix += xinc / 2;
+	if ((rtoi(ix) & NOT_GRIDM) != tx) {
 		/* Not in the same tile, no hit. */
 		return -1;
 	}
 	
-	ty = float_to_int(iy) & GRIDM;
-	*ax += (xinc / GRIDW) * pwall->xopen;
-	*ay = iy;
-	*ppbmp = s_walls[wall_index(pwall->iwall)].pbmp;
-	return ty;
+	tx = rtoi(ix) & GRIDM;
+	if (xopen > tx) {
+		/* We hit the visible zone of the door... */
+		*ax = ix;
+		*ay += yinc / 2;
+		*ptex = wall_tex(s_doors.iwall[idoor], FACE_H);
+		return GRIDW - xopen + tx;
+	}
+
+	return -1;
+}
+
+/* Returns the column hit or -1.
+ * ax and ay will contain the point hit if column >= 0.
+ * is_door and is_vdoor must be checked before.
+ */
+static int hit_vdoor(int wtype, real xinc, real yinc, real *ax, real *ay,
+		     int *ptex)
+{
+	real iy;
+	int idoor, ty, xopen;
+
+	idoor = door_index(wtype);
+	xopen = s_door_xopen[idoor];
+	if (xopen == 0) {
+		/* Fully open. */
+		return -1;
+	}
+
+	iy = *ay;
+	ty = rtoi(iy) & NOT_GRIDM;
+	iy += yinc / 2;
+	if ((rtoi(iy) & NOT_GRIDM) != ty) {
+		/* Not in the same tile, no hit. */
+		return -1;
+	}
+	
+	ty = rtoi(iy) & GRIDM;
+	if (xopen > ty) {
+		/* We hit the visible zone of the door... */
+		*ax += xinc / 2;
+		*ay = iy;
+		*ptex = wall_tex(s_doors.iwall[idoor], FACE_V);
+		return GRIDW - xopen + ty;
+	}
+
+	return -1;
+}
+
+/* Returns the column hit or -1.
+ * ax and ay will contain the point hit if column >= 0.
+ * is_pwall and is_hwall must be checked before.
+ */
+static int hit_hpwall(int wtype, real xinc, real yinc, real *ax, real *ay,
+		      int *ptex)
+{
+	real ix;
+	int ipwall, tx, xopen;
+
+	ipwall = pwall_index(wtype);
+	xopen = s_pwall_xopen[ipwall];
+	if (xopen == GRIDW) {
+		/* Fully open. */
+		return -1;
+	}
+
+	ix = *ax;
+	tx = rtoi(ix) & NOT_GRIDM;
+	ix += (xinc / GRIDW) * xopen;
+	if ((rtoi(ix) & NOT_GRIDM) != tx) {
+		/* Not in the same tile, no hit. */
+		return -1;
+	}
+	
+	tx = rtoi(ix) & GRIDM;
+	*ax = ix;
+	*ay += (yinc / GRIDW) * xopen;
+	*ptex = wall_tex(s_pwalls.iwall[ipwall], FACE_H);
+	return tx;
+}
+
+/* Returns the column hit or -1.
+ * ax and ay will contain the point hit if column >= 0.
+ * is_pwall and is_vpwall must be checked before.
+ */
+static int hit_vpwall(int wtype, real xinc, real yinc, real *ax, real *ay,
+		      int *ptex)
+{
+	real iy;
+	int ipwall, ty, xopen;
+
+	ipwall = pwall_index(wtype);
+	xopen = s_pwall_xopen[ipwall];
+	if (xopen == GRIDW) {
+		/* Fully open. */
+		return -1;
+	}
+
+	iy = *ay;
+	ty = rtoi(iy) & NOT_GRIDM;
+	iy += (yinc / GRIDW) * xopen;
+	if ((rtoi(iy) & NOT_GRIDM) != ty) {
+		/* Not in the same tile, no hit. */
+		return -1;
+	}
+	
+	ty = rtoi(iy) & GRIDM;
+	*ax += (xinc / GRIDW) * xopen;
+	*ay = iy;
+	*ptex = wall_tex(s_pwalls.iwall[ipwall], FACE_V);
+	return ty;
+}
+
+static int get_hwall_tex(int a, int wtype, int px, int py)
+{
+	int wdtype, iwall;
+
+	if (a > 0 && a < A180) {
+		py++;
+	} else if (a > A180 && a < A360) {
+		py--;
+	}
+
+	wdtype = wall_at(px, py);
+	if (is_door(wdtype) && is_vdoor(wdtype)) {
+		iwall = wall_index(s_doors.iwall[door_index(wdtype)] + 1);
+	} else {
+		iwall = wall_index(wtype);
+	}
+
+	return wall_tex(iwall, FACE_H);
+}
+
+/* Returns the column hit or -1 for a diagonal wall tile 'wtype entered
+ * at *ax, *ay through an horizontal side, by a ray at angle 'a. If we
+ * enter through a solid side, we hit it as a wall. Else we hit the
+ * diagonal, and *ax, *ay will be the point hit, or we go out of the tile
+ * through the other side.
+ *
+ * This works for the diagonal with the solid half up and left, reflecting
+ * the ray for the others.
+ */
+static int hit_hdiag(int a, int wtype, real *ax, real *ay,
+		     int *ptex)
+{
+	int tx, ty, col;
+	real d, u, ex;
+
+	/* Where we enter. Rays facing up are one unit over the side, see
+	 * hit_hwall().
+	 */
+	ex = *ax;
+	if (a < A180) {
+		ex -= itantab[a];
+	}
+
+	if (wtype & DIAG_RIGHT) {
+		a = fixangle(A180 - a);
+	}
+	if (wtype & DIAG_DOWN) {
+		a = fixangle(A360 - a);
+	}
+
+	if (a > A180) {
+		/* We enter through the top side. */
+		*ptex = wall_tex(diag_index(wtype), FACE_H);
+		return rtoi(*ax) & GRIDM;
+	}
+
+	if (a <= A45) {
+		/* Not facing the diagonal. */
+		return -1;
+	}
+
+	/* Triangle with the bottom left corner, the point where we enter
+	 * and the point hit, at distance d of the corner.
+	 */
+	tx = rtoi(*ax) & NOT_GRIDM;
+	ty = rtoi(*ay) & NOT_GRIDM;
+	u = ex - itor(tx);
+	if (wtype & DIAG_RIGHT) {
+		u = itor(GRIDW) - u;
+	}
+	d = rmul(rmul(u, sintab[fixangle(A180 - a)]), isintab[a - A45]);
+
+	/* Offset of the point hit from the corner, in x and y. */
+	u = rmul(d, sintab[A45]);
+	if (u < 0 || u >= itor(GRIDW))
+		return -1;
+
+	col = rtoi(u);
+	if (col > GRIDM) {
+		col = GRIDM;
+	}
+
+	if (wtype & DIAG_RIGHT) {
+		*ax = itor(tx + GRIDW) - u;
+	} else {
+		*ax = itor(tx) + u;
+	}
+	if (wtype & DIAG_DOWN) {
+		*ay = itor(ty) + u;
+	} else {
+		*ay = itor(ty + GRIDW) - u;
+	}
+
+	/* Reflected, the texture would be seen reversed. */
+	if (((wtype & DIAG_RIGHT) != 0) != ((wtype & DIAG_DOWN) != 0)) {
+		col = GRIDM - col;
+	}
+
+	*ptex = wall_tex(diag_index(wtype), FACE_H);
+	return col;
+}
+
+/* Like hit_hdiag() for a tile entered through a vertical side. */
+static int hit_vdiag(int a, int wtype, real *ax, real *ay,
+		     int *ptex)
+{
+	int tx, ty, col;
+	real d, u, ey;
+
+	/* Rays facing left are one unit beyond the side, see hit_vwall(). */
+	ey = *ay;
+	if (a > A90 && a < A270) {
+		ey -= tantab[a];
+	}
+
+	if (wtype & DIAG_RIGHT) {
+		a = fixangle(A180 - a);
+	}
+	if (wtype & DIAG_DOWN) {
+		a = fixangle(A360 - a);
+	}
+
+	if (a < A90 || a > A270) {
+		/* We enter through the left side. */
+		*ptex = wall_tex(diag_index(wtype), FACE_V);
+		return rtoi(*ay) & GRIDM;
+	}
+
+	if (a >= A225) {
+		/* Not facing the diagonal. */
+		return -1;
+	}
+
+	/* Triangle with the top right corner, the point where we enter
+	 * and the point hit, at distance d of the corner.
+	 */
+	tx = rtoi(*ax) & NOT_GRIDM;
+	ty = rtoi(*ay) & NOT_GRIDM;
+	u = ey - itor(ty);
+	if (wtype & DIAG_DOWN) {
+		u = itor(GRIDW) - u;
+	}
+	d = rmul(rmul(u, sintab[a - A90]), isintab[A225 - a]);
+
+	/* Offset of the point hit from the corner, in x and y. */
+	u = rmul(d, sintab[A45]);
+	if (u < 0 || u >= itor(GRIDW))
+		return -1;
+
+	col = rtoi(itor(GRIDW) - u);
+	if (col > GRIDM) {
+		col = GRIDM;
+	}
+
+	if (wtype & DIAG_RIGHT) {
+		*ax = itor(tx) + u;
+	} else {
+		*ax = itor(tx + GRIDW) - u;
+	}
+	if (wtype & DIAG_DOWN) {
+		*ay = itor(ty + GRIDW) - u;
+	} else {
+		*ay = itor(ty) + u;
+	}
+
+	if (((wtype & DIAG_RIGHT) != 0) != ((wtype & DIAG_DOWN) != 0)) {
+		col = GRIDM - col;
+	}
+
+	*ptex = wall_tex(diag_index(wtype), FACE_H);
+	return col;
+}
+
+/* If the texture 'tex has a key color. */
+static int is_see_through(int tex)
+{
+	return s_textures[tex] != NULL && s_textures[tex]->use_key_color;
+}
+
+/* Adds the see-through wall hit 'h to 'ls, if there is room.
+ * They are added nearest first.
+ */
+static void add_layer(struct layers *ls, const struct hit *h)
+{
+	if (ls->n < MAX_LAYERS) {
+		ls->l[ls->n++] = *h;
+	}
+}
+
+/* Sets in 'dst the nearest layers of 'hls and 'vls in front of the wall
+ * at distance 'd.
+ */
+static void merge_layers(struct layers *dst, const struct layers *hls,
+			 const struct layers *vls, real d)
+{
+	int i, j;
+	const struct hit *l;
+
+	i = j = 0;
+	dst->n = 0;
+	while (dst->n < MAX_LAYERS) {
+		if (i < hls->n && (j >= vls->n || hls->l[i].d <= vls->l[j].d)) {
+			l = &hls->l[i++];
+		} else if (j < vls->n) {
+			l = &vls->l[j++];
+		} else {
+			break;
+		}
+		if (l->d >= d)
+			break;
+		dst->l[dst->n++] = *l;
+	}
+}
+
+/* Distance from 'cam to the point hit at 'ay by the ray at angle 'a,
+ * 'b being the angle between 'a and cam->angle, in absolute value.
+ * It is the distance along the view direction, so we do not see the
+ * walls curved.
+ */
+static real hdist(const struct camera *cam, int a, int b, real ay)
+{
+	real d;
+
+	d = rmul(rmul(cam->y - ay, isintab[a]), sintab[fixangle(A90 + b)]);
+	if (d < 0) {
+		d = -d;
+	}
+
+	return d;
+}
+
+/* Like hdist() for the point hit at 'ax. */
+static real vdist(const struct camera *cam, int a, int b, real ax)
+{
+	real d;
+
+	d = rmul(rmul(cam->x - ax, isintab[fixangle(A90 + a)]),
+		 sintab[fixangle(A90 + b)]);
+	if (d < 0) {
+		d = -d;
+	}
+
+	return d;
+}
+
+/* Returns the column hit or -1 for the tile 'wtype, not empty, at px, py,
+ * entered through an horizontal side.
+ */
+static int hit_htile(int a, int wtype, int px, int py, real xinc,
+		     real yinc, real *ax, real *ay, int *ptex)
+{
+	switch (wtype & TILE_TYPE_MASK) {
+	case WALL_TILE:
+		*ptex = get_hwall_tex(a, wtype, px, py);
+		// *ptex = wall_tex(wall_index(wtype), FACE_H);
+		return rtoi(*ax) & GRIDM;
+	case DOOR_TILE:
+		if (is_hdoor(wtype)) {
+			return hit_hdoor(wtype, xinc, yinc, ax, ay, ptex);
+		}
+		return -1;
+	case PWALL_TILE:
+		if (is_hpwall(wtype)) {
+			return hit_hpwall(wtype, xinc, yinc, ax, ay, ptex);
+		}
+		return -1;
+	default:
+		return hit_hdiag(a, wtype, ax, ay, ptex);
+	}
+}
+
+/* Cast a ray from 'cam at angle 'a and hit an horizontal wall.
+ * 'b is the angle between 'a and cam->angle, in absolute value.
+ * Sets in 'h the wall hit, with h->d REAL_MAX if none.
+ * The see-through walls we go through are added to 'ls.
+ */
+static void hit_hwall(const struct camera *cam, int a, int b, struct hit *h,
+		      struct layers *ls)
+{
+	int iter, wtype, px, py, col;
+	real ax, ay, hx, hy, xinc, yinc;
+
+	iter = 0;
+	ls->n = 0;
+	h->d = REAL_MAX;
+	h->tx = h->ty = 0;
+	h->face = FACE_H;
+	h->tex = 0;
+	h->col = 0;
+	if (a != 0 && a != A180) {
+		if (a > 0 && a < A180)  {
+			// facing up
+			ay = itor((rtoi(cam->y) & NOT_GRIDM) - 1);
+			yinc = itor(-GRIDW);
+		} else {
+			// ray facing down
+			ay = itor((rtoi(cam->y) & NOT_GRIDM) + GRIDW);
+			yinc = itor(GRIDW);
+		}
+
+		if (a == A90 || a == A270) {
+			ax = cam->x;
+			xinc = 0;
+		} else {
+			ax = cam->x + rmul(cam->y - ay, itantab[a]);	
+			xinc = rmul(yinc, -itantab[a]);
+		}
+
+		for (;;) {
+			iter++;
+			px = rtoi(ax);
+			py = rtoi(ay);
+			wtype = wall_at(px, py);
+			if (wtype != EMPTY_TILE) {
+				hx = ax;
+				hy = ay;
+				col = hit_htile(a, wtype, px, py, xinc, yinc,
+						&hx, &hy, &h->tex);
+				if (col >= 0) {
+					h->col = col;
+					h->tx = px >> GRIDS;
+					h->ty = py >> GRIDS;
+					if (!is_see_through(h->tex) ||
+					    !is_in_map(px, py))
+					{
+						ay = hy;
+						break;
+					}
+					h->d = hdist(cam, a, b, hy);
+					add_layer(ls, h);
+				}
+			}
+
+			ax += xinc;
+			ay += yinc;
+		}
+
+		kassert(iter <= MAPW);
+
+		h->d = hdist(cam, a, b, ay);
+	}
+}
+
+static int get_vwall_tex(int a, int wtype, int px, int py)
+{
+	int wdtype, iwall;
+
+	if (a < A90 || a > A270) {
+		px--;
+	} else if (a > A90 && a < A270) {
+		px++;
+	}
+
+	wdtype = wall_at(px, py);
+	if (is_door(wdtype) && is_hdoor(wdtype)) {
+		iwall = wall_index(s_doors.iwall[door_index(wdtype)] + 1);
+	} else {
+		iwall = wall_index(wtype);
+	}
+
+	return wall_tex(iwall, FACE_V);
+}
+
+/* Like hit_htile() for a tile entered through a vertical side. */
+static int hit_vtile(int a, int wtype, int px, int py, real xinc,
+		     real yinc, real *ax, real *ay, int *ptex)
+{
+	switch (wtype & TILE_TYPE_MASK) {
+	case WALL_TILE:
+		*ptex = get_vwall_tex(a, wtype, px, py);
+		// *ptex = wall_tex(wall_index(wtype), FACE_V);
+		return py & GRIDM;
+	case DOOR_TILE:
+		if (is_vdoor(wtype)) {
+			return hit_vdoor(wtype, xinc, yinc, ax, ay, ptex);
+		}
+		return -1;
+	case PWALL_TILE:
+		if (is_vpwall(wtype)) {
+			return hit_vpwall(wtype, xinc, yinc, ax, ay, ptex);
+		}
+		return -1;
+	default:
+		return hit_vdiag(a, wtype, ax, ay, ptex);
+	}
+}
+
+/* Like hit_hwall() for a vertical wall. */
+static void hit_vwall(const struct camera *cam, int a, int b, struct hit *h,
+		      struct layers *ls)
+{
+	int iter, wtype, px, py, col;
+	real ax, ay, hx, hy, xinc, yinc;
+
+	iter = 0;
+	ls->n = 0;
+	h->d = REAL_MAX;
+	h->tx = h->ty = 0;
+	h->face = FACE_V;
+	h->tex = 0;
+	h->col = 0;
+	if (a != A90 && a != A270) {
+		if (a > A90 && a < A270) {
+			// facing left
+			ax = itor((rtoi(cam->x) & NOT_GRIDM) - 1);
+			xinc = itor(-GRIDW);
+		} else {
+			// facing right
+			ax = itor((rtoi(cam->x) & NOT_GRIDM) + GRIDW);
+			xinc = itor(GRIDW);
+		}
+
+		if (a == 0 || a == A180) {
+			ay = cam->y;
+			yinc = 0;
+		} else {
+			ay = cam->y + rmul(cam->x - ax, tantab[a]); 
+			yinc = rmul(xinc, -tantab[a]); 
+		}
+
+		for (;;) {
+			iter++;
+			px = rtoi(ax);
+			py = rtoi(ay);
+			wtype = wall_at(px, py);
+			if (wtype != EMPTY_TILE) {
+				hx = ax;
+				hy = ay;
+				col = hit_vtile(a, wtype, px, py, xinc, yinc,
+						&hx, &hy, &h->tex);
+				if (col >= 0) {
+					h->col = col;
+					h->tx = px >> GRIDS;
+					h->ty = py >> GRIDS;
+					if (!is_see_through(h->tex) ||
+					    !is_in_map(px, py))
+					{
+						ax = hx;
+						break;
+					}
+					h->d = vdist(cam, a, b, hx);
+					add_layer(ls, h);
+				}
+			}
+
+			ax += xinc;
+			ay += yinc;
+		}
+
+		kassert(iter <= MAPW);
+
+		h->d = vdist(cam, a, b, ax);
+	}
+}
+
+static void draw_walls(struct view *v)
+{
+	int wh, x, a, b; 
+	struct hit *h, vh;
+	struct layers hls, vls;
+	const struct camera *cam;
+
+	cam = &v->cam;
+	for (x = 0; x < v->w; x++) {
+		a = cam->angle + (v->afov >> 1) - (x * v->afov) / v->w;
+		b = iabs(a - cam->angle);
+		a = fixangle(a);
+		h = &v->hits[s_drawi][x];
+		hit_hwall(cam, a, b, h, &hls);
+		hit_vwall(cam, a, b, &vh, &vls);
+		if (vh.d <= h->d) {
+			*h = vh;
+		}
+		
+		merge_layers(&v->layers[x], &hls, &vls, h->d);
+		v->zbuf[x] = h->d;
+		if (h->d > 0) {
+			wh = idivr(SLICEH * v->dst_plane, h->d);
+			draw_wall_column(v, s_textures[h->tex], h->col, wh, x);
+		}
+	}
+}
+
+/* Draws the see-through walls over everything, farthest first. */
+static void draw_layers(struct view *v)
+{
+	int x, i, wh;
+	const struct layers *ls;
+
+	for (x = 0; x < v->w; x++) {
+		ls = &v->layers[x];
+		for (i = ls->n - 1; i >= 0; i--) {
+			if (ls->l[i].d > 0) {
+				wh = idivr(SLICEH * v->dst_plane, ls->l[i].d);
+				draw_masked_column(v,
+						   s_textures[ls->l[i].tex],
+						   ls->l[i].col, wh, x);
+			}
+		}
+	}
+}
+
+static void draw_view(struct view *v)
+{
+	reset_visplane(v);
+	draw_walls(v);
+	set_visplane_bbox(v);
+	draw_floor(v);
+	draw_layers(v);
+	// draw_visplane_bbox(v);
+}
+
+/* Draws the viewports of the worker 'worker'. */
+static void draw_views(int worker)
+{
+	int i;
+
+	for (i = worker; i < s_nviews; i += s_nworkers) {
+		draw_view(&s_views[i]);
+	}
+}
+
+static int help_draw(void *data)
+{
+	const struct kernel_device *kd;
+	const struct helper *h;
+
+	kd = kernel_get_device();
+	h = data;
+	for (;;) {
+		kd->sem_wait(h->sem);
+		if (s_render_quit)
+			break;
+		s_helpers_job(h->worker);
+		kd->sem_post(s_helpers_done_sem);
+	}
+
+	return 0;
+}
+
+/* Sets where each viewport is in the buffer we draw into. */
+static void set_view_pixels(void)
+{
+	int i, pixsz;
+	struct bmp *bp;
+	struct view *v;
+
+	if (s_indexed) {
+		bp = &s_buf8_bmps[s_drawi];
+		pixsz = 1;
+	} else {
+		bp = &s_buf_bmps[s_drawi];
+		pixsz = 4;
+	}
+
+	for (i = 0; i < s_nviews; i++) {
+		v = &s_views[i];
+		v->pixels = bp->pixels + v->y0 * bp->pitch + v->x0 * pixsz;
+		v->pitch = bp->pitch;
+	}
+}
+
+/* Draws the viewports, sharing them with the helpers if there are more
+ * than one.
+ */
+static void draw(void)
+{
+	int i, nhelpers;
+	const struct kernel_device *kd;
+
+	select_drawers();
+	set_view_pixels();
+
+	nhelpers = s_nviews - 1;
+	if (nhelpers > s_nhelpers) {
+		nhelpers = s_nhelpers;
+	}
+	s_nworkers = nhelpers + 1;
+	s_helpers_job = draw_views;
+
+	kd = kernel_get_device();
+	for (i = 0; i < nhelpers; i++) {
+		kd->sem_post(s_helpers[i].sem);
+	}
+	draw_views(0);
+	for (i = 0; i < nhelpers; i++) {
+		kd->sem_wait(s_helpers_done_sem);
+	}
+}
+
+#if 0
+static void drawSprite(int x, int y, byte[] spr) {
+	// traslacion
+	x -= view_x;
+	y -= view_y;
+
+	// rotamos el centro del sprite para tenerlo en coordenadas de la vista
+	int a = fixangle(A90 + view_angle);
+	int b = fixangle(view_angle);
+	long_t xp = x * sin[a] - y * sin[b];
+
+	// xp es la distancia del centro al plano (con su perspectiva ya corregida)
+	// if (xp < DST_VPLANE)
+	if (xp <= 0)
+		return;
+
+	// yp es la distancia del centro al centro de vision
+	long_t yp = x * sin[b] + y * sin[a]; 
+
+	// a es la altura de la columna para todo el sprite, ya que todo el
+	// sprite mira directamente a la vista
+	// tambien es su anchura, puesto que es cuadrado
+	a = (int) ((((WALLMUL_F << 1) / xp) + 1) >> 1);
+
+	// proyectamos yp
+	b = SCRMID - (a >> 1) + (int) ((((((yp * DST_VPLANE) >> FS) << 1) / xp) + 1) >> 1);
+
+	// System.out.println(a + "," + b);
+
+	_drawSpr(a, b);
+ }
+
+static void _drawSpr(int wh, int x0) {
+	if (x0 >= SCRW) return;
+	if (x0 + wh < 0) return;
+
+	int ws = COLUMNH_F / wh;	// wall step
+
+	int xa = x0;		// first column on screen
+	int xb = x0 + wh;	// last column on screen
+	int t0 = 0;
+	if (xa < 0) {
+		xa = 0;
+		t0 = -ws*x0;	// first column on texture
+	}
+
+	if (xb >= SCRW) {
+		xb = SCRW - 1;		
+	}
+
+	if (wh > SCRH)
+		wh = SCRH;
+
+	for ( ; xa < xb; xa++) {
+		// System.out.println("t0 = " + (t0 >> 8));
+		drawScan(wall, t0 >> 8, buf, wh, xa); 
+		t0 += ws;
+	}
+}
+#endif
+
+/* Sets 'v' from 'vp', which must be valid. */
+static void set_view(struct view *v, const struct raycast_viewport *vp)
+{
+	double a;
+
+	v->x0 = vp->x;
+	v->y0 = vp->y;
+	v->w = vp->w;
+	v->h = vp->h;
+	v->afov = (int) floor(vp->fov * A360 / 360.0 + 0.5);
+	v->dst_plane = (int) floor((vp->w / 2.0) /
+				   tan(toradians(vp->fov / 2.0)) + 0.5);
+	v->follow = vp->follow;
+	if (v->follow) {
+		v->cam = s_cam;
+	} else {
+		v->cam.x = dtor(vp->cam_x * GRIDW);
+		v->cam.y = dtor(vp->cam_y * GRIDW);
+		a = fmod(vp->cam_angle, 360);
+		if (a < 0) {
+			a += 360;
+		}
+		v->cam.angle = fixangle((int) floor(a * A360 / 360 + 0.5));
+	}
+}
+
+static int is_viewport_valid(const struct raycast_viewport *vp)
+{
+	if (vp->x < 0 || vp->y < 0 || vp->w < 1 || vp->h < 1 ||
+	    vp->x + vp->w > SCRW || vp->y + vp->h > SCRH)
+	{
+		return 0;
+	}
+
+	if (vp->fov < 1 || vp->fov > 179)
+		return 0;
+
+	if (!vp->follow && (vp->cam_x <= 0 || vp->cam_x >= MAPW ||
+			    vp->cam_y <= 0 || vp->cam_y >= MAPH))
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+static int viewports_overlap(const struct raycast_viewport *a,
+			     const struct raycast_viewport *b)
+{
+	return a->x < b->x + b->w && b->x < a->x + a->w &&
+	       a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+int raycast_set_viewports(const struct raycast_viewport *vps, int n)
+{
+	int i, j;
+
+	if (!kassert(n >= 1 && n <= RAYCAST_MAX_VIEWPORTS))
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (!is_viewport_valid(&vps[i])) {
+			ktrace("viewport %d is not valid", i);
+			return 0;
+		}
+		for (j = 0; j < i; j++) {
+			if (viewports_overlap(&vps[i], &vps[j])) {
+				ktrace("viewports %d and %d overlap", j, i);
+				return 0;
+			}
+		}
+	}
+
+	/* The render thread reads them. After wait_frame() it is idle and
+	 * s_showi is the frame it drew last, the only one the queries read;
+	 * the next frame drawn sets the count of its own buffer.
+	 */
+	wait_frame();
+	for (i = 0; i < n; i++) {
+		set_view(&s_views[i], &vps[i]);
+	}
+	s_nviews = n;
+	s_buf_nviews[s_showi] = 0;
+	s_changed = 1;
+	return 1;
+}
+
+/* Returns the hit on column 'x of viewport 'i in the frame shown, or NULL
+ * if there is none.
+ */
+static const struct hit *get_shown_hit(int i, int x)
+{
+	const struct hit *h;
+
+	/* The render thread does not write s_showi. */
+	if (i < 0 || i >= s_buf_nviews[s_showi])
+		return NULL;
+	if (x < 0 || x >= s_views[i].w)
+		return NULL;
+
+	h = &s_views[i].hits[s_showi][x];
+	if (h->d <= 0 || h->d == REAL_MAX)
+		return NULL;
+
+	return h;
+}
+
+static void set_raycast_hit(struct raycast_hit *hit, const struct hit *h)
+{
+	hit->tile_x = h->tx;
+	hit->tile_y = h->ty;
+	hit->face = h->face == FACE_H ? RAYCAST_FACE_H : RAYCAST_FACE_V;
+	hit->tex = h->tex;
+	hit->tex_col = h->col;
+	hit->dist = rtod(h->d) / GRIDW;
+}
+
+int raycast_get_hit(int i, int x, struct raycast_hit *hit)
+{
+	const struct hit *h;
+
+	h = get_shown_hit(i, x);
+	if (h == NULL)
+		return 0;
+
+	set_raycast_hit(hit, h);
+	return 1;
+}
+
+int raycast_pick(int x, int y, struct raycast_hit *hit)
+{
+	int i, wh;
+	const struct hit *h;
+	const struct view *v;
+
+	for (i = 0; i < s_buf_nviews[s_showi]; i++) {
+		v = &s_views[i];
+		if (x >= v->x0 && x < v->x0 + v->w &&
+		    y >= v->y0 && y < v->y0 + v->h)
+		{
+			break;
+		}
+	}
+	if (i == s_buf_nviews[s_showi])
+		return 0;
+
+	h = get_shown_hit(i, x - v->x0);
+	if (h == NULL)
+		return 0;
+
+	/* As the column drawers do. */
+	wh = idivr(SLICEH * v->dst_plane, h->d) & ~1;
+	y -= v->y0;
+	if (wh < v->h && (y < (v->h - wh) >> 1 || y >= (v->h + wh) >> 1))
+		return 0;
+
+	set_raycast_hit(hit, h);
+	return 1;
+}
+
+/* Lines of sight are traced in LOS_ONE units per tile. */
+enum {
+	LOS_FS = 16,
+	LOS_ONE = 1 << LOS_FS,
+};
+
+/* A line of sight, in LOS_ONE units per tile. */
+struct los {
+	int x0, y0, x1, y1;
+};
+
+/* Returns 'c, in tiles, in LOS_ONE units, kept in [-1, max + 1] tiles. */
+static int los_coord(double c, int max)
+{
+	if (c < -1) {
+		c = -1;
+	} else if (c > max + 1) {
+		c = max + 1;
+	}
+
+	return (int) floor(c * LOS_ONE + 0.5);
+}
+
+/* If 'l crosses the door in direction 'dir, open 'xopen, of tile tx, ty.
+ * The door is in the middle of the tile, and covers [0, xopen[ of it,
+ * as in hit_hdoor() and hit_vdoor().
+ */
+static int los_hits_door(const struct los *l, int tx, int ty, int dir,
+			 int xopen)
+{
+	int m, a0, a1, b0, b1, b;
+
+	if (xopen == 0)
+		return 0;
+
+	if (dir == DOOR_DIR_H) {
+		m = ty * LOS_ONE + LOS_ONE / 2;
+		a0 = l->y0;
+		a1 = l->y1;
+		b0 = l->x0;
+		b1 = l->x1;
+		b = tx * LOS_ONE;
+	} else {
+		m = tx * LOS_ONE + LOS_ONE / 2;
+		a0 = l->x0;
+		a1 = l->x1;
+		b0 = l->y0;
+		b1 = l->y1;
+		b = ty * LOS_ONE;
+	}
+
+	if ((a0 < m && a1 < m) || (a0 > m && a1 > m))
+		return 0;
+	if (a0 == a1)
+		return 1;
+
+	/* Where we cross the middle of the tile. */
+	b = b0 + (int) ((long long) (b1 - b0) * (m - a0) / (a1 - a0)) - b;
+	return b >= 0 && b < xopen * (LOS_ONE / GRIDW);
+}
+
+/* Clips p + t * d, for t in [*t0, *t1], to [0, 1].
+ * Returns 0 if nothing is left.
+ */
+static int clip_los(double p, double d, double *t0, double *t1)
+{
+	double ta, tb, tmp;
+
+	if (d == 0)
+		return p >= 0 && p <= 1;
+
+	ta = -p / d;
+	tb = (1 - p) / d;
+	if (ta > tb) {
+		tmp = ta;
+		ta = tb;
+		tb = tmp;
+	}
+	if (ta > *t0) {
+		*t0 = ta;
+	}
+	if (tb < *t1) {
+		*t1 = tb;
+	}
+
+	return *t0 <= *t1;
+}
+
+/* If u, v, in tile units from the top left corner of the tile, is in the
+ * solid half of the diagonal 'wtype.
+ */
+static int is_in_diag(double u, double v, int wtype)
+{
+	if (wtype & DIAG_RIGHT) {
+		u = 1 - u;
+	}
+	if (wtype & DIAG_DOWN) {
+		v = 1 - v;
+	}
+
+	return u + v < 1;
+}
+
+/* If 'l crosses the solid half of the diagonal 'wtype at tile tx, ty.
+ * That half is convex, so it is enough to check the ends of the part of
+ * 'l in the tile.
+ */
+static int los_hits_diag(const struct los *l, int tx, int ty, int wtype)
+{
+	double u, v, du, dv, t0, t1;
+
+	u = (double) (l->x0 - tx * LOS_ONE) / LOS_ONE;
+	v = (double) (l->y0 - ty * LOS_ONE) / LOS_ONE;
+	du = (double) (l->x1 - l->x0) / LOS_ONE;
+	dv = (double) (l->y1 - l->y0) / LOS_ONE;
+	t0 = 0;
+	t1 = 1;
+	if (!clip_los(u, du, &t0, &t1) || !clip_los(v, dv, &t0, &t1))
+		return 0;
+
+	return is_in_diag(u + du * t0, v + dv * t0, wtype) ||
+	       is_in_diag(u + du * t1, v + dv * t1, wtype);
+}
+
+/* If the tile tx, ty, entered by 'l through its side 'face (FACE_H or
+ * FACE_V), blocks it.
+ */
+static int los_blocked(const struct los *l, int tx, int ty, int face)
+{
+	int i, wtype;
+
+	if (tx < 0 || tx >= MAPW || ty < 0 || ty >= MAPH)
+		return 1;
+
+	wtype = s_map[ty * MAPW + tx];
+	if (wtype == EMPTY_TILE)
+		return 0;
+
+	switch (wtype & TILE_TYPE_MASK) {
+	case WALL_TILE:
+		return !is_see_through(wall_tex(wall_index(wtype), face));
+	case DOOR_TILE:
+		i = door_index(wtype);
+		face = s_doors.dir[i] == DOOR_DIR_H ? FACE_H : FACE_V;
+		return !is_see_through(wall_tex(s_doors.iwall[i], face)) &&
+		       los_hits_door(l, tx, ty, s_doors.dir[i],
+				     s_doors.xopen[i]);
+	case PWALL_TILE:
+		i = pwall_index(wtype);
+		return !is_see_through(wall_tex(s_pwalls.iwall[i], face)) &&
+		       s_pwalls.xopen[i] < GRIDW;
+	default:
+		return !is_see_through(wall_tex(diag_index(wtype), FACE_H)) &&
+		       los_hits_diag(l, tx, ty, wtype);
+	}
+}
+
+/* What each tile does to the lines of sight, in LOS_TW * LOS_TH tiles
+ * around the map: the lines start and end at most one tile out of it,
+ * and the walk can step one more when a line ends at a corner. Kept
+ * current by set_los_tile() when a door or push wall moves, and by
+ * set_los_tiles() when the map or the textures change.
+ */
+enum {
+	LOS_TW = MAPW + 5,
+	LOS_TH = MAPH + 5,
+	/* Blocks the lines entering through the face FACE_H or FACE_V. */
+	LOS_BLOCK_H = 1 << FACE_H,
+	LOS_BLOCK_V = 1 << FACE_V,
+	/* Depends on the line, ask los_blocked(). */
+	LOS_ASK = 4,
+};
+
+static int s_los_tiles[LOS_TW * LOS_TH];
+
+/* The LOS_BLOCK_H and LOS_BLOCK_V of the s_walls entry iwall. */
+static int los_wall_tile(int iwall)
+{
+	int c;
+
+	c = 0;
+	if (!is_see_through(wall_tex(iwall, FACE_H)))
+		c |= LOS_BLOCK_H;
+	if (!is_see_through(wall_tex(iwall, FACE_V)))
+		c |= LOS_BLOCK_V;
+	return c;
+}
+
+/* The s_los_tiles entry of a tile of type 'wtype, like los_blocked(). */
+static int los_tile(int wtype)
+{
+	int i, face;
+
+	if (wtype == EMPTY_TILE)
+		return 0;
+
+	switch (wtype & TILE_TYPE_MASK) {
+	case WALL_TILE:
+		return los_wall_tile(wall_index(wtype));
+	case DOOR_TILE:
+		i = door_index(wtype);
+		face = s_doors.dir[i] == DOOR_DIR_H ? FACE_H : FACE_V;
+		if (is_see_through(wall_tex(s_doors.iwall[i], face)) ||
+		    s_doors.xopen[i] == 0)
+			return 0;
+		return LOS_ASK;
+	case PWALL_TILE:
+		i = pwall_index(wtype);
+		if (s_pwalls.xopen[i] >= GRIDW)
+			return 0;
+		return los_wall_tile(s_pwalls.iwall[i]);
+	default:
+		if (is_see_through(wall_tex(diag_index(wtype), FACE_H)))
+			return 0;
+		return LOS_ASK;
+	}
+}
+
+/* Updates the s_los_tiles entry of the map tile i. */
+static void set_los_tile(int i)
+{
+	s_los_tiles[(i / MAPW + 2) * LOS_TW + i % MAPW + 2] =
+		los_tile(s_map[i]);
+}
+
+static void set_los_tiles(void)
+{
+	int i;
+
+	for (i = 0; i < LOS_TW * LOS_TH; i++) {
+		s_los_tiles[i] = LOS_BLOCK_H | LOS_BLOCK_V;
+	}
+	for (i = 0; i < MAPSZ; i++) {
+		set_los_tile(i);
+	}
 }
 
-static struct bmp *get_hwall_bmp(int a, int wtype, int px, int py)
+/* If the tile tx, ty, entered by 'l through 'face, blocks it, from
+ * s_los_tiles.
+ */
+static int los_tile_blocks(const struct los *l, int tx, int ty, int face)
 {
-	int wdtype, iwall;
+	int c;
 
-	if (a > 0 && a < A180) {
-		py++;
-	} else if (a > A180 && a < A360) {
-		py--;
-	}
+	c = s_los_tiles[(ty + 2) * LOS_TW + tx + 2];
+	if (c & LOS_ASK)
+		return los_blocked(l, tx, ty, face);
+	return (c >> face) & 1;
+}
 
-	wdtype = wall_at(px, py);
-	if (is_door(wdtype) && is_vdoor(wdtype)) {
-		iwall = wall_index(s_doors[door_index(wdtype)].iwall + 1);
+/* A walk along the tiles of a line of sight.
+ * tx, ty: the tile we are at; sx, sy: the step, 1 or -1, on each axis.
+ * n: the tiles left to enter.
+ * distx and disty are the distances from the start to the next vertical
+ * and horizontal sides, which we compare as distx / adx < disty / ady
+ * without dividing.
+ */
+struct los_walk {
+	int tx, ty, sx, sy, n;
+	long long adx, ady, distx, disty;
+};
+
+static void start_los_walk(const struct los *l, struct los_walk *w)
+{
+	w->tx = l->x0 >> LOS_FS;
+	w->ty = l->y0 >> LOS_FS;
+	w->n = iabs((l->x1 >> LOS_FS) - w->tx) +
+	       iabs((l->y1 >> LOS_FS) - w->ty);
+	w->adx = iabs(l->x1 - l->x0);
+	w->ady = iabs(l->y1 - l->y0);
+	if (l->x1 > l->x0) {
+		w->sx = 1;
+		w->distx = ((long long) (w->tx + 1) << LOS_FS) - l->x0;
 	} else {
-		iwall = wall_index(wtype);
+		w->sx = -1;
+		w->distx = l->x0 - ((long long) w->tx << LOS_FS);
+	}
+	if (l->y1 > l->y0) {
+		w->sy = 1;
+		w->disty = ((long long) (w->ty + 1) << LOS_FS) - l->y0;
+	} else {
+		w->sy = -1;
+		w->disty = l->y0 - ((long long) w->ty << LOS_FS);
 	}
-
-	return s_walls[iwall].pbmp;
 }
 
-/* Cast a ray of at angle 'a and hit an horizontal wall.
- * 'b is the angle between 'a and view_angle, in absolute value.
- * Returns the distance to the hit point or FLT_MAX.
- * If not FLT_MAX, and 'column will be column of the wall hit.
+/* Goes on with the walk 'w of 'l to its end. Returns 1 if nothing blocks
+ * 'l from there.
  */
-static float hit_hwall(int a, int b, int *column, struct bmp **ppbmp)
+static int walk_los(const struct los *l, struct los_walk *w)
 {
-	int iter, wtype, px, py;
-	float d, ax, ay, xinc, yinc;
-
-	iter = 0;
-	if (a == 0 || a == A180) {
-		d = FLT_MAX;
-		ax = 0;
-		ay = 0;
-	} else { 
-		if (a > 0 && a < A180)  {
-			// facing up
-			ay = (float_to_int(view_y) & NOT_GRIDM) - 1;
-			yinc = -GRIDW;
+	while (w->n-- > 0) {
+		if (w->ady == 0 || (w->adx != 0 && w->distx * w->ady <
+						 w->disty * w->adx))
+		{
+			w->tx += w->sx;
+			w->distx += LOS_ONE;
+			if (los_tile_blocks(l, w->tx, w->ty, FACE_V))
+				return 0;
 		} else {
-			// ray facing down
-			ay = (float_to_int(view_y) & NOT_GRIDM) + GRIDW;
-			yinc = GRIDW;
+			w->ty += w->sy;
+			w->disty += LOS_ONE;
+			if (los_tile_blocks(l, w->tx, w->ty, FACE_H))
+				return 0;
 		}
+	}
 
-		if (a == A90 || a == A270) {
-			ax = view_x;
-			xinc = 0;
-		} else {
-			ax = view_x + (view_y - ay) * itantab[a];	
-			xinc = yinc * -itantab[a];
+	return 1;
+}
+
+/* Returns 1 if nothing blocks 'l. */
+static int trace_los(const struct los *l)
+{
+	struct los_walk w;
+
+	start_los_walk(l, &w);
+	return walk_los(l, &w);
+}
+
+enum {
+	/* Batches of at least twice this many lines are shared with the
+	 * render helpers, if they are not drawing.
+	 */
+	LOS_MIN_SPLIT = 1024,
+};
+
+/* The lines raycast_check_los() is checking. Worker w checks the lines
+ * from w * chunk, chunk lines, a multiple of 32 so each one sets its
+ * own words of vis.
+ */
+static struct {
+	const double *x0, *y0, *x1, *y1;
+	unsigned int *vis;
+	int n, chunk;
+} s_los_job;
+
+static void (*s_check_los_lines)(int i0, int i1);
+
+/* Puts in 'l line i of s_los_job. */
+static void get_los(int i, struct los *l)
+{
+	l->x0 = los_coord(s_los_job.x0[i], MAPW);
+	l->y0 = los_coord(s_los_job.y0[i], MAPH);
+	l->x1 = los_coord(s_los_job.x1[i], MAPW);
+	l->y1 = los_coord(s_los_job.y1[i], MAPH);
+}
+
+/* Checks the lines [i0, i1[ of s_los_job. i0 must be a multiple of 32. */
+static void check_los_lines(int i0, int i1)
+{
+	int i;
+	struct los l;
+	unsigned int *vis;
+
+	vis = s_los_job.vis;
+	for (i = i0; i < i1; i++) {
+		if ((i & 31) == 0) {
+			vis[i >> 5] = 0;
+		}
+		get_los(i, &l);
+		if (trace_los(&l)) {
+			vis[i >> 5] |= 1u << (i & 31);
 		}
+	}
+}
 
-		for (;;) {
-			iter++;
-			px = float_to_int(ax);
-			py = float_to_int(ay);
-			wtype = wall_at(px, py);
-			if (is_door(wtype) && is_hdoor(wtype)) {
-				*column = hit_hdoor(wtype, xinc, yinc,
-					       	    &ax, &ay, ppbmp);
-				if (*column >= 0) {
-					break;
-				}
-			} else if (is_pwall(wtype) && is_hpwall(wtype)) {
-				*column = hit_hpwall(wtype, xinc, yinc,
-					       	     &ax, &ay, ppbmp);
-				if (*column >= 0) {
-					break;
+#if USE_X86_SIMD
+
+/* For each mask of 4 lanes, the lanes in it. */
+static const long long s_lane_masks[16][4] = {
+	{ 0, 0, 0, 0 }, { -1, 0, 0, 0 }, { 0, -1, 0, 0 }, { -1, -1, 0, 0 },
+	{ 0, 0, -1, 0 }, { -1, 0, -1, 0 }, { 0, -1, -1, 0 },
+	{ -1, -1, -1, 0 }, { 0, 0, 0, -1 }, { -1, 0, 0, -1 },
+	{ 0, -1, 0, -1 }, { -1, -1, 0, -1 }, { 0, 0, -1, -1 },
+	{ -1, 0, -1, -1 }, { 0, -1, -1, -1 }, { -1, -1, -1, -1 },
+};
+
+/* los_coord() of c[0..3], in 64 bit lanes. */
+__attribute__((target("avx2")))
+static inline __m256i los_coords_avx2(const double *c, int max)
+{
+	__m256d v;
+
+	v = _mm256_loadu_pd(c);
+	v = _mm256_max_pd(v, _mm256_set1_pd(-1));
+	v = _mm256_min_pd(v, _mm256_set1_pd(max + 1));
+	v = _mm256_mul_pd(v, _mm256_set1_pd(LOS_ONE));
+	v = _mm256_floor_pd(_mm256_add_pd(v, _mm256_set1_pd(0.5)));
+	return _mm256_cvtepi32_epi64(_mm256_cvttpd_epi32(v));
+}
+
+/* Like start_los_walk() on one axis, from a0 to a1: the tile we start
+ * at, the step, the length and the distance to the next side. Returns the
+ * number of tiles to enter.
+ */
+__attribute__((target("avx2")))
+static inline __m256i start_los_axis_avx2(__m256i a0, __m256i a1,
+					  __m256i *t, __m256i *s,
+					  __m256i *ad, __m256i *dist)
+{
+	__m256i fwd, f, d;
+
+	*t = _mm256_srai_epi32(a0, LOS_FS);
+	fwd = _mm256_cmpgt_epi64(a1, a0);
+	*s = _mm256_or_si256(_mm256_andnot_si256(fwd,
+						 _mm256_set1_epi64x(-1)),
+			     _mm256_set1_epi64x(1));
+	f = _mm256_sub_epi64(a0, _mm256_slli_epi64(*t, LOS_FS));
+	*dist = _mm256_blendv_epi8(f, _mm256_sub_epi64(
+					_mm256_set1_epi64x(LOS_ONE), f), fwd);
+	d = _mm256_sub_epi64(a1, a0);
+	*ad = _mm256_blendv_epi8(_mm256_sub_epi64(_mm256_setzero_si256(), d),
+				 d, fwd);
+	d = _mm256_sub_epi64(_mm256_srai_epi32(a1, LOS_FS), *t);
+	return _mm256_blendv_epi8(_mm256_sub_epi64(_mm256_setzero_si256(), d),
+				  d, _mm256_cmpgt_epi64(d,
+						_mm256_setzero_si256()));
+}
+
+/* A line that has entered a tile marked LOS_ASK through 'face, with
+ * its walk from there.
+ */
+struct los_ask {
+	int i, face;
+	struct los l;
+	struct los_walk w;
+};
+
+/*
+ * Walks the lines [i, i + n[ of s_los_job, n a multiple of 4 up to 32, 4
+ * at a time, one in each 64 bit lane so distx * ady stays exact. Sets the
+ * bits of the lines seen in *vis. We step until the 4 are done, reading
+ * the tiles with a gather from s_los_tiles. The lanes keep stepping after
+ * being blocked, and the gather only skips the ones past their end, so
+ * the next gather does not wait for this one. A line that enters a tile
+ * marked LOS_ASK leaves its lane and is put in 'asks'. Returns how many.
+ *
+ * This calls nothing: the code we could call is not AVX, and mixing them
+ * is slow.
+ */
+__attribute__((target("avx2")))
+static int walk_los_lanes_avx2(int i, int n, unsigned int *vis,
+			       struct los_ask *asks)
+{
+	int j, k, m, vm, nasks;
+	__m256i x0, y0, x1, y1;
+	__m256i tx, ty, sx, sy, nleft, adx, ady, distx, disty, active;
+	__m256i stepx, want, c, hit, one, zero, ones, tw, lo32;
+	long long ax0[4], ay0[4], ax1[4], ay1[4];
+	long long atx[4], aty[4], asx[4], asy[4], an[4];
+	long long aadx[4], aady[4], adistx[4], adisty[4], astepx[4];
+	struct los_ask *a;
+
+	one = _mm256_set1_epi64x(LOS_ONE);
+	zero = _mm256_setzero_si256();
+	ones = _mm256_set1_epi64x(-1);
+	tw = _mm256_set1_epi64x(LOS_TW);
+	lo32 = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+	nasks = 0;
+	for (n += i; i < n; i += 4) {
+		x0 = los_coords_avx2(s_los_job.x0 + i, MAPW);
+		y0 = los_coords_avx2(s_los_job.y0 + i, MAPH);
+		x1 = los_coords_avx2(s_los_job.x1 + i, MAPW);
+		y1 = los_coords_avx2(s_los_job.y1 + i, MAPH);
+		nleft = _mm256_add_epi64(
+			start_los_axis_avx2(x0, x1, &tx, &sx, &adx, &distx),
+			start_los_axis_avx2(y0, y1, &ty, &sy, &ady, &disty));
+
+		/* The lines that stay in their tile are seen. */
+		active = _mm256_cmpgt_epi64(nleft, zero);
+		m = _mm256_movemask_pd(_mm256_castsi256_pd(active));
+		vm = m ^ 15;
+		while (m != 0) {
+			/* distx * ady < disty * adx, or ady == 0. */
+			stepx = _mm256_cmpgt_epi64(
+					_mm256_mul_epi32(disty, adx),
+					_mm256_mul_epi32(distx, ady));
+			stepx = _mm256_andnot_si256(
+					_mm256_cmpeq_epi64(adx, zero), stepx);
+			stepx = _mm256_or_si256(stepx,
+					_mm256_cmpeq_epi64(ady, zero));
+
+			tx = _mm256_add_epi64(tx, _mm256_and_si256(stepx, sx));
+			distx = _mm256_add_epi64(distx,
+					_mm256_and_si256(stepx, one));
+			ty = _mm256_add_epi64(ty,
+					_mm256_andnot_si256(stepx, sy));
+			disty = _mm256_add_epi64(disty,
+					_mm256_andnot_si256(stepx, one));
+			nleft = _mm256_add_epi64(nleft, ones);
+
+			c = _mm256_add_epi64(_mm256_mul_epi32(ty, tw), tx);
+			c = _mm256_cvtepi32_epi64(_mm256_mask_i64gather_epi32(
+				_mm_setzero_si128(),
+				s_los_tiles + 2 * LOS_TW + 2, c,
+				_mm256_castsi256_si128(
+					_mm256_permutevar8x32_epi32(
+						_mm256_cmpgt_epi64(nleft, ones),
+						lo32)),
+				4));
+
+			want = _mm256_blendv_epi8(
+					_mm256_set1_epi64x(LOS_BLOCK_H),
+					_mm256_set1_epi64x(LOS_BLOCK_V),
+					stepx);
+			hit = _mm256_cmpeq_epi64(_mm256_and_si256(c, want),
+						 zero);
+			hit = _mm256_andnot_si256(hit, active);
+
+			k = _mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_cmpgt_epi64(_mm256_and_si256(c,
+					_mm256_set1_epi64x(LOS_ASK)), zero)));
+			k &= m;
+			if (k != 0) {
+				_mm256_storeu_si256((__m256i *) ax0, x0);
+				_mm256_storeu_si256((__m256i *) ay0, y0);
+				_mm256_storeu_si256((__m256i *) ax1, x1);
+				_mm256_storeu_si256((__m256i *) ay1, y1);
+				_mm256_storeu_si256((__m256i *) atx, tx);
+				_mm256_storeu_si256((__m256i *) aty, ty);
+				_mm256_storeu_si256((__m256i *) asx, sx);
+				_mm256_storeu_si256((__m256i *) asy, sy);
+				_mm256_storeu_si256((__m256i *) an, nleft);
+				_mm256_storeu_si256((__m256i *) aadx, adx);
+				_mm256_storeu_si256((__m256i *) aady, ady);
+				_mm256_storeu_si256((__m256i *) adistx, distx);
+				_mm256_storeu_si256((__m256i *) adisty, disty);
+				_mm256_storeu_si256((__m256i *) astepx, stepx);
+				for (j = 0; j < 4; j++) {
+					if (!(k & (1 << j)))
+						continue;
+					a = &asks[nasks++];
+					a->i = i + j;
+					a->face = astepx[j] ? FACE_V : FACE_H;
+					a->l.x0 = (int) ax0[j];
+					a->l.y0 = (int) ay0[j];
+					a->l.x1 = (int) ax1[j];
+					a->l.y1 = (int) ay1[j];
+					a->w.tx = (int) atx[j];
+					a->w.ty = (int) aty[j];
+					a->w.sx = (int) asx[j];
+					a->w.sy = (int) asy[j];
+					a->w.n = (int) an[j];
+					a->w.adx = aadx[j];
+					a->w.ady = aady[j];
+					a->w.distx = adistx[j];
+					a->w.disty = adisty[j];
 				}
+				hit = _mm256_or_si256(hit, _mm256_loadu_si256(
+					(const __m256i *) s_lane_masks[k]));
 			}
+			active = _mm256_andnot_si256(hit, active);
+
+			/* The lines that get to their end are seen. */
+			hit = _mm256_and_si256(active,
+					       _mm256_cmpeq_epi64(nleft, zero));
+			vm |= _mm256_movemask_pd(_mm256_castsi256_pd(hit));
+			active = _mm256_andnot_si256(hit, active);
+			m = _mm256_movemask_pd(_mm256_castsi256_pd(active));
+		}
+		*vis |= (unsigned int) vm << (i & 31);
+	}
 
-			if (is_wall(wtype)) {
-				*column = float_to_int(ax) & GRIDM;
-				*ppbmp = get_hwall_bmp(a, wtype, px, py);
-				// *ppbmp = s_walls[wall_index(wtype)].pbmp;
-				break;
-			}
+	return nasks;
+}
 
-			ax += xinc;
-			ay += yinc;
+/* Like check_los_lines(), with walk_los_lanes_avx2(). */
+static void check_los_lines_avx2(int i0, int i1)
+{
+	int i, j, n, nasks;
+	struct los l;
+	struct los_ask asks[32];
+	unsigned int *vis;
+
+	for (i = i0; i < i1; i += 32) {
+		n = i1 - i;
+		if (n > 32) {
+			n = 32;
+		}
+		vis = &s_los_job.vis[i >> 5];
+		*vis = 0;
+		nasks = walk_los_lanes_avx2(i, n & ~3, vis, asks);
+		for (j = 0; j < nasks; j++) {
+			if (!los_blocked(&asks[j].l, asks[j].w.tx,
+					 asks[j].w.ty, asks[j].face) &&
+			    walk_los(&asks[j].l, &asks[j].w))
+			{
+				*vis |= 1u << (asks[j].i & 31);
+			}
+		}
+		for (j = n & ~3; j < n; j++) {
+			get_los(i + j, &l);
+			if (trace_los(&l)) {
+				*vis |= 1u << ((i + j) & 31);
+			}
 		}
+	}
+}
 
-		kassert(iter <= MAPW);
+#endif
 
-		d = (view_y - ay) * isintab[a] * sintab[fixangle(A90 + b)];
-		if (d < 0) {
-			d = -d;
-		}
+/* Checks the lines of worker 'worker'. */
+static void check_los_part(int worker)
+{
+	int i0, i1;
+
+	i0 = worker * s_los_job.chunk;
+	i1 = i0 + s_los_job.chunk;
+	if (i1 > s_los_job.n) {
+		i1 = s_los_job.n;
 	}
+	if (i0 < i1) {
+		s_check_los_lines(i0, i1);
+	}
+}
 
-	return d;
+static void init_los(void)
+{
+	s_check_los_lines = check_los_lines;
+#if USE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		s_check_los_lines = check_los_lines_avx2;
+	}
+#endif
 }
 
-static struct bmp *get_vwall_bmp(int a, int wtype, int px, int py)
+void raycast_check_los(const double *x0, const double *y0,
+		       const double *x1, const double *y1, int n,
+		       unsigned int *vis)
 {
-	int wdtype, iwall;
+	int i, nhelpers;
+	const struct kernel_device *kd;
 
-	if (a < A90 || a > A270) {
-		px--;
-	} else if (a > A90 && a < A270) {
-		px++;
+	if (n <= 0)
+		return;
+
+	s_los_job.x0 = x0;
+	s_los_job.y0 = y0;
+	s_los_job.x1 = x1;
+	s_los_job.y1 = y1;
+	s_los_job.vis = vis;
+	s_los_job.n = n;
+
+	/* While drawing, the helpers are busy and so are the cores. */
+	nhelpers = 0;
+	if (!s_drawing) {
+		nhelpers = n / LOS_MIN_SPLIT - 1;
+		if (nhelpers > s_nhelpers) {
+			nhelpers = s_nhelpers;
+		}
+	}
+	if (nhelpers <= 0) {
+		s_check_los_lines(0, n);
+		return;
 	}
 
-	wdtype = wall_at(px, py);
-	if (is_door(wdtype) && is_hdoor(wdtype)) {
-		iwall = wall_index(s_doors[door_index(wdtype)].iwall + 1);
-	} else {
-		iwall = wall_index(wtype);
+	s_los_job.chunk = ((n + nhelpers) / (nhelpers + 1) + 31) & ~31;
+	s_helpers_job = check_los_part;
+	kd = kernel_get_device();
+	for (i = 0; i < nhelpers; i++) {
+		kd->sem_post(s_helpers[i].sem);
 	}
+	check_los_part(0);
+	for (i = 0; i < nhelpers; i++) {
+		kd->sem_wait(s_helpers_done_sem);
+	}
+}
 
-	return s_walls[iwall].pbmp;
+/* The whole screen, following the player. */
+static void set_default_viewport(void)
+{
+	struct raycast_viewport vp;
+
+	memset(&vp, 0, sizeof(vp));
+	vp.w = SCRW;
+	vp.h = SCRH;
+	vp.fov = FOV;
+	vp.follow = 1;
+	raycast_set_viewports(&vp, 1);
 }
 
-/* Cast a ray of at angle 'a and hit an vertical wall.
- * 'b is the angle between 'a and view_angle, in absolute value.
- * Returns the distance to the hit point or FLT_MAX.
- * If not FLT_MAX, and 'column will be column of the wall hit.
- */
-static float hit_vwall(int a, int b, int *column, struct bmp **ppbmp)
+void raycast_init(void)
 {
-	int iter, wtype, px, py;
-	float d, ax, ay, xinc, yinc;
+	if (s_bench_mode && s_bench_font == NULL) {
+		s_bench_font = create_builtin_font();
+	}
+	init();
+	init_los();
+	set_default_viewport();
+	start_render_thread();
+}
 
-	iter = 0;
-	if (a == A90 || a == A270) {
-		d = FLT_MAX;
-		ax = 0;
-		ay = 0;
-	} else {
-		if (a > A90 && a < A270) {
-			// facing left
-			ax = (float_to_int(view_x) & NOT_GRIDM) - 1;
-			xinc = -GRIDW;
-		} else {
-			// facing right
-			ax = (float_to_int(view_x) & NOT_GRIDM) + GRIDW;
-			xinc = GRIDW;
-		}
+/* Collisions are done in tiles. A move is done in steps no longer than the
+ * radius, so the circle cannot jump over anything, and at most
+ * MAX_MOVE_STEPS, so each circle costs the same. After each step we push
+ * the circle out of the tiles around until it stays put; where the pushes
+ * don't agree (a wedge between walls and diagonals) we undo the step.
+ */
+enum {
+	MAX_MOVE_STEPS = 8,
+	/* Times we push a circle out of the tiles around after a step. */
+	MAX_MOVE_PUSHES = 8,
+};
 
-		if (a == 0 || a == A180) {
-			ay = view_y;
-			yinc = 0;
-		} else {
-			ay = view_y + (view_x - ax) * tantab[a]; 
-			yinc = xinc * -tantab[a]; 
+/* A push moving the circle less than this does not count. */
+#define MOVE_EPS 1e-9
+
+/* Pushes the circle at (*x, *y) of radius 'r' out of the convex polygon
+ * of 'n' vertices (vx[i], vy[i]), in any order around it. If the center
+ * is inside, it goes out by one of the edges with its bit set in 'edges',
+ * the edge from vertex i to i + 1 being bit i.
+ */
+static void push_from_poly(const double *vx, const double *vy, int n,
+			   int edges, double *x, double *y, double r)
+{
+	int i, j, iedge;
+	double ex, ey, len, nx, ny, s, smax, sout, orient, t, qx, qy, d, dmin;
+	double cx, cy;
+
+	/* +1 if clockwise, with y down. */
+	orient = (vx[1] - vx[0]) * (vy[2] - vy[0]) -
+		 (vy[1] - vy[0]) * (vx[2] - vx[0]) > 0 ? 1 : -1;
+
+	/* Distance to the line of each edge, positive outside. */
+	iedge = -1;
+	smax = -1e9;
+	sout = -1e9;
+	for (i = 0; i < n; i++) {
+		j = (i + 1) % n;
+		ex = vx[j] - vx[i];
+		ey = vy[j] - vy[i];
+		len = sqrt(ex * ex + ey * ey);
+		s = ((*x - vx[i]) * ey - (*y - vy[i]) * ex) * orient / len;
+		if (s > sout) {
+			sout = s;
 		}
+		if (s > smax && (edges & (1 << i))) {
+			smax = s;
+			iedge = i;
+		}
+	}
 
-		for (;;) {
-			iter++;
-			px = float_to_int(ax);
-			py = float_to_int(ay);
-			wtype = wall_at(px, py);
-			if (is_door(wtype) && is_vdoor(wtype)) {
-				*column = hit_vdoor(wtype, xinc, yinc,
-					       	    &ax, &ay, ppbmp);
-				if (*column >= 0) {
-					break;
-				}
-			} else if (is_pwall(wtype) && is_vpwall(wtype)) {
-				*column = hit_vpwall(wtype, xinc, yinc,
-					       	     &ax, &ay, ppbmp);
-				if (*column >= 0) {
-					break;
-				}
-			}
+	if (sout <= 0 && iedge >= 0) {
+		/* Out by the edge we went in the least. */
+		i = iedge;
+		j = (i + 1) % n;
+		ex = vx[j] - vx[i];
+		ey = vy[j] - vy[i];
+		len = sqrt(ex * ex + ey * ey);
+		nx = ey * orient / len;
+		ny = -ex * orient / len;
+		*x += nx * (r - smax);
+		*y += ny * (r - smax);
+		return;
+	}
 
-			if (is_wall(wtype)) {
-				*column = py & GRIDM;
-				*ppbmp = get_vwall_bmp(a, wtype, px, py);
-				// *ppbmp = s_walls[wall_index(wtype)].pbmp;
-				break;
-			}
+	if (sout <= 0 || sout >= r) {
+		return;
+	}
 
-			ax += xinc;
-			ay += yinc;
+	/* Outside, but maybe near: from the nearest point of the edges. */
+	cx = *x;
+	cy = *y;
+	dmin = r * r;
+	qx = qy = 0;
+	for (i = 0; i < n; i++) {
+		j = (i + 1) % n;
+		ex = vx[j] - vx[i];
+		ey = vy[j] - vy[i];
+		t = ((cx - vx[i]) * ex + (cy - vy[i]) * ey) /
+		    (ex * ex + ey * ey);
+		if (t < 0) {
+			t = 0;
+		} else if (t > 1) {
+			t = 1;
 		}
+		nx = vx[i] + ex * t;
+		ny = vy[i] + ey * t;
+		d = (cx - nx) * (cx - nx) + (cy - ny) * (cy - ny);
+		if (d < dmin) {
+			dmin = d;
+			qx = nx;
+			qy = ny;
+		}
+	}
 
-		kassert(iter <= MAPW);
-
-		d = (view_x - ax) * isintab[fixangle(A90 + a)] *
-		     sintab[fixangle(A90 + b)];
+	if (dmin < r * r) {
+		d = sqrt(dmin);
+		*x = qx + (cx - qx) * r / d;
+		*y = qy + (cy - qy) * r / d;
+	}
+}
 
-		if (d < 0) {
-			d = -d;
+/* Pushes the circle at (*x, *y) of radius 'r' out of the door panel
+ * from (ax, ay) to (bx, by), to the side of (x0, y0), where it was before
+ * the step, so it cannot cross it.
+ */
+static void push_from_panel(double ax, double ay, double bx, double by,
+			    double x0, double y0, double *x, double *y,
+			    double r)
+{
+	double ex, ey, len, nx, ny, s, t, qx, qy, d;
+
+	ex = bx - ax;
+	ey = by - ay;
+	len = sqrt(ex * ex + ey * ey);
+	t = ((*x - ax) * ex + (*y - ay) * ey) / (len * len);
+	if (t >= 0 && t <= 1) {
+		nx = -ey / len;
+		ny = ex / len;
+		if ((x0 - ax) * nx + (y0 - ay) * ny < 0) {
+			nx = -nx;
+			ny = -ny;
 		}
-
+		s = (*x - ax) * nx + (*y - ay) * ny;
+		if (s < r) {
+			*x += nx * (r - s);
+			*y += ny * (r - s);
+		}
+		return;
 	}
 
-	return d;
+	/* Beyond the ends. */
+	if (t < 0) {
+		qx = ax;
+		qy = ay;
+	} else {
+		qx = bx;
+		qy = by;
+	}
+	d = (*x - qx) * (*x - qx) + (*y - qy) * (*y - qy);
+	if (d < r * r && d > 0) {
+		d = sqrt(d);
+		*x = qx + (*x - qx) * r / d;
+		*y = qy + (*y - qy) * r / d;
+	}
 }
 
-static void draw_walls(void)
+/* Pushes the circle at (*x, *y) of radius 'r' out of what is solid in
+ * tile (tx, ty). (x0, y0) is where it was before the step.
+ */
+static void push_from_tile(int tx, int ty, double x0, double y0,
+			   double *x, double *y, double r)
 {
-	int angle, wh, x, a, b; 
-	int col, vcol;
-	float d, vd;
-	struct bmp *pbmp, *pvbmp;
+	int i, wtype, cx, cy, edges;
+	double vx[4], vy[4], len;
 
-	pbmp = pvbmp = NULL;
-	angle = view_angle + AFOV_D2;
-	col = vcol = 0;
-	for (x = 0; x < RAYS; x++, angle--) {
-		a = angle;
-		b = iabs(a - view_angle);
-		a = fixangle(a);
-		d = hit_hwall(a, b, &col, &pbmp);
-		vd = hit_vwall(a, b, &vcol, &pvbmp);
-		if (vd <= d) {
-			col = vcol;
-			d = vd;
-			pbmp = pvbmp;
+	/* Outside the map is like a wall. */
+	wtype = WALL_TILE | 1;
+	if (tx >= 0 && tx < MAPW && ty >= 0 && ty < MAPH) {
+		wtype = s_map[ty * MAPW + tx];
+	}
+	if (wtype == EMPTY_TILE) {
+		return;
+	}
+
+	switch (wtype & TILE_TYPE_MASK) {
+	case DOOR_TILE:
+		/* The panel covers [0, xopen) along the middle of the tile. */
+		i = door_index(wtype);
+		if (s_doors.xopen[i] == 0) {
+			return;
 		}
-		
-		s_zbuf[x] = d;
-		if (d > 0) {
-			wh = float_to_int(SLICEH * DST_PLANE / d);
-			draw_wall_column(pbmp, col, wh, x);
+		len = (double) s_doors.xopen[i] / GRIDW;
+		if (s_doors.dir[i] == DOOR_DIR_H) {
+			push_from_panel(tx, ty + 0.5, tx + len, ty + 0.5,
+					x0, y0, x, y, r);
+		} else {
+			push_from_panel(tx + 0.5, ty, tx + 0.5, ty + len,
+					x0, y0, x, y, r);
+		}
+		return;
+	case PWALL_TILE:
+		/* Solid until pushed away. */
+		if (s_pwalls.xopen[pwall_index(wtype)] == GRIDW) {
+			return;
 		}
+		break;
+	case DIAG_TILE:
+		/* The corner (cx, cy) and the two next to it. */
+		cx = (wtype & DIAG_RIGHT) ? 1 : 0;
+		cy = (wtype & DIAG_DOWN) ? 1 : 0;
+		vx[0] = tx + cx;
+		vy[0] = ty + cy;
+		vx[1] = tx + 1 - cx;
+		vy[1] = ty + cy;
+		vx[2] = tx + cx;
+		vy[2] = ty + 1 - cy;
+		push_from_poly(vx, vy, 3, 7, x, y, r);
+		return;
 	}
+
+	/* A wall, also if we can see through it. If we are inside (a push
+	 * wall has come back over us), we don't go out into other walls.
+	 */
+	vx[0] = vx[3] = tx;
+	vx[1] = vx[2] = tx + 1;
+	vy[0] = vy[1] = ty;
+	vy[2] = vy[3] = ty + 1;
+	edges = 0;
+	if (!is_wall(wall_at_tile(tx, ty - 1))) {
+		edges |= 1;
+	}
+	if (!is_wall(wall_at_tile(tx + 1, ty))) {
+		edges |= 2;
+	}
+	if (!is_wall(wall_at_tile(tx, ty + 1))) {
+		edges |= 4;
+	}
+	if (!is_wall(wall_at_tile(tx - 1, ty))) {
+		edges |= 8;
+	}
+	push_from_poly(vx, vy, 4, edges, x, y, r);
 }
 
-static void draw(void)
+/* Pushes the circle at (*x, *y) of radius 'r' out of the tiles it
+ * touches once. (x0, y0) is where it was before the step. Returns if it
+ * moved.
+ */
+static int push_circle(double x0, double y0, double *x, double *y,
+		       double r)
 {
-	reset_visplane();
-	draw_walls();
-	set_visplane_bbox();
-	draw_floor();
-	// draw_visplane_bbox();
-}
+	int tx, ty, tx0, ty0, tx1, ty1;
+	double xs, ys;
+
+	xs = *x;
+	ys = *y;
+	tx0 = (int) floor(xs - r);
+	ty0 = (int) floor(ys - r);
+	tx1 = (int) floor(xs + r);
+	ty1 = (int) floor(ys + r);
+	for (ty = ty0; ty <= ty1; ty++) {
+		for (tx = tx0; tx <= tx1; tx++) {
+			push_from_tile(tx, ty, x0, y0, x, y, r);
+		}
+	}
 
-#if 0
-static void drawSprite(int x, int y, byte[] spr) {
-	// traslacion
-	x -= view_x;
-	y -= view_y;
+	return fabs(*x - xs) > MOVE_EPS || fabs(*y - ys) > MOVE_EPS;
+}
 
-	// rotamos el centro del sprite para tenerlo en coordenadas de la vista
-	int a = fixangle(A90 + view_angle);
-	int b = fixangle(view_angle);
-	long_t xp = x * sin[a] - y * sin[b];
+/* Moves one circle, see raycast_move_circles(). */
+static void move_circle(double *px, double *py, double dx, double dy,
+			double r)
+{
+	int i, k, nsteps;
+	double x, y, x0, y0, len;
 
-	// xp es la distancia del centro al plano (con su perspectiva ya corregida)
-	// if (xp < DST_VPLANE)
-	if (xp <= 0)
+	len = sqrt(dx * dx + dy * dy);
+	if (len == 0) {
 		return;
+	}
 
-	// yp es la distancia del centro al centro de vision
-	long_t yp = x * sin[b] + y * sin[a]; 
+	nsteps = (int) ceil(len / r);
+	if (nsteps > MAX_MOVE_STEPS) {
+		/* Too fast: we move less. */
+		nsteps = MAX_MOVE_STEPS;
+		dx = dx * nsteps * r / len;
+		dy = dy * nsteps * r / len;
+	}
+	dx /= nsteps;
+	dy /= nsteps;
+
+	x = *px;
+	y = *py;
+	for (i = 0; i < nsteps; i++) {
+		x0 = x;
+		y0 = y;
+		x += dx;
+		y += dy;
+		for (k = 0; k < MAX_MOVE_PUSHES; k++) {
+			if (!push_circle(x0, y0, &x, &y, r)) {
+				break;
+			}
+		}
+		if (k == MAX_MOVE_PUSHES) {
+			/* Stuck: we stay where we were. */
+			x = x0;
+			y = y0;
+			break;
+		}
+	}
 
-	// a es la altura de la columna para todo el sprite, ya que todo el
-	// sprite mira directamente a la vista
-	// tambien es su anchura, puesto que es cuadrado
-	a = (int) ((((WALLMUL_F << 1) / xp) + 1) >> 1);
+	*px = x;
+	*py = y;
+}
 
-	// proyectamos yp
-	b = SCRMID - (a >> 1) + (int) ((((((yp * DST_VPLANE) >> FS) << 1) / xp) + 1) >> 1);
+void raycast_move_circles(double *x, double *y, const double *dx,
+			  const double *dy, const double *r, int n)
+{
+	int i;
+	double ri;
 
-	// System.out.println(a + "," + b);
+	for (i = 0; i < n; i++) {
+		ri = r[i];
+		if (kassert_fails(ri > 0 && ri < 0.5)) {
+			ri = ri <= 0 ? 1.0 / GRIDW : 0.49;
+		}
+		move_circle(&x[i], &y[i], dx[i], dy[i], ri);
+	}
+}
 
-	_drawSpr(a, b);
- }
+struct actorset *raycast_get_actors(void)
+{
+	return &s_actors;
+}
 
-static void _drawSpr(int wh, int x0) {
-	if (x0 >= SCRW) return;
-	if (x0 + wh < 0) return;
+/* The directions of raycast_get_flow() for each FLOW_RIGHT... */
+static const unsigned char s_flow_dirs[] = {
+	RAYCAST_FLOW_NONE,
+	RAYCAST_FLOW_RIGHT,
+	RAYCAST_FLOW_UP,
+	RAYCAST_FLOW_LEFT,
+	RAYCAST_FLOW_DOWN,
+};
 
-	int ws = COLUMNH_F / wh;	// wall step
+int raycast_get_flow(int goal_x, int goal_y, int tile_x, int tile_y,
+		     int *dist)
+{
+	int f, t;
 
-	int xa = x0;		// first column on screen
-	int xb = x0 + wh;	// last column on screen
-	int t0 = 0;
-	if (xa < 0) {
-		xa = 0;
-		t0 = -ws*x0;	// first column on texture
+	if (dist != NULL) {
+		*dist = -1;
 	}
-
-	if (xb >= SCRW) {
-		xb = SCRW - 1;		
+	if (goal_x < 0 || goal_x >= MAPW || goal_y < 0 || goal_y >= MAPH ||
+	    tile_x < 0 || tile_x >= MAPW || tile_y < 0 || tile_y >= MAPH)
+	{
+		return RAYCAST_FLOW_NONE;
 	}
 
-	if (wh > SCRH)
-		wh = SCRH;
-
-	for ( ; xa < xb; xa++) {
-		// System.out.println("t0 = " + (t0 >> 8));
-		drawScan(wall, t0 >> 8, buf, wh, xa); 
-		t0 += ws;
+	f = flowmap_get(&s_flow, goal_y * MAPW + goal_x);
+	t = tile_y * MAPW + tile_x;
+	if (dist != NULL && s_flow.dist[f][t] != FLOW_FAR) {
+		*dist = s_flow.dist[f][t];
 	}
+	return s_flow_dirs[s_flow.dir[f][t]];
 }
-#endif
 
-void raycast_init(void)
+void raycast_done(void)
 {
-	init();
+	int i;
+
+	wait_frame();
+	stop_render_thread();
+
+	for (i = 0; i < NTEXSETS; i++) {
+		free_texset(i);
+	}
+	doorset_free(&s_doors);
+	doorset_free(&s_pwalls);
+	flowmap_free(&s_flow);
+	actorset_free(&s_actors);
+	free(s_door_xopen);
+	free(s_pwall_xopen);
+	s_door_xopen = NULL;
+	s_pwall_xopen = NULL;
+	free_walls();
+	free_font(s_bench_font);
+	s_bench_font = NULL;
 }
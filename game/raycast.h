@@ -24,8 +24,125 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef RAYCAST_H
 #define RAYCAST_H
 
+struct actorset;
+
+enum {
+	RAYCAST_MAX_VIEWPORTS = 8,
+};
+
+/* Faces of a tile. */
+enum {
+	RAYCAST_FACE_H,
+	RAYCAST_FACE_V,
+};
+
+/* Directions of raycast_get_flow(): to the tile on the right (x + 1), up
+ * (y - 1), left or down.
+ */
+enum {
+	RAYCAST_FLOW_NONE,
+	RAYCAST_FLOW_RIGHT,
+	RAYCAST_FLOW_UP,
+	RAYCAST_FLOW_LEFT,
+	RAYCAST_FLOW_DOWN,
+};
+
+/* A camera drawn on a rectangle of the screen.
+ *
+ * x, y, w, h: the rectangle, inside the screen.
+ * fov: horizontal field of view in degrees, in range [1, 179].
+ * follow: if not 0, the camera is the player's. Else it is at cam_x,
+ *	   cam_y, in tiles (the center of the tile (1, 2) is (1.5, 2.5)),
+ *	   looking at cam_angle degrees (0 looks towards increasing x, 90
+ *	   towards decreasing y).
+ */
+struct raycast_viewport {
+	int x, y, w, h;
+	int fov;
+	int follow;
+	double cam_x, cam_y, cam_angle;
+};
+
+/* The wall seen on a column of a viewport.
+ *
+ * tile_x, tile_y: the tile of the wall (door, push wall...).
+ * face: RAYCAST_FACE_H if the ray entered the tile through its top or
+ *	 bottom side, RAYCAST_FACE_V if through its left or right side.
+ * tex: index of the wall texture.
+ * tex_col: column of the texture, in range [0, 63].
+ * dist: distance in tiles, along the view direction.
+ */
+struct raycast_hit {
+	int tile_x, tile_y;
+	int face;
+	int tex;
+	int tex_col;
+	double dist;
+};
+
 void raycast_init(void);
 void raycast_update(void);
 void raycast_draw(void);
+void raycast_done(void);
+
+/* Sets the 'n' viewports drawn each frame, in range
+ * [1, RAYCAST_MAX_VIEWPORTS]. They cannot overlap, and are drawn at the
+ * same time on different cores if possible. Call it after raycast_init(),
+ * which sets one viewport of the whole screen following the player.
+ * Returns 0 and changes nothing if they are not valid.
+ */
+int raycast_set_viewports(const struct raycast_viewport *vps, int n);
+
+/* Sets in 'hit' the wall seen on column 'x' of viewport 'i' in the frame
+ * shown by the last raycast_draw(), without casting again. See-through
+ * walls are not reported, only the wall behind them.
+ * Returns 0 if there is no such column or it has not been drawn yet.
+ */
+int raycast_get_hit(int i, int x, struct raycast_hit *hit);
+
+/* Like raycast_get_hit() for the screen pixel x, y, which must be on a
+ * wall of a viewport, else returns 0.
+ */
+int raycast_pick(int x, int y, struct raycast_hit *hit);
+
+/* Checks the lines of sight from (x0[i], y0[i]) to (x1[i], y1[i]), in
+ * tiles, for i in [0, n). Sets bit i % 32 of vis[i / 32] if nothing
+ * blocks line i, else clears it. Walls block, except the ones we can see
+ * through, and doors and push walls block as they are now. The tiles
+ * where the lines start are not checked. Large batches are shared with
+ * the render helpers when they are not drawing.
+ */
+void raycast_check_los(const double *x0, const double *y0,
+		       const double *x1, const double *y1, int n,
+		       unsigned int *vis);
+
+/* Moves the circles of radius r[i] at (x[i], y[i]) by (dx[i], dy[i]),
+ * in tiles, for i in [0, n), sliding along what they touch instead of
+ * going through it: walls, also the ones we can see through, doors as
+ * much as they are closed and push walls not fully pushed away. The
+ * radius must be in range (0, 0.5). A move is done in steps no longer
+ * than the radius, up to 8; longer moves are shortened.
+ */
+void raycast_move_circles(double *x, double *y, const double *dx,
+			  const double *dy, const double *r, int n);
+
+/* Returns the actors of the map (see actors.h), in tiles like the map.
+ * Each raycast_update() moves them by their velocity with
+ * raycast_move_circles() and sorts them by tile again.
+ */
+struct actorset *raycast_get_actors(void);
+
+/* Returns the direction to move from tile (tile_x, tile_y) to go to tile
+ * (goal_x, goal_y) by a shortest way, or RAYCAST_FLOW_NONE if we are
+ * there or it can't be reached. If 'dist' is not NULL, sets there the
+ * tiles to go, or -1. Actors go through the empty tiles, the doors at
+ * least half open and the push walls pushed away, moving to one of the 4
+ * tiles around each step.
+ * The ways to the last goals asked are kept and follow the doors as they
+ * move, so any number of actors can go to the same goal for the cost of
+ * one.
+ */
+int raycast_get_flow(int goal_x, int goal_y, int tile_x, int tile_y,
+		     int *dist);
 
 #endif
@@ -0,0 +1,169 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef REAL_H
+#define REAL_H
+
+/* The 'real' type used by the renderer for distances, world positions and
+ * trigonometric tables.
+ *
+ * By default it is a float. If configured with --enable-fixedpoint
+ * (PP_FIXED_POINT), it is an int with FS decimal bits, so the renderer
+ * can run on machines without a fast FPU.
+ *
+ * real + real, real - real, real * int and real / int work the same for
+ * both representations. For anything else use the functions below.
+ */
+
+#ifndef CFG_H
+#include "cfg/cfg.h"
+#endif
+
+#ifndef FLOATINT_H
+#include "cbase/floatint.h"
+#endif
+
+#include <float.h>
+#include <limits.h>
+
+enum {
+	/* decimal bits */
+	FS = 14,
+	FONE = 1 << FS,
+	DOT5 = 1 << (FS - 1),
+};
+
+#if PP_FIXED_POINT
+
+typedef int real;
+
+#define REAL_MAX INT_MAX
+#define REAL_NAME "fixed"
+
+/* int to real */
+static inline real itor(int i)
+{
+	return i << FS;
+}
+
+/* real to int, rounding to the nearest like float_to_int() */
+static inline int rtoi(real r)
+{
+	return (r + DOT5) >> FS;
+}
+
+static inline double rtod(real r)
+{
+	return (double) r / FONE;
+}
+
+/* double to real, saturating */
+static inline real dtor(double d)
+{
+	d *= FONE;
+	if (d >= INT_MAX)
+		return INT_MAX;
+	if (d <= -INT_MAX)
+		return -INT_MAX;
+	return (real) (d < 0 ? d - 0.5 : d + 0.5);
+}
+
+static inline real rmul(real a, real b)
+{
+	return (real) (((long long) a * b) >> FS);
+}
+
+static inline real rdiv(real a, real b)
+{
+	long long q;
+
+	if (b == 0)
+		return a < 0 ? -REAL_MAX : REAL_MAX;
+
+	q = ((long long) a << FS) / b;
+	if (q > INT_MAX)
+		return INT_MAX;
+	if (q < -INT_MAX)
+		return -INT_MAX;
+	return (real) q;
+}
+
+/* Returns round(n / r), where n is an int and r a positive real;
+ * saturates to INT_MAX.
+ */
+static inline int idivr(int n, real r)
+{
+	long long q;
+
+	if (r <= 0)
+		return INT_MAX;
+
+	q = (((long long) n << (FS + 1)) / r + 1) >> 1;
+	return q > INT_MAX ? INT_MAX : (int) q;
+}
+
+#else
+
+typedef float real;
+
+#define REAL_MAX FLT_MAX
+#define REAL_NAME "float"
+
+static inline real itor(int i)
+{
+	return i;
+}
+
+static inline int rtoi(real r)
+{
+	return float_to_int(r);
+}
+
+static inline real dtor(double d)
+{
+	return d;
+}
+
+static inline double rtod(real r)
+{
+	return r;
+}
+
+static inline real rmul(real a, real b)
+{
+	return a * b;
+}
+
+static inline real rdiv(real a, real b)
+{
+	return a / b;
+}
+
+static inline int idivr(int n, real r)
+{
+	return float_to_int(n / r);
+}
+
+#endif
+
+#endif
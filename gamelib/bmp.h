@@ -33,6 +33,11 @@ enum {
 	FLIPV = 2
 };
 
+/* Most dirty rects we keep, see add_dirty_rect. */
+enum {
+	MAX_DIRTY_RECTS = 16
+};
+
 struct rect {
 	int x;
 	int y;
@@ -55,6 +60,19 @@ void get_clip(struct rect *r);
 void rect_intersect(const struct rect *ra, const struct rect *rb,
 		    struct rect *dst);
 
+/*
+ * Dirty rects: after track_dirty(bmp), draw_bmp, draw_bmp_kct,
+ * draw_bmp_alpha, draw_mask_bmp, draw_line, draw_bmp_scaled and
+ * draw_bmp_rotated add to a list the parts of 'bmp' they change. They are
+ * merged to at most MAX_DIRTY_RECTS. Code that changes the pixels in other
+ * ways must call add_dirty_rect(), which does nothing if 'bmp' is not the
+ * bitmap tracked. The *_clip functions don't add anything.
+ */
+void track_dirty(const struct bmp *bmp);
+void add_dirty_rect(const struct bmp *bmp, const struct rect *r);
+int get_dirty_rects(const struct rect **rects);
+void clear_dirty_rects(void);
+
 void set_draw_color(unsigned int color);
 
 void draw_line(struct bmp *dst, int x0, int y0, int x1, int y1);
@@ -63,6 +81,7 @@ void draw_line(struct bmp *dst, int x0, int y0, int x1, int y1);
  * Draws the rect 'src_rect' of 'bmp' in position (dx,dy) of 'dst'.
  * If 'src_rect' is NULL, considers all 'bmp'.
  * Applies the current global clipping.
+ * If 'bmp' has alpha, it is blended with 'dst'.
  */
 void draw_bmp(const struct bmp *src, int dx, int dy, struct bmp *dst,
 	      const struct rect *src_rect);
@@ -76,6 +95,14 @@ void draw_bmp_kct(const struct bmp *src, int dx, int dy, struct bmp *dst,
 	          const struct rect *src_rect, int use_key_color,
 		  int transform);
 
+/*
+ * Same as draw_bmp, but the alpha of each pixel of 'src' (255 if it has no
+ * alpha and is not of the key color) is multiplied by 'alpha' [0..255],
+ * for fades.
+ */
+void draw_bmp_alpha(const struct bmp *src, int dx, int dy, struct bmp *dst,
+		    const struct rect *src_rect, int alpha);
+
 /* Draws a bitmap onto another, but it takes the pixels that are not
  * transparent, and draws them as transparent pixels on the dst bitmap.
  * The dst and src bitmaps must have the keycolor defined.
@@ -83,6 +110,69 @@ void draw_bmp_kct(const struct bmp *src, int dx, int dy, struct bmp *dst,
 void draw_mask_bmp(const struct bmp *src, int dx, int dy, struct bmp *dst,
 		   const struct rect *src_rect, int transform);
 
+/*
+ * Same as draw_bmp_kct, draw_mask_bmp and draw_line, but clipped by 'clip'
+ * instead of the global clipping, and with 'color' for the line (a
+ * palette index if 'dst' has a palette). The line is clipped by 'clip' the
+ * same as draw_line does and then only the pixels inside 'tile' are drawn,
+ * if 'tile' is not NULL.
+ * As they use no global state, they can be called from several threads at
+ * once.
+ */
+void draw_bmp_kct_clip(const struct bmp *src, int dx, int dy,
+		       struct bmp *dst, const struct rect *src_rect,
+		       int use_key_color, int transform,
+		       const struct rect *clip);
+void draw_mask_bmp_clip(const struct bmp *src, int dx, int dy,
+			struct bmp *dst, const struct rect *src_rect,
+			int transform, const struct rect *clip);
+void draw_line_clip(struct bmp *dst, int x0, int y0, int x1, int y1,
+		    unsigned int color, const struct rect *clip,
+		    const struct rect *tile);
+
+/*
+ * While 'rec' is set for 'dst', draw_bmp, draw_bmp_kct, draw_mask_bmp and
+ * draw_line to 'dst' give their arguments and the current clip (and the
+ * draw color) to 'rec' instead of drawing; they still add to the dirty
+ * rects. draw_bmp_alpha, draw_bmp_scaled and draw_bmp_rotated to 'dst'
+ * call rec->flush first, to draw what was given before. The *_clip
+ * functions draw directly. Set 'dst' to NULL to stop.
+ */
+struct draw_recorder {
+	void (*bmp)(const struct bmp *src, int dx, int dy,
+		    const struct rect *src_rect, int use_key_color,
+		    int transform, const struct rect *clip);
+	void (*mask_bmp)(const struct bmp *src, int dx, int dy,
+			 const struct rect *src_rect, int transform,
+			 const struct rect *clip);
+	void (*line)(int x0, int y0, int x1, int y1, unsigned int color,
+		     const struct rect *clip);
+	void (*flush)(void);
+};
+
+void set_draw_recorder(struct bmp *dst, const struct draw_recorder *rec);
+
+/*
+ * Draws the rect 'src_rect' of 'src' scaled to fill the rect (dx, dy, dw,
+ * dh) of 'dst', taking the nearest pixels.
+ * If 'src_rect' is NULL, considers all 'src'.
+ * Applies the current global clipping and the key color or alpha of 'src'.
+ * 'src' must be smaller than 16384 x 16384.
+ */
+void draw_bmp_scaled(const struct bmp *src, int dx, int dy, int dw, int dh,
+		     struct bmp *dst, const struct rect *src_rect);
+
+/*
+ * Draws the rect 'src_rect' of 'src' scaled by 'scale' and rotated
+ * 'angle' radians clockwise, with its center at (cx, cy) of 'dst'.
+ * If 'src_rect' is NULL, considers all 'src'.
+ * Applies the current global clipping and the key color or alpha of 'src'.
+ * 'src' must be smaller than 16384 x 16384.
+ */
+void draw_bmp_rotated(const struct bmp *src, int cx, int cy, double angle,
+		      double scale, struct bmp *dst,
+		      const struct rect *src_rect);
+
 void bmp_draw_init(void);
 
 #ifdef __cplusplus
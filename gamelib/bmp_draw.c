@@ -24,12 +24,79 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "bmp.h"
 #include "cbase/cbase.h"
 #include "cbase/kassert.h"
+#include "cfg/cfg.h"
+#include <math.h>
 #include <string.h>
 
+#if PP_SIMD && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define USE_X86_SIMD 0
+#endif
+
+/* Blitters of one row with key color, from 'src' to 'dst' going forward,
+ * or from 'src' to the 'n' pixels before 'dst' going backward (rev).
+ */
+struct kc_rows {
+	void (*row32)(const unsigned int *src, unsigned int *dst, int n,
+		      unsigned int key_color);
+	void (*row32_rev)(const unsigned int *src, unsigned int *dst, int n,
+			  unsigned int key_color);
+	void (*row8)(const unsigned char *src, unsigned int *dst, int n,
+		     const unsigned int *src_pal, unsigned int key_color);
+	void (*row8_rev)(const unsigned char *src, unsigned int *dst, int n,
+			 const unsigned int *src_pal, unsigned int key_color);
+};
+
+/* Fixed point of the positions stepped by the scaled and rotated blits,
+ * the most pixels they fetch at once and the bitmap size they support.
+ */
+enum {
+	FETCH_FS = 16,
+	FETCH_CHUNK = 256,
+	FETCH_MAXSZ = 1 << 14
+};
+
+/* Fetchers of 'n' pixels of 'src', which has 'rw' pixels per row, as
+ * colors into 'dst'. Pixel k is at column (u + k * du) >> FETCH_FS and
+ * row (v + k * dv) >> FETCH_FS, so we can walk any line of the bitmap.
+ */
+struct fetch_rows {
+	void (*row32)(const unsigned int *src, int rw, unsigned int *dst,
+		      int n, int u, int v, int du, int dv);
+	void (*row8)(const unsigned char *src, int rw, unsigned int *dst,
+		     int n, int u, int v, int du, int dv,
+		     const unsigned int *src_pal);
+};
+
 static struct rect s_clip;
 static unsigned int s_draw_color;
 static unsigned char s_draw_pal_color;
 
+/* The bitmap whose drawing we give to s_recorder, see set_draw_recorder. */
+static const struct bmp *s_recorder_dst;
+static const struct draw_recorder *s_recorder;
+
+/* The bitmap whose changes we track, and the parts changed. */
+static const struct bmp *s_dirty_bmp;
+static struct rect s_dirty[MAX_DIRTY_RECTS];
+static int s_ndirty;
+
+/* The SIMD row blitters for this CPU, or NULL to use the plain ones. */
+static const struct kc_rows *s_kc_rows;
+
+/* The fetchers for this CPU. */
+static const struct fetch_rows *s_fetch_rows;
+
+/* The expander of a row of palette indexes to colors for this CPU. */
+static void (*s_pal_row)(const unsigned char *src, unsigned int *dst, int n,
+			 const unsigned int *src_pal);
+
+/* The alpha blender of one row for this CPU, see blend_tail. */
+static void (*s_blend_row)(const unsigned int *src, unsigned int *dst,
+			   int n, int alpha);
+
 /*
  * Intersects 'ra' and 'rb' into 'dst'. 'ra' or 'rb' can be 'dst'.
  */
@@ -120,6 +187,166 @@ void get_clip(struct rect *r)
 	memcpy(r, &s_clip, sizeof(*r));
 }
 
+static int rect_area(const struct rect *r)
+{
+	return r->w * r->h;
+}
+
+/*
+ * Puts in 'dst' the smallest rect that contains 'ra' and 'rb', which are
+ * not empty. 'ra' or 'rb' can be 'dst'.
+ */
+static void rect_union(const struct rect *ra, const struct rect *rb,
+		       struct rect *dst)
+{
+	int x, y, x2, y2;
+
+	x = ra->x < rb->x ? ra->x : rb->x;
+	y = ra->y < rb->y ? ra->y : rb->y;
+	x2 = ra->x + ra->w > rb->x + rb->w ? ra->x + ra->w : rb->x + rb->w;
+	y2 = ra->y + ra->h > rb->y + rb->h ? ra->y + ra->h : rb->y + rb->h;
+	dst->x = x;
+	dst->y = y;
+	dst->w = x2 - x;
+	dst->h = y2 - y;
+}
+
+/*
+ * Starts to track the changes to 'bmp', with no dirty rects. NULL stops.
+ */
+void track_dirty(const struct bmp *bmp)
+{
+	s_dirty_bmp = bmp;
+	s_ndirty = 0;
+}
+
+/*
+ * If 'bmp' is the bitmap tracked, adds the rect 'r' of it to the dirty
+ * rects.
+ * A rect is merged with another if the rect that covers both is not
+ * bigger than the two, so the overlapping and touching ones become one.
+ * If there is no room, it is merged with the one that grows less.
+ */
+void add_dirty_rect(const struct bmp *bmp, const struct rect *r)
+{
+	int i, best, grow, best_grow;
+	struct rect q, u;
+
+	if (bmp == NULL || bmp != s_dirty_bmp || r == NULL)
+		return;
+
+	q.x = 0;
+	q.y = 0;
+	q.w = bmp->w;
+	q.h = bmp->h;
+	rect_intersect(r, &q, &q);
+	if (q.w <= 0)
+		return;
+
+	/* Each merge removes one rect, so this ends. */
+	i = 0;
+	while (i < s_ndirty) {
+		rect_union(&s_dirty[i], &q, &u);
+		if (rect_area(&u) <= rect_area(&s_dirty[i]) + rect_area(&q)) {
+			q = u;
+			s_dirty[i] = s_dirty[--s_ndirty];
+			i = 0;
+		} else {
+			i++;
+		}
+	}
+
+	if (s_ndirty == MAX_DIRTY_RECTS) {
+		best = 0;
+		best_grow = 0;
+		for (i = 0; i < s_ndirty; i++) {
+			rect_union(&s_dirty[i], &q, &u);
+			grow = rect_area(&u) - rect_area(&s_dirty[i]);
+			if (i == 0 || grow < best_grow) {
+				best = i;
+				best_grow = grow;
+			}
+		}
+		rect_union(&s_dirty[best], &q, &s_dirty[best]);
+		return;
+	}
+
+	s_dirty[s_ndirty++] = q;
+}
+
+/*
+ * Puts in '*rects' the dirty rects and returns how many there are.
+ */
+int get_dirty_rects(const struct rect **rects)
+{
+	*rects = s_dirty;
+	return s_ndirty;
+}
+
+/*
+ * Forgets the dirty rects, but keeps tracking the same bitmap.
+ */
+void clear_dirty_rects(void)
+{
+	s_ndirty = 0;
+}
+
+/*
+ * Adds the rect (x, y, w, h) of 'dst' inside the current clip to the dirty
+ * rects.
+ */
+static void mark_dirty(const struct bmp *dst, int x, int y, int w, int h)
+{
+	struct rect r;
+
+	if (dst == NULL || dst != s_dirty_bmp)
+		return;
+
+	r.x = x;
+	r.y = y;
+	r.w = w;
+	r.h = h;
+	rect_intersect(&r, &s_clip, &r);
+	add_dirty_rect(dst, &r);
+}
+
+/*
+ * Same as mark_dirty for the rect of 'dst' where 'src_rect' of 'src' is
+ * drawn at (dx, dy).
+ */
+static void mark_bmp_dirty(const struct bmp *src, int dx, int dy,
+			   const struct bmp *dst, const struct rect *src_rect)
+{
+	struct rect r;
+
+	if (src == NULL || dst == NULL || dst != s_dirty_bmp)
+		return;
+
+	r.x = 0;
+	r.y = 0;
+	r.w = src->w;
+	r.h = src->h;
+	if (src_rect != NULL)
+		rect_intersect(src_rect, &r, &r);
+	mark_dirty(dst, dx, dy, r.w, r.h);
+}
+
+void set_draw_recorder(struct bmp *dst, const struct draw_recorder *rec)
+{
+	if (kassert_fails(dst == NULL || rec != NULL))
+		return;
+
+	s_recorder_dst = dst;
+	s_recorder = rec;
+}
+
+/* Draws what the recorder of 'dst' has, if any, before we draw to it. */
+static void flush_recorder(const struct bmp *dst)
+{
+	if (dst != NULL && dst == s_recorder_dst)
+		s_recorder->flush();
+}
+
 static void blit_bmp32_32kc(const unsigned int *src, unsigned int *dst,
 			    int rows, int columns,
 			    int src_delta, int dst_delta,
@@ -556,19 +783,34 @@ static void mask_bmp8_32kc_hv(const unsigned char *src, unsigned int *dst,
 	}
 }
 
+/* This expands whole 8 bpp frames, so we do 4 pixels per iteration. */
+static void pal_row(const unsigned char *src, unsigned int *dst, int n,
+		    const unsigned int *src_pal)
+{
+	while (n >= 4) {
+		dst[0] = src_pal[src[0]];
+		dst[1] = src_pal[src[1]];
+		dst[2] = src_pal[src[2]];
+		dst[3] = src_pal[src[3]];
+		dst += 4;
+		src += 4;
+		n -= 4;
+	}
+	while (n--) {
+		*dst = src_pal[*src];
+		dst++;
+		src++;
+	}
+}
+
 static void blit_bmp8_32(const unsigned char *src, unsigned int *dst, int rows,
 			 int columns, int src_delta, int dst_delta,
 			 const unsigned int *src_pal, int src_palsz)
 {
-	int tmp;
-
+	src_delta += columns;
+	dst_delta += columns;
 	while (rows--) {
-		tmp = columns;
-		while (tmp--) {
-			*dst = src_pal[*src];
-			dst++;
-			src++;
-		}
+		s_pal_row(src, dst, columns, src_pal);
 		dst += dst_delta;
 		src += src_delta;
 	}
@@ -638,6 +880,731 @@ static void blit_bmp8_32_hv(const unsigned char *src, unsigned int *dst,
 	}
 }
 
+static inline void fetch_tail32(const unsigned int *src, int rw,
+				unsigned int *dst, int n, int u, int v,
+				int du, int dv)
+{
+	while (n--) {
+		*dst++ = src[(v >> FETCH_FS) * rw + (u >> FETCH_FS)];
+		u += du;
+		v += dv;
+	}
+}
+
+static inline void fetch_tail8(const unsigned char *src, int rw,
+			       unsigned int *dst, int n, int u, int v,
+			       int du, int dv, const unsigned int *src_pal)
+{
+	while (n--) {
+		*dst++ = src_pal[src[(v >> FETCH_FS) * rw + (u >> FETCH_FS)]];
+		u += du;
+		v += dv;
+	}
+}
+
+static void fetch_row32(const unsigned int *src, int rw, unsigned int *dst,
+			int n, int u, int v, int du, int dv)
+{
+	fetch_tail32(src, rw, dst, n, u, v, du, dv);
+}
+
+static void fetch_row8(const unsigned char *src, int rw, unsigned int *dst,
+		       int n, int u, int v, int du, int dv,
+		       const unsigned int *src_pal)
+{
+	fetch_tail8(src, rw, dst, n, u, v, du, dv, src_pal);
+}
+
+static const struct fetch_rows s_fetch_rows_c = {
+	fetch_row32, fetch_row8
+};
+
+/*
+ * Blends the 'n' colors of 'src', multiplied by their alpha, over 'dst',
+ * with the alpha of 'src' scaled by 'alpha' [0..256]. For each channel,
+ * being 'a' the alpha of the source scaled:
+ *
+ *	dst = src * alpha / 256 + dst * (255 - a) / 255
+ *
+ * The high byte of 'dst' is kept.
+ */
+static inline void blend_tail(const unsigned int *src, unsigned int *dst,
+			      int n, int alpha)
+{
+	unsigned int s, d, a, c, t, r;
+	int sh;
+
+	while (n--) {
+		s = *src++;
+		d = *dst;
+		a = ((s >> 24) * alpha) >> 8;
+		r = d & 0xff000000;
+		for (sh = 0; sh < 24; sh += 8) {
+			c = (((s >> sh) & 0xff) * alpha) >> 8;
+			t = ((d >> sh) & 0xff) * (255 - a);
+			c += (t + 1 + (t >> 8)) >> 8;
+			if (c > 255)
+				c = 255;
+			r |= c << sh;
+		}
+		*dst++ = r;
+	}
+}
+
+static void blend_row(const unsigned int *src, unsigned int *dst, int n,
+		      int alpha)
+{
+	blend_tail(src, dst, n, alpha);
+}
+
+#if USE_X86_SIMD
+
+/* The SIMD key color blitters draw several pixels at once, taking from
+ * 'dst' the ones of key color: (dst & mask) | (src & ~mask). A group
+ * fully of key color is not touched, and one without any is just stored.
+ * The pixels left at the end of the row are drawn one by one by the
+ * kc_tail functions, inlined in each so the AVX2 ones don't mix with SSE
+ * code.
+ */
+
+static inline void kc_tail32(const unsigned int *src, unsigned int *dst,
+			     int n, unsigned int key_color)
+{
+	while (n--) {
+		if (*src != key_color)
+			*dst = *src;
+		src++;
+		dst++;
+	}
+}
+
+static inline void kc_tail32_rev(const unsigned int *src, unsigned int *dst,
+				 int n, unsigned int key_color)
+{
+	while (n--) {
+		dst--;
+		if (*src != key_color)
+			*dst = *src;
+		src++;
+	}
+}
+
+static inline void kc_tail8(const unsigned char *src, unsigned int *dst,
+			    int n, const unsigned int *src_pal,
+			    unsigned int key_color)
+{
+	unsigned int color;
+
+	while (n--) {
+		color = src_pal[*src];
+		if (color != key_color)
+			*dst = color;
+		src++;
+		dst++;
+	}
+}
+
+static inline void kc_tail8_rev(const unsigned char *src, unsigned int *dst,
+				int n, const unsigned int *src_pal,
+				unsigned int key_color)
+{
+	unsigned int color;
+
+	while (n--) {
+		dst--;
+		color = src_pal[*src];
+		if (color != key_color)
+			*dst = color;
+		src++;
+	}
+}
+
+__attribute__((target("sse2")))
+static void kc_group_sse2(__m128i s, __m128i k, unsigned int *dst)
+{
+	__m128i m, d;
+	int bits;
+
+	m = _mm_cmpeq_epi32(s, k);
+	bits = _mm_movemask_epi8(m);
+	if (bits == 0) {
+		_mm_storeu_si128((__m128i *) dst, s);
+	} else if (bits != 0xffff) {
+		d = _mm_loadu_si128((const __m128i *) dst);
+		d = _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s));
+		_mm_storeu_si128((__m128i *) dst, d);
+	}
+}
+
+__attribute__((target("sse2")))
+static void kc_row32_sse2(const unsigned int *src, unsigned int *dst, int n,
+			  unsigned int key_color)
+{
+	__m128i k;
+
+	k = _mm_set1_epi32((int) key_color);
+	for (; n >= 4; n -= 4) {
+		kc_group_sse2(_mm_loadu_si128((const __m128i *) src), k, dst);
+		src += 4;
+		dst += 4;
+	}
+	kc_tail32(src, dst, n, key_color);
+}
+
+__attribute__((target("sse2")))
+static void kc_row32_rev_sse2(const unsigned int *src, unsigned int *dst,
+			      int n, unsigned int key_color)
+{
+	__m128i k, s;
+
+	k = _mm_set1_epi32((int) key_color);
+	for (; n >= 4; n -= 4) {
+		dst -= 4;
+		s = _mm_loadu_si128((const __m128i *) src);
+		s = _mm_shuffle_epi32(s, _MM_SHUFFLE(0, 1, 2, 3));
+		kc_group_sse2(s, k, dst);
+		src += 4;
+	}
+	kc_tail32_rev(src, dst, n, key_color);
+}
+
+/* SSE2 has no gather, so the palette is read one by one. */
+__attribute__((target("sse2")))
+static void kc_row8_sse2(const unsigned char *src, unsigned int *dst, int n,
+			 const unsigned int *src_pal, unsigned int key_color)
+{
+	__m128i k, s;
+
+	k = _mm_set1_epi32((int) key_color);
+	for (; n >= 4; n -= 4) {
+		s = _mm_setr_epi32((int) src_pal[src[0]], (int) src_pal[src[1]],
+				   (int) src_pal[src[2]], (int) src_pal[src[3]]);
+		kc_group_sse2(s, k, dst);
+		src += 4;
+		dst += 4;
+	}
+	kc_tail8(src, dst, n, src_pal, key_color);
+}
+
+__attribute__((target("sse2")))
+static void kc_row8_rev_sse2(const unsigned char *src, unsigned int *dst,
+			     int n, const unsigned int *src_pal,
+			     unsigned int key_color)
+{
+	__m128i k, s;
+
+	k = _mm_set1_epi32((int) key_color);
+	for (; n >= 4; n -= 4) {
+		dst -= 4;
+		s = _mm_setr_epi32((int) src_pal[src[3]], (int) src_pal[src[2]],
+				   (int) src_pal[src[1]], (int) src_pal[src[0]]);
+		kc_group_sse2(s, k, dst);
+		src += 4;
+	}
+	kc_tail8_rev(src, dst, n, src_pal, key_color);
+}
+
+static const struct kc_rows s_kc_rows_sse2 = {
+	kc_row32_sse2, kc_row32_rev_sse2, kc_row8_sse2, kc_row8_rev_sse2
+};
+
+/*
+ * The SIMD alpha blenders work on 16 bit channels, so the products fit,
+ * and skip the groups fully transparent (0).
+ */
+__attribute__((target("sse2")))
+static __m128i blend_half_sse2(__m128i s, __m128i d, __m128i alpha)
+{
+	__m128i a, t;
+
+	s = _mm_srli_epi16(_mm_mullo_epi16(s, alpha), 8);
+	a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+	t = _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), a));
+	t = _mm_add_epi16(t, _mm_add_epi16(_mm_set1_epi16(1),
+					   _mm_srli_epi16(t, 8)));
+	return _mm_add_epi16(s, _mm_srli_epi16(t, 8));
+}
+
+__attribute__((target("sse2")))
+static void blend_row_sse2(const unsigned int *src, unsigned int *dst,
+			   int n, int alpha)
+{
+	__m128i z, al, hi, s, d, lo16, hi16;
+
+	z = _mm_setzero_si128();
+	al = _mm_set1_epi16((short) alpha);
+	hi = _mm_set1_epi32((int) 0xff000000);
+	for (; n >= 4; n -= 4) {
+		s = _mm_loadu_si128((const __m128i *) src);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, z)) != 0xffff) {
+			d = _mm_loadu_si128((const __m128i *) dst);
+			lo16 = blend_half_sse2(_mm_unpacklo_epi8(s, z),
+					       _mm_unpacklo_epi8(d, z), al);
+			hi16 = blend_half_sse2(_mm_unpackhi_epi8(s, z),
+					       _mm_unpackhi_epi8(d, z), al);
+			s = _mm_packus_epi16(lo16, hi16);
+			s = _mm_or_si128(_mm_andnot_si128(hi, s),
+					 _mm_and_si128(hi, d));
+			_mm_storeu_si128((__m128i *) dst, s);
+		}
+		src += 4;
+		dst += 4;
+	}
+	blend_tail(src, dst, n, alpha);
+}
+
+__attribute__((target("avx2")))
+static void kc_group_avx2(__m256i s, __m256i k, unsigned int *dst)
+{
+	__m256i m, d;
+	int bits;
+
+	m = _mm256_cmpeq_epi32(s, k);
+	bits = _mm256_movemask_epi8(m);
+	if (bits == 0) {
+		_mm256_storeu_si256((__m256i *) dst, s);
+	} else if (bits != -1) {
+		d = _mm256_loadu_si256((const __m256i *) dst);
+		d = _mm256_blendv_epi8(s, d, m);
+		_mm256_storeu_si256((__m256i *) dst, d);
+	}
+}
+
+__attribute__((target("avx2")))
+static void kc_row32_avx2(const unsigned int *src, unsigned int *dst, int n,
+			  unsigned int key_color)
+{
+	__m256i k;
+
+	k = _mm256_set1_epi32((int) key_color);
+	for (; n >= 8; n -= 8) {
+		kc_group_avx2(_mm256_loadu_si256((const __m256i *) src), k,
+			      dst);
+		src += 8;
+		dst += 8;
+	}
+	kc_tail32(src, dst, n, key_color);
+}
+
+__attribute__((target("avx2")))
+static void kc_row32_rev_avx2(const unsigned int *src, unsigned int *dst,
+			      int n, unsigned int key_color)
+{
+	__m256i k, s, rev;
+
+	k = _mm256_set1_epi32((int) key_color);
+	rev = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	for (; n >= 8; n -= 8) {
+		dst -= 8;
+		s = _mm256_loadu_si256((const __m256i *) src);
+		s = _mm256_permutevar8x32_epi32(s, rev);
+		kc_group_avx2(s, k, dst);
+		src += 8;
+	}
+	kc_tail32_rev(src, dst, n, key_color);
+}
+
+/* The palette is read with a gather of the 8 indexes. */
+__attribute__((target("avx2")))
+static void kc_row8_avx2(const unsigned char *src, unsigned int *dst, int n,
+			 const unsigned int *src_pal, unsigned int key_color)
+{
+	__m256i k, s;
+
+	k = _mm256_set1_epi32((int) key_color);
+	for (; n >= 8; n -= 8) {
+		s = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) src));
+		s = _mm256_i32gather_epi32((const int *) src_pal, s, 4);
+		kc_group_avx2(s, k, dst);
+		src += 8;
+		dst += 8;
+	}
+	kc_tail8(src, dst, n, src_pal, key_color);
+}
+
+__attribute__((target("avx2")))
+static void kc_row8_rev_avx2(const unsigned char *src, unsigned int *dst,
+			     int n, const unsigned int *src_pal,
+			     unsigned int key_color)
+{
+	__m256i k, s, rev;
+
+	k = _mm256_set1_epi32((int) key_color);
+	rev = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	for (; n >= 8; n -= 8) {
+		dst -= 8;
+		s = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) src));
+		s = _mm256_permutevar8x32_epi32(s, rev);
+		s = _mm256_i32gather_epi32((const int *) src_pal, s, 4);
+		kc_group_avx2(s, k, dst);
+		src += 8;
+	}
+	kc_tail8_rev(src, dst, n, src_pal, key_color);
+}
+
+/* As pal_row, gathering 16 colors at once; only the entries of the
+ * indexes found are read, as there.
+ */
+__attribute__((target("avx2")))
+static void pal_row_avx2(const unsigned char *src, unsigned int *dst, int n,
+			 const unsigned int *src_pal)
+{
+	__m128i s;
+	__m256i lo, hi;
+
+	for (; n >= 16; n -= 16) {
+		s = _mm_loadu_si128((const __m128i *) src);
+		lo = _mm256_cvtepu8_epi32(s);
+		hi = _mm256_cvtepu8_epi32(_mm_srli_si128(s, 8));
+		lo = _mm256_i32gather_epi32((const int *) src_pal, lo, 4);
+		hi = _mm256_i32gather_epi32((const int *) src_pal, hi, 4);
+		_mm256_storeu_si256((__m256i *) dst, lo);
+		_mm256_storeu_si256((__m256i *) (dst + 8), hi);
+		src += 16;
+		dst += 16;
+	}
+	while (n--) {
+		*dst++ = src_pal[*src++];
+	}
+}
+
+static const struct kc_rows s_kc_rows_avx2 = {
+	kc_row32_avx2, kc_row32_rev_avx2, kc_row8_avx2, kc_row8_rev_avx2
+};
+
+/* The fetchers gather 8 pixels at once, stepping the 8 positions. */
+
+__attribute__((target("avx2")))
+static void fetch_start_avx2(int u, int v, int du, int dv,
+			     __m256i *uu, __m256i *vv)
+{
+	__m256i k;
+
+	k = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	*uu = _mm256_add_epi32(_mm256_set1_epi32(u),
+		_mm256_mullo_epi32(k, _mm256_set1_epi32(du)));
+	*vv = _mm256_add_epi32(_mm256_set1_epi32(v),
+		_mm256_mullo_epi32(k, _mm256_set1_epi32(dv)));
+}
+
+__attribute__((target("avx2")))
+static void fetch_row32_avx2(const unsigned int *src, int rw,
+			     unsigned int *dst, int n, int u, int v,
+			     int du, int dv)
+{
+	__m256i uu, vv, du8, dv8, w, i;
+
+	fetch_start_avx2(u, v, du, dv, &uu, &vv);
+	du8 = _mm256_slli_epi32(_mm256_set1_epi32(du), 3);
+	dv8 = _mm256_slli_epi32(_mm256_set1_epi32(dv), 3);
+	w = _mm256_set1_epi32(rw);
+	for (; n >= 8; n -= 8) {
+		i = _mm256_add_epi32(
+			_mm256_mullo_epi32(_mm256_srai_epi32(vv, FETCH_FS), w),
+			_mm256_srai_epi32(uu, FETCH_FS));
+		_mm256_storeu_si256((__m256i *) dst,
+			_mm256_i32gather_epi32((const int *) src, i, 4));
+		uu = _mm256_add_epi32(uu, du8);
+		vv = _mm256_add_epi32(vv, dv8);
+		dst += 8;
+	}
+	u = _mm256_cvtsi256_si32(uu);
+	v = _mm256_cvtsi256_si32(vv);
+	fetch_tail32(src, rw, dst, n, u, v, du, dv);
+}
+
+/*
+ * There is no gather of bytes, so we gather the 4 bytes ending at each
+ * pixel and keep the last. Then we gather the colors from the palette.
+ * We cannot read before 'src', so the lines that pass over its first
+ * pixels are fetched one by one.
+ */
+__attribute__((target("avx2")))
+static void fetch_row8_avx2(const unsigned char *src, int rw,
+			    unsigned int *dst, int n, int u, int v,
+			    int du, int dv, const unsigned int *src_pal)
+{
+	__m256i uu, vv, du8, dv8, w, i;
+	int umin, vmin;
+
+	umin = du < 0 ? u + du * (n - 1) : u;
+	vmin = dv < 0 ? v + dv * (n - 1) : v;
+	if ((vmin >> FETCH_FS) * rw + (umin >> FETCH_FS) < 3) {
+		fetch_tail8(src, rw, dst, n, u, v, du, dv, src_pal);
+		return;
+	}
+
+	fetch_start_avx2(u, v, du, dv, &uu, &vv);
+	du8 = _mm256_slli_epi32(_mm256_set1_epi32(du), 3);
+	dv8 = _mm256_slli_epi32(_mm256_set1_epi32(dv), 3);
+	w = _mm256_set1_epi32(rw);
+	for (; n >= 8; n -= 8) {
+		i = _mm256_add_epi32(
+			_mm256_mullo_epi32(_mm256_srai_epi32(vv, FETCH_FS), w),
+			_mm256_srai_epi32(uu, FETCH_FS));
+		i = _mm256_sub_epi32(i, _mm256_set1_epi32(3));
+		i = _mm256_i32gather_epi32((const int *) src, i, 1);
+		i = _mm256_srli_epi32(i, 24);
+		_mm256_storeu_si256((__m256i *) dst,
+			_mm256_i32gather_epi32((const int *) src_pal, i, 4));
+		uu = _mm256_add_epi32(uu, du8);
+		vv = _mm256_add_epi32(vv, dv8);
+		dst += 8;
+	}
+	u = _mm256_cvtsi256_si32(uu);
+	v = _mm256_cvtsi256_si32(vv);
+	fetch_tail8(src, rw, dst, n, u, v, du, dv, src_pal);
+}
+
+static const struct fetch_rows s_fetch_rows_avx2 = {
+	fetch_row32_avx2, fetch_row8_avx2
+};
+
+__attribute__((target("avx2")))
+static __m256i blend_half_avx2(__m256i s, __m256i d, __m256i alpha)
+{
+	__m256i a, t;
+
+	s = _mm256_srli_epi16(_mm256_mullo_epi16(s, alpha), 8);
+	a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xff), 0xff);
+	t = _mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(255), a));
+	t = _mm256_add_epi16(t, _mm256_add_epi16(_mm256_set1_epi16(1),
+						 _mm256_srli_epi16(t, 8)));
+	return _mm256_add_epi16(s, _mm256_srli_epi16(t, 8));
+}
+
+__attribute__((target("avx2")))
+static void blend_row_avx2(const unsigned int *src, unsigned int *dst,
+			   int n, int alpha)
+{
+	__m256i z, al, hi, s, d, lo16, hi16;
+
+	z = _mm256_setzero_si256();
+	al = _mm256_set1_epi16((short) alpha);
+	hi = _mm256_set1_epi32((int) 0xff000000);
+	for (; n >= 8; n -= 8) {
+		s = _mm256_loadu_si256((const __m256i *) src);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(s, z)) != -1) {
+			d = _mm256_loadu_si256((const __m256i *) dst);
+			lo16 = blend_half_avx2(_mm256_unpacklo_epi8(s, z),
+					       _mm256_unpacklo_epi8(d, z), al);
+			hi16 = blend_half_avx2(_mm256_unpackhi_epi8(s, z),
+					       _mm256_unpackhi_epi8(d, z), al);
+			s = _mm256_packus_epi16(lo16, hi16);
+			s = _mm256_or_si256(_mm256_andnot_si256(hi, s),
+					    _mm256_and_si256(hi, d));
+			_mm256_storeu_si256((__m256i *) dst, s);
+		}
+		src += 8;
+		dst += 8;
+	}
+	blend_tail(src, dst, n, alpha);
+}
+
+#endif
+
+/* Same as the blit_bmp*_32kc* functions, with the s_kc_rows blitters. */
+static void blit_kc_rows(const unsigned char *src, int src_offs,
+			 unsigned int *dst, int rows, int columns,
+			 int src_delta, int dst_delta,
+			 const unsigned int *src_pal, unsigned int key_color,
+			 int transform)
+{
+	const unsigned int *src32;
+	int dst_pitch;
+
+	dst_pitch = columns + dst_delta;
+	if (transform & FLIPV) {
+		dst += dst_pitch * (rows - 1);
+		dst_pitch = -dst_pitch;
+	}
+	if (transform & FLIPH) {
+		dst += columns;
+	}
+
+	if (src_pal != NULL) {
+		src += src_offs;
+		src_delta += columns;
+		while (rows--) {
+			if (transform & FLIPH) {
+				s_kc_rows->row8_rev(src, dst, columns, src_pal,
+						    key_color);
+			} else {
+				s_kc_rows->row8(src, dst, columns, src_pal,
+						key_color);
+			}
+			src += src_delta;
+			dst += dst_pitch;
+		}
+	} else {
+		src32 = (const unsigned int *) src + src_offs;
+		src_delta += columns;
+		while (rows--) {
+			if (transform & FLIPH) {
+				s_kc_rows->row32_rev(src32, dst, columns,
+						     key_color);
+			} else {
+				s_kc_rows->row32(src32, dst, columns,
+						 key_color);
+			}
+			src32 += src_delta;
+			dst += dst_pitch;
+		}
+	}
+}
+
+/*
+ * Draws the rect (sx, sy, columns, rows) of 'src', that has runs, at 'dst',
+ * which is 'dst_rw' pixels wide. Only the runs are visited, clipped to the
+ * columns.
+ */
+static void blit_runs(const struct bmp *src, int sx, int sy,
+		      unsigned int *dst, int dst_rw, int rows, int columns,
+		      int transform)
+{
+	int y, i, end, a, b, n;
+	const struct bmp_runs *runs;
+	const unsigned char *spix;
+	const unsigned int *spix32, *pal;
+	unsigned int *dpix;
+
+	if (transform & FLIPV) {
+		dst += dst_rw * (rows - 1);
+		dst_rw = -dst_rw;
+	}
+
+	runs = src->runs;
+	pal = src->pal;
+	for (y = sy; y < sy + rows; y++, dst += dst_rw) {
+		/* Only if src_rect goes out of the bitmap. */
+		if (y < 0 || y >= src->h)
+			continue;
+
+		spix = src->pixels + y * src->pitch;
+		spix32 = (const unsigned int *) spix;
+		end = runs->row[y + 1];
+		for (i = runs->row[y]; i < end; i++) {
+			a = runs->x[i];
+			if (a >= sx + columns)
+				break;
+			b = a + runs->len[i];
+			if (b <= sx)
+				continue;
+			if (a < sx)
+				a = sx;
+			if (b > sx + columns)
+				b = sx + columns;
+
+			n = b - a;
+			if (transform & FLIPH) {
+				dpix = dst + sx + columns - a;
+				if (pal != NULL) {
+					while (n--)
+						*--dpix = pal[spix[a++]];
+				} else {
+					while (n--)
+						*--dpix = spix32[a++];
+				}
+			} else {
+				dpix = dst + a - sx;
+				if (pal != NULL) {
+					while (n--)
+						*dpix++ = pal[spix[a++]];
+				} else {
+					memcpy(dpix, spix32 + a, n * 4);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Puts in 'dst' the 'n' pixels of 'src' (8 bpp if 'src_pal' is not NULL)
+ * as colors multiplied by their alpha, in reverse order if 'rev'. Without
+ * 'use_alpha' they are opaque, or transparent if of the key color and
+ * 'use_key_color'.
+ */
+static void alpha_src_row(const unsigned char *src, unsigned int *dst,
+			  int n, const unsigned int *src_pal, int use_alpha,
+			  int use_key_color, unsigned int key_color, int rev)
+{
+	int i, step;
+	unsigned int c;
+
+	step = 1;
+	if (rev) {
+		dst += n - 1;
+		step = -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (src_pal != NULL)
+			c = src_pal[src[i]];
+		else
+			c = ((const unsigned int *) src)[i];
+
+		if (use_alpha)
+			*dst = c;
+		else if (use_key_color && c == key_color)
+			*dst = 0;
+		else
+			*dst = c | 0xff000000;
+		dst += step;
+	}
+}
+
+/*
+ * Same as blit_bmp, but blending with alpha: the one of each pixel if
+ * 'use_alpha', else opaque but for the key color, scaled by 'alpha'
+ * [0..256].
+ */
+static void blit_alpha(const unsigned char *src, int src_offs,
+		       unsigned int *dst, int rows, int columns,
+		       int src_delta, int dst_delta,
+		       const unsigned int *src_pal, int use_alpha,
+		       int use_key_color, unsigned int key_color,
+		       int alpha, int transform)
+{
+	unsigned int tmp[FETCH_CHUNK];
+	const unsigned int *p;
+	int x, k, dst_pitch, src_pitch, pixsz;
+
+	dst_pitch = columns + dst_delta;
+	if (transform & FLIPV) {
+		dst += dst_pitch * (rows - 1);
+		dst_pitch = -dst_pitch;
+	}
+
+	pixsz = src_pal != NULL ? 1 : 4;
+	src += src_offs * pixsz;
+	src_pitch = (columns + src_delta) * pixsz;
+	while (rows--) {
+		for (x = 0; x < columns; x += k) {
+			k = columns - x;
+			if (k > FETCH_CHUNK)
+				k = FETCH_CHUNK;
+			if (use_alpha && src_pal == NULL &&
+			    !(transform & FLIPH))
+			{
+				p = (const unsigned int *) src + x;
+			} else {
+				alpha_src_row(src + x * pixsz, tmp, k,
+					      src_pal, use_alpha,
+					      use_key_color, key_color,
+					      transform & FLIPH);
+				p = tmp;
+			}
+
+			if (transform & FLIPH)
+				s_blend_row(p, dst + columns - x - k, k, alpha);
+			else
+				s_blend_row(p, dst + x, k, alpha);
+		}
+		src += src_pitch;
+		dst += dst_pitch;
+	}
+}
+
 static void blit_bmp(const unsigned char *src, int src_offs,
 		     unsigned char *dst, int dst_offs,
 		     int rows, int columns,
@@ -650,7 +1617,11 @@ static void blit_bmp(const unsigned char *src, int src_offs,
 	if (kassert_fails(dst_pal == NULL))
 		return;
 
-	if (use_key_color) {
+	if (use_key_color && s_kc_rows != NULL) {
+		blit_kc_rows(src, src_offs, (unsigned int *) dst + dst_offs,
+			     rows, columns, src_delta, dst_delta,
+			     src_pal, key_color, transform);
+	} else if (use_key_color) {
 		if (src_pal != NULL) {
 			switch (transform) {
 			default:
@@ -849,11 +1820,13 @@ static void mask_bmp(const unsigned char *src, int src_offs,
 
 /*
  * Draws the rect 'src_rect' of 'bmp' into a 32 bit color 'dst' in position
- * (dx, dy). 
+ * (dx, dy), clipped by 'clip'. 'alpha' [0..256] scales the alpha of 'src'
+ * (see blit_alpha).
  */
 static void draw_bmp32(const struct bmp *src, int dx, int dy,
 		       struct bmp *dst, const struct rect *src_rect,
-		       int use_key_color, int transform)
+		       int use_key_color, int alpha, int transform,
+		       const struct rect *clip)
 {
 	int src_rw, dst_rw;
 	struct rect p, q, sr;
@@ -872,7 +1845,7 @@ static void draw_bmp32(const struct bmp *src, int dx, int dy,
 	 * Current clip.
 	 */
 
-	memcpy(&p, &s_clip, sizeof(p));
+	memcpy(&p, clip, sizeof(p));
 
 	/*
 	 * Intersect with dest image.
@@ -919,6 +1892,21 @@ static void draw_bmp32(const struct bmp *src, int dx, int dy,
 	 * Now, from source, we have to take the rect q.x, q.y, p.w, p.h.
 	 * In dest, we have to paint in p.x, p.y .
 	 */
+	if (src->use_alpha || alpha < 256) {
+		blit_alpha(src->pixels, src_rw * q.y + q.x,
+			   (unsigned int *) dst->pixels + dst_rw * p.y + p.x,
+			   p.h, p.w, src_rw - p.w, dst_rw - p.w,
+			   src->pal, src->use_alpha, use_key_color,
+			   src->key_color, alpha, transform);
+		return;
+	}
+
+	if (use_key_color && src->runs != NULL) {
+		blit_runs(src, q.x, q.y, (unsigned int *) dst->pixels +
+			  dst_rw * p.y + p.x, dst_rw, p.h, p.w, transform);
+		return;
+	}
+
 	blit_bmp(src->pixels, src_rw * q.y + q.x,
 		dst->pixels, dst_rw * p.y + p.x,
 		p.h, p.w,
@@ -930,7 +1918,7 @@ static void draw_bmp32(const struct bmp *src, int dx, int dy,
 
 static void draw_mask_bmp32(const struct bmp *src, int dx, int dy,
 		            struct bmp *dst, const struct rect *src_rect,
-		            int transform)
+		            int transform, const struct rect *clip)
 {
 	int src_rw, dst_rw;
 	struct rect p, q, sr;
@@ -949,7 +1937,7 @@ static void draw_mask_bmp32(const struct bmp *src, int dx, int dy,
 	 * Current clip.
 	 */
 
-	memcpy(&p, &s_clip, sizeof(p));
+	memcpy(&p, clip, sizeof(p));
 
 	/*
 	 * Intersect with dest image.
@@ -1008,6 +1996,21 @@ static void draw_mask_bmp32(const struct bmp *src, int dx, int dy,
 void draw_bmp_kct(const struct bmp *src, int dx, int dy, struct bmp *dst,
 	          const struct rect *src_rect, int use_key_color,
 		  int transform)
+{
+	mark_bmp_dirty(src, dx, dy, dst, src_rect);
+	if (dst != NULL && dst == s_recorder_dst) {
+		s_recorder->bmp(src, dx, dy, src_rect, use_key_color,
+				transform, &s_clip);
+		return;
+	}
+	draw_bmp_kct_clip(src, dx, dy, dst, src_rect, use_key_color,
+			  transform, &s_clip);
+}
+
+void draw_bmp_kct_clip(const struct bmp *src, int dx, int dy,
+		       struct bmp *dst, const struct rect *src_rect,
+		       int use_key_color, int transform,
+		       const struct rect *clip)
 {
 	struct rect r;
 
@@ -1033,7 +2036,7 @@ void draw_bmp_kct(const struct bmp *src, int dx, int dy, struct bmp *dst,
 	}
 
 	draw_bmp32(src, dx, dy, dst, &r, src->use_key_color & use_key_color,
-		transform);
+		256, transform, clip);
 }
 
 void draw_bmp(const struct bmp *src, int dx, int dy, struct bmp *dst,
@@ -1042,8 +2045,60 @@ void draw_bmp(const struct bmp *src, int dx, int dy, struct bmp *dst,
 	draw_bmp_kct(src, dx, dy, dst, src_rect, 1, 0);
 }
 
+void draw_bmp_alpha(const struct bmp *src, int dx, int dy, struct bmp *dst,
+		    const struct rect *src_rect, int alpha)
+{
+	struct rect r;
+
+	if (kassert_fails(src != NULL))
+		return;
+
+	if (kassert_fails(dst != NULL))
+		return;
+
+	/*
+	 * Drawing to palettized bitmaps is not supported yet.
+	 */
+	if (kassert_fails(dst->pal == NULL))
+		return;
+
+	if (alpha <= 0)
+		return;
+
+	flush_recorder(dst);
+	if (src_rect == NULL) {
+		r.x = 0;
+		r.y = 0;
+		r.w = src->w;
+		r.h = src->h;
+	} else {
+		r = *src_rect;
+	}
+
+	/* [0..255] to [0..256] */
+	if (alpha > 255)
+		alpha = 255;
+	alpha += alpha >> 7;
+	mark_bmp_dirty(src, dx, dy, dst, &r);
+	draw_bmp32(src, dx, dy, dst, &r, src->use_key_color, alpha, 0,
+		   &s_clip);
+}
+
 void draw_mask_bmp(const struct bmp *src, int dx, int dy, struct bmp *dst,
 		   const struct rect *src_rect, int transform)
+{
+	mark_bmp_dirty(src, dx, dy, dst, src_rect);
+	if (dst != NULL && dst == s_recorder_dst) {
+		s_recorder->mask_bmp(src, dx, dy, src_rect, transform,
+				     &s_clip);
+		return;
+	}
+	draw_mask_bmp_clip(src, dx, dy, dst, src_rect, transform, &s_clip);
+}
+
+void draw_mask_bmp_clip(const struct bmp *src, int dx, int dy,
+			struct bmp *dst, const struct rect *src_rect,
+			int transform, const struct rect *clip)
 {
 	struct rect r;
 
@@ -1074,7 +2129,245 @@ void draw_mask_bmp(const struct bmp *src, int dx, int dy, struct bmp *dst,
 		r = *src_rect;
 	}
 
-	draw_mask_bmp32(src, dx, dy, dst, &r, transform);
+	draw_mask_bmp32(src, dx, dy, dst, &r, transform, clip);
+}
+
+/*
+ * Common part of the scaled and rotated blits. Puts in 'sr' the 'src_rect'
+ * of 'src' inside 'src', or all 'src' if NULL, and in 'clip' the current
+ * clip inside 'dst'. Returns 0 if there is nothing to draw.
+ */
+static int prepare_fetch(const struct bmp *src, const struct bmp *dst,
+			 const struct rect *src_rect, struct rect *sr,
+			 struct rect *clip)
+{
+	struct rect r;
+
+	if (kassert_fails(src != NULL))
+		return 0;
+
+	if (kassert_fails(dst != NULL))
+		return 0;
+
+	/*
+	 * Drawing to palettized bitmaps is not supported yet.
+	 */
+	if (kassert_fails(dst->pal == NULL))
+		return 0;
+
+	/*
+	 * So the positions in fixed point fit in 30 bits.
+	 */
+	if (kassert_fails(src->w < FETCH_MAXSZ && src->h < FETCH_MAXSZ))
+		return 0;
+
+	r.x = 0;
+	r.y = 0;
+	r.w = src->w;
+	r.h = src->h;
+	if (src_rect == NULL)
+		*sr = r;
+	else
+		rect_intersect(src_rect, &r, sr);
+	if (sr->w <= 0)
+		return 0;
+
+	r.w = dst->w;
+	r.h = dst->h;
+	rect_intersect(&s_clip, &r, clip);
+	return clip->w > 0;
+}
+
+/*
+ * Draws at 'dst' the 'n' pixels of 'src' starting at the position (u, v)
+ * and stepping (du, dv), in fixed point FETCH_FS. Blending if 'src' has
+ * alpha, else taking into account the key color if 'use_key_color'.
+ */
+static void draw_fetched(const struct bmp *src, unsigned int *dst, int n,
+			 int u, int v, int du, int dv, int use_key_color)
+{
+	unsigned int tmp[FETCH_CHUNK];
+	unsigned int *p;
+	int k;
+
+	while (n > 0) {
+		k = n < FETCH_CHUNK ? n : FETCH_CHUNK;
+		p = use_key_color || src->use_alpha ? tmp : dst;
+		if (src->pal != NULL) {
+			s_fetch_rows->row8(src->pixels, src->pitch, p, k,
+					   u, v, du, dv, src->pal);
+		} else {
+			s_fetch_rows->row32((const unsigned int *) src->pixels,
+					    src->pitch >> 2, p, k,
+					    u, v, du, dv);
+		}
+
+		if (src->use_alpha) {
+			s_blend_row(tmp, dst, k, 256);
+		} else if (use_key_color && s_kc_rows != NULL) {
+			s_kc_rows->row32(tmp, dst, k, src->key_color);
+		} else if (use_key_color) {
+			blit_bmp32_32kc(tmp, dst, 1, k, 0, 0, src->key_color);
+		}
+
+		/* Safe: the pixel at k is inside the bitmap. */
+		u += k * du;
+		v += k * dv;
+		dst += k;
+		n -= k;
+	}
+}
+
+void draw_bmp_scaled(const struct bmp *src, int dx, int dy, int dw, int dh,
+		     struct bmp *dst, const struct rect *src_rect)
+{
+	int y, u, v, du, dv, dst_rw;
+	unsigned int *dpix;
+	struct rect p, q, sr;
+
+	if (!prepare_fetch(src, dst, src_rect, &sr, &p))
+		return;
+
+	flush_recorder(dst);
+	if (dw <= 0 || dh <= 0)
+		return;
+
+	q.x = dx;
+	q.y = dy;
+	q.w = dw;
+	q.h = dh;
+	rect_intersect(&p, &q, &p);
+	if (p.w <= 0)
+		return;
+
+	mark_dirty(dst, p.x, p.y, p.w, p.h);
+
+	/*
+	 * We take the pixel at the center of each destination pixel.
+	 * Safe: (p.x - dx) * du < dw * du <= sr.w << FETCH_FS.
+	 */
+	du = (sr.w << FETCH_FS) / dw;
+	dv = (sr.h << FETCH_FS) / dh;
+	u = (sr.x << FETCH_FS) + (p.x - dx) * du + (du >> 1);
+	v = (sr.y << FETCH_FS) + (p.y - dy) * dv + (dv >> 1);
+
+	dst_rw = dst->pitch >> 2;
+	dpix = (unsigned int *) dst->pixels + dst_rw * p.y + p.x;
+	for (y = 0; y < p.h; y++) {
+		draw_fetched(src, dpix, p.w, u, v, du, 0, src->use_key_color);
+		v += dv;
+		dpix += dst_rw;
+	}
+}
+
+static long long floor_div(long long n, long long d)
+{
+	long long q;
+
+	q = n / d;
+	if (n % d != 0 && (n < 0) != (d < 0))
+		q--;
+	return q;
+}
+
+/*
+ * Narrows the steps [*k0, *k1[ to the ones k where a + k * d is in
+ * [0, lim[.
+ */
+static void clip_steps(long long a, long long d, long long lim,
+		       long long *k0, long long *k1)
+{
+	long long lo, hi;
+
+	if (d == 0) {
+		if (a < 0 || a >= lim)
+			*k1 = *k0;
+		return;
+	}
+
+	if (d > 0) {
+		lo = -floor_div(a, d);
+		hi = floor_div(lim - 1 - a, d);
+	} else {
+		lo = -floor_div(a - lim + 1, d);
+		hi = floor_div(-a, d);
+	}
+
+	if (lo > *k0)
+		*k0 = lo;
+	if (hi + 1 < *k1)
+		*k1 = hi + 1;
+}
+
+void draw_bmp_rotated(const struct bmp *src, int cx, int cy, double angle,
+		      double scale, struct bmp *dst,
+		      const struct rect *src_rect)
+{
+	int x0, x1, y0, y1, y, du, dv, dst_rw;
+	long long u, v, k0, k1;
+	double c, s, ex, ey, rx, ry;
+	unsigned int *dpix;
+	struct rect p, sr;
+
+	if (!prepare_fetch(src, dst, src_rect, &sr, &p))
+		return;
+
+	flush_recorder(dst);
+	if (scale <= 0)
+		return;
+
+	/*
+	 * (c, s) is the step in the source for one pixel to the right in
+	 * the destination, and (-s, c) for one pixel down. Smaller than a
+	 * pixel if they are too big.
+	 */
+	c = cos(angle) / scale;
+	s = sin(angle) / scale;
+	if (fabs(c) >= FETCH_MAXSZ || fabs(s) >= FETCH_MAXSZ)
+		return;
+
+	du = (int) floor(c * (1 << FETCH_FS) + 0.5);
+	dv = (int) floor(-s * (1 << FETCH_FS) + 0.5);
+
+	/*
+	 * The bounding box of the rotated rect, inside the clip.
+	 */
+	ex = (fabs(cos(angle)) * sr.w + fabs(sin(angle)) * sr.h) * scale / 2;
+	ey = (fabs(sin(angle)) * sr.w + fabs(cos(angle)) * sr.h) * scale / 2;
+	x0 = cx - ex <= p.x ? p.x : (int) floor(cx - ex);
+	x1 = cx + ex >= p.x + p.w ? p.x + p.w : (int) ceil(cx + ex);
+	y0 = cy - ey <= p.y ? p.y : (int) floor(cy - ey);
+	y1 = cy + ey >= p.y + p.h ? p.y + p.h : (int) ceil(cy + ey);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	mark_dirty(dst, x0, y0, x1 - x0, y1 - y0);
+
+	/*
+	 * For each row, the steps whose pixel falls inside the source rect
+	 * are found exactly, so the fetchers don't check anything.
+	 */
+	dst_rw = dst->pitch >> 2;
+	dpix = (unsigned int *) dst->pixels + dst_rw * y0;
+	rx = x0 + 0.5 - cx;
+	for (y = y0; y < y1; y++) {
+		ry = y + 0.5 - cy;
+		u = (long long) floor((sr.w / 2.0 + rx * c + ry * s) *
+				      (1 << FETCH_FS));
+		v = (long long) floor((sr.h / 2.0 - rx * s + ry * c) *
+				      (1 << FETCH_FS));
+		k0 = 0;
+		k1 = x1 - x0;
+		clip_steps(u, du, (long long) sr.w << FETCH_FS, &k0, &k1);
+		clip_steps(v, dv, (long long) sr.h << FETCH_FS, &k0, &k1);
+		if (k0 < k1) {
+			draw_fetched(src, dpix + x0 + k0, (int) (k1 - k0),
+				     (int) (u + k0 * du) + (sr.x << FETCH_FS),
+				     (int) (v + k0 * dv) + (sr.y << FETCH_FS),
+				     du, dv, src->use_key_color);
+		}
+		dpix += dst_rw;
+	}
 }
 
 void set_draw_color(unsigned int color)
@@ -1085,22 +2378,18 @@ void set_draw_color(unsigned int color)
 
 static void draw_line32(struct bmp *dst, int x, int y,
 			int d1x, int d1y, int d2x, int d2y,
-		       	int m, int m2, int n)
+		       	int m, int m2, int n, unsigned int color)
 {
 	unsigned int *pixels;
 	int p, rw;
 
-	/* Any transparency? Don't paint. */
-	if (s_draw_color & 0xff000000)
-		return;
-       
 	pixels = (unsigned int *) dst->pixels;
 	rw = dst->pitch >> 2;
 	y *= rw;
 	d1y *= rw;
 	d2y *= rw;
 	for (p = 0; p <= m; p++) {
-		pixels[y + x] = s_draw_color;
+		pixels[y + x] = color;
 		m2 += n;
 		if (m2 >= m) {
 			m2 -= m;
@@ -1115,7 +2404,7 @@ static void draw_line32(struct bmp *dst, int x, int y,
 
 static void draw_line8(struct bmp *dst, int x, int y,
 		       int d1x, int d1y, int d2x, int d2y,
-		       int m, int m2, int n)
+		       int m, int m2, int n, unsigned char pal_color)
 {
 	int p;
 
@@ -1123,7 +2412,7 @@ static void draw_line8(struct bmp *dst, int x, int y,
 	d1y *= dst->pitch;
 	d2y *= dst->pitch;
 	for (p = 0; p <= m; p++) {
-		dst->pixels[y + x] = s_draw_pal_color;
+		dst->pixels[y + x] = pal_color;
 		m2 += n;
 		if (m2 >= m) {
 			m2 -= m;
@@ -1137,19 +2426,104 @@ static void draw_line8(struct bmp *dst, int x, int y,
 }
 
 /*
- * Bresenham.
+ * Like draw_line32 and draw_line8, but only inside 'tile'.
+ * After p steps we have moved p times along the major axis and
+ * (m2 + p * n) / m times along the other, so we find the steps in the
+ * tile on each axis, jump to the first and stop after the last.
  */
+static void draw_line_tile(struct bmp *dst, int x, int y,
+			   int d1x, int d1y, int d2x, int d2y,
+			   int m, int m2, int n, unsigned int color,
+			   const struct rect *tile)
+{
+	long long p, p1, j0, j1, t, k;
+
+	p = 0;
+	p1 = (long long) m + 1;
+	j0 = 0;
+	j1 = p1;
+	if (d2x != 0) {
+		clip_steps(x - tile->x, d2x, tile->w, &p, &p1);
+		clip_steps(y - tile->y, d1y, tile->h, &j0, &j1);
+	} else {
+		clip_steps(y - tile->y, d2y, tile->h, &p, &p1);
+		clip_steps(x - tile->x, d1x, tile->w, &j0, &j1);
+	}
+	if (j0 >= j1)
+		return;
+	if (n > 0) {
+		t = -floor_div(m2 - j0 * m, n);
+		if (t > p)
+			p = t;
+		t = floor_div(j1 * m - m2 - 1, n) + 1;
+		if (t < p1)
+			p1 = t;
+	}
+	if (p >= p1)
+		return;
+
+	if (m > 0) {
+		t = m2 + p * n;
+		k = t / m;
+		m2 = (int) (t % m);
+		x += (int) (p * d2x + k * (d1x - d2x));
+		y += (int) (p * d2y + k * (d1y - d2y));
+	}
+
+	for (; p < p1; p++) {
+		if (dst->pal == NULL) {
+			((unsigned int *) (dst->pixels +
+				y * dst->pitch))[x] = color;
+		} else {
+			dst->pixels[y * dst->pitch + x] =
+				(unsigned char) color;
+		}
+		m2 += n;
+		if (m2 >= m) {
+			m2 -= m;
+			x += d1x;
+			y += d1y;
+		} else {
+			x += d2x;
+			y += d2y;
+		}
+	}
+}
+
 void draw_line(struct bmp *dst, int x0, int y0, int x1, int y1)
+{
+	mark_dirty(dst, x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1,
+		   iabs(x1 - x0) + 1, iabs(y1 - y0) + 1);
+	if (dst == s_recorder_dst)
+		s_recorder->line(x0, y0, x1, y1, s_draw_color, &s_clip);
+	else if (dst->pal == NULL)
+		draw_line_clip(dst, x0, y0, x1, y1, s_draw_color, &s_clip,
+			       NULL);
+	else
+		draw_line_clip(dst, x0, y0, x1, y1, s_draw_pal_color,
+			       &s_clip, NULL);
+}
+
+/*
+ * Bresenham.
+ */
+void draw_line_clip(struct bmp *dst, int x0, int y0, int x1, int y1,
+		    unsigned int color, const struct rect *clip,
+		    const struct rect *tile)
 {
 	int d1x, d1y, d2x, d2y, m, n;
 	struct rect r;
 
+	/* Any transparency? Don't paint. */
+	if (dst->pal == NULL && (color & 0xff000000))
+		return;
+
 	/* clip */
 	r.x = 0;
 	r.y = 0;
 	r.w = dst->w;
 	r.h = dst->h;
-	rect_intersect(&s_clip, &r, &r);
+	rect_intersect(clip, &r, &r);
 
 	if (y1 < y0) {
 		m = x0;
@@ -1200,10 +2574,14 @@ void draw_line(struct bmp *dst, int x0, int y0, int x1, int y1)
 	}
 	
 	x1 = m >> 1;
-	if (dst->pal == NULL) {
-		draw_line32(dst, x0, y0, d1x, d1y, d2x, d2y, m, x1, n);
+	if (tile != NULL) {
+		draw_line_tile(dst, x0, y0, d1x, d1y, d2x, d2y, m, x1, n,
+			       color, tile);
+	} else if (dst->pal == NULL) {
+		draw_line32(dst, x0, y0, d1x, d1y, d2x, d2y, m, x1, n, color);
 	} else {
-		draw_line8(dst, x0, y0, d1x, d1y, d2x, d2y, m, x1, n);
+		draw_line8(dst, x0, y0, d1x, d1y, d2x, d2y, m, x1, n,
+			   (unsigned char) color);
 	}
 }
 
@@ -1212,4 +2590,23 @@ void bmp_draw_init(void)
 	s_draw_color = 0;
 	s_draw_pal_color = 0;
 	reset_clip(0, 0);
+	s_recorder_dst = NULL;
+	s_recorder = NULL;
+
+	s_kc_rows = NULL;
+	s_fetch_rows = &s_fetch_rows_c;
+	s_blend_row = blend_row;
+	s_pal_row = pal_row;
+#if USE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		s_kc_rows = &s_kc_rows_avx2;
+		s_fetch_rows = &s_fetch_rows_avx2;
+		s_blend_row = blend_row_avx2;
+		s_pal_row = pal_row_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		s_kc_rows = &s_kc_rows_sse2;
+		s_blend_row = blend_row_sse2;
+	}
+#endif
 }
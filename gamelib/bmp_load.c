@@ -229,6 +229,8 @@ static struct bmp *create_bmp(int width, int height, int pal_size, int *ecode)
 	}
 
 	im->pal = NULL;
+	im->runs = NULL;
+	im->use_alpha = 0;
 	if (pal_size > 0) {
 		/*
 		 * Safe: pal_size in range [1..256] by (1).
@@ -1052,19 +1054,25 @@ fredat: free(data);
 error:	return im;
 }
 
+/* If 'amask' is not 0, puts the alpha in the high byte of each pixel. */
 static void expand_32bpp_rgb(unsigned int *dst, unsigned char *src,
 			     int w, int h, unsigned int rmask,
-			     unsigned int gmask, unsigned int bmask)
+			     unsigned int gmask, unsigned int bmask,
+			     unsigned int amask)
 {
 	int i;
 	unsigned int pix;
 	unsigned int *dwsrc;
-	int bshr, gshr, rshr;
-	int bmul, gmul, rmul;
+	int bshr, gshr, rshr, ashr;
+	int bmul, gmul, rmul, amul;
 
 	calc_shr_mul(bmask, &bshr, &bmul);
 	calc_shr_mul(gmask, &gshr, &gmul);
 	calc_shr_mul(rmask, &rshr, &rmul);
+	ashr = 0;
+	amul = 0;
+	if (amask != 0)
+		calc_shr_mul(amask, &ashr, &amul);
 
 	dwsrc = (unsigned int *) src;
 	while (h--) {
@@ -1072,12 +1080,57 @@ static void expand_32bpp_rgb(unsigned int *dst, unsigned char *src,
 			pix = apply_mask(*dwsrc, bmask, bshr, bmul);
 			pix |= apply_mask(*dwsrc, gmask, gshr, gmul) << 8;
 			pix |= apply_mask(*dwsrc, rmask, rshr, rmul) << 16;
+			if (amask != 0) {
+				pix |= apply_mask(*dwsrc, amask, ashr,
+						  amul) << 24;
+			}
 			*dst++ = pix;
 			dwsrc++;
 		}
 	}
 }
 
+/*
+ * Multiplies the colors of 'im', a 32 bpp bitmap with the alpha in the
+ * high byte, by their alpha.
+ *
+ * If all the alpha values are 255, or all 0 (some programs write the
+ * alpha mask but not the alpha), the alpha is removed instead, and returns
+ * 0. Else returns 1.
+ */
+static int premultiply_alpha(struct bmp *im)
+{
+	int i, n, a, all0, all255;
+	unsigned int pix;
+	unsigned int *pixels;
+
+	pixels = (unsigned int *) im->pixels;
+	n = im->w * im->h;
+	all0 = 1;
+	all255 = 1;
+	for (i = 0; i < n; i++) {
+		a = pixels[i] >> 24;
+		all0 &= a == 0;
+		all255 &= a == 255;
+	}
+
+	if (all0 || all255) {
+		for (i = 0; i < n; i++)
+			pixels[i] &= 0xffffff;
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		pix = pixels[i];
+		a = pix >> 24;
+		pixels[i] = (pix & 0xff000000) |
+			((((pix >> 16) & 0xff) * a + 127) / 255) << 16 |
+			((((pix >> 8) & 0xff) * a + 127) / 255) << 8 |
+			(((pix & 0xff) * a + 127) / 255);
+	}
+	return 1;
+}
+
 /*
  * Load a 32 bit bitmap or returns NULL on failure.
  *
@@ -1099,7 +1152,7 @@ static struct bmp *load_32bpp_bmp(BITMAPV5HEADER *ih, FILE *fp, int *ecode)
 	int rowlen;
 	struct bmp *im;
 	unsigned char *data;
-	unsigned int rmask, gmask, bmask;
+	unsigned int rmask, gmask, bmask, amask;
 
 	im = NULL;
 	if (ih->bV5Compression != BI_RGB &&
@@ -1121,14 +1174,19 @@ static struct bmp *load_32bpp_bmp(BITMAPV5HEADER *ih, FILE *fp, int *ecode)
 		}
 	}
 
+	/*
+	 * Only V4 and V5 headers have the alpha mask, else it is 0.
+	 */
 	if (ih->bV5Compression == BI_BITFIELDS) {
 		rmask = ih->bV5RedMask;
 		gmask = ih->bV5GreenMask;
 		bmask = ih->bV5BlueMask;
+		amask = ih->bV5AlphaMask;
 	} else {
 		bmask = 0xff;
 		gmask = 0xff00;
 		rmask = 0xff0000;
+		amask = 0;
 	}
 
 	/*
@@ -1152,7 +1210,9 @@ static struct bmp *load_32bpp_bmp(BITMAPV5HEADER *ih, FILE *fp, int *ecode)
 		goto fredat;
 
 	expand_32bpp_rgb((unsigned int *) im->pixels, data, im->w, im->h,
-			 rmask, gmask, bmask);
+			 rmask, gmask, bmask, amask);
+	if (amask != 0)
+		im->use_alpha = premultiply_alpha(im);
 
 fredat:	free(data);
 error:	return im;
@@ -1355,11 +1415,230 @@ end:	if (ecode != NULL)
 	return r;
 }
 
+struct bmp *expand_bmp32(const struct bmp *bmp, int *ecode)
+{
+	int x, y, ec;
+	struct bmp *im;
+	const unsigned char *src;
+	unsigned int *dst;
+
+	ec = E_BMP_OK;
+	if (kassert_fails(bmp != NULL)) {
+		ec = E_BMP_ERROR;
+		im = NULL;
+		goto end;
+	}
+
+	im = create_bmp(bmp->w, bmp->h, 0, &ec);
+	if (im == NULL)
+		goto end;
+
+	for (y = 0; y < bmp->h; y++) {
+		src = bmp->pixels + y * bmp->pitch;
+		dst = (unsigned int *) (im->pixels + y * im->pitch);
+		if (bmp->pal == NULL) {
+			memcpy(dst, src, bmp->w * 4);
+		} else {
+			for (x = 0; x < bmp->w; x++)
+				dst[x] = bmp->pal[src[x]];
+		}
+	}
+
+	im->use_key_color = bmp->use_key_color;
+	im->key_color = bmp->key_color;
+	im->use_alpha = bmp->use_alpha;
+	if (bmp->runs != NULL) {
+		ec = encode_bmp_runs(im);
+		if (ec != E_BMP_OK) {
+			free_bmp(im, 1);
+			im = NULL;
+		}
+	}
+
+end:	if (ecode != NULL)
+		*ecode = ec;
+	return im;
+}
+
+/*
+ * Returns the index of color 'c' in 'pal', adding it if it is not there.
+ * Returns -1 if the palette is full.
+ */
+static int intern_color(unsigned int c, unsigned int *pal, int *palsz)
+{
+	int i;
+
+	for (i = 0; i < *palsz; i++) {
+		if (pal[i] == c)
+			return i;
+	}
+
+	if (*palsz == 256)
+		return -1;
+
+	pal[i] = c;
+	(*palsz)++;
+	return i;
+}
+
+struct bmp *remap_bmp8(const struct bmp *bmp, unsigned int *pal, int *palsz,
+		       int *ecode)
+{
+	int x, y, i, ec;
+	short map[256];
+	struct bmp *im;
+	const unsigned char *src;
+	unsigned char *dst;
+
+	ec = E_BMP_OK;
+	if (kassert_fails(bmp != NULL && pal != NULL && palsz != NULL)) {
+		ec = E_BMP_ERROR;
+		im = NULL;
+		goto end;
+	}
+
+	im = create_bmp(bmp->w, bmp->h, 1, &ec);
+	if (im == NULL)
+		goto end;
+
+	free(im->pal);
+	im->pal = pal;
+
+	for (i = 0; i < 256; i++)
+		map[i] = -1;
+
+	for (y = 0; y < bmp->h; y++) {
+		src = bmp->pixels + y * bmp->pitch;
+		dst = im->pixels + y * im->pitch;
+		for (x = 0; x < bmp->w; x++) {
+			if (bmp->pal == NULL) {
+				i = intern_color(((const unsigned int *) src)[x],
+						 pal, palsz);
+			} else {
+				i = map[src[x]];
+				if (i < 0) {
+					i = intern_color(bmp->pal[src[x]],
+							 pal, palsz);
+					map[src[x]] = i;
+				}
+			}
+			if (i < 0) {
+				ec = E_BMP_PAL_FULL;
+				free_bmp(im, 0);
+				im = NULL;
+				goto end;
+			}
+			dst[x] = (unsigned char) i;
+		}
+	}
+
+	/* Safe: *palsz in range [1..256], we have added at least one. */
+	im->palsz = *palsz;
+	im->use_key_color = bmp->use_key_color;
+	im->key_color = bmp->key_color;
+	if (bmp->runs != NULL) {
+		ec = encode_bmp_runs(im);
+		if (ec != E_BMP_OK) {
+			free_bmp(im, 0);
+			im = NULL;
+		}
+	}
+
+end:	if (ecode != NULL)
+		*ecode = ec;
+	return im;
+}
+
+/* If the pixel 'x' of the row 'pixels' of 'bmp' is of the key color. */
+static int is_key_pixel(const struct bmp *bmp, const unsigned char *pixels,
+			int x)
+{
+	if (bmp->pal != NULL)
+		return bmp->pal[pixels[x]] == bmp->key_color;
+	else
+		return ((const unsigned int *) pixels)[x] == bmp->key_color;
+}
+
+/*
+ * Finds the runs of 'bmp'. If 'runs' is NULL only counts them, else fills
+ * it. Returns the number of runs.
+ */
+static int find_runs(const struct bmp *bmp, struct bmp_runs *runs)
+{
+	int x, y, x0, n;
+	const unsigned char *pixels;
+
+	n = 0;
+	for (y = 0; y < bmp->h; y++) {
+		if (runs != NULL)
+			runs->row[y] = n;
+		pixels = bmp->pixels + y * bmp->pitch;
+		x = 0;
+		while (x < bmp->w) {
+			while (x < bmp->w && is_key_pixel(bmp, pixels, x))
+				x++;
+			if (x == bmp->w)
+				break;
+			x0 = x;
+			while (x < bmp->w && !is_key_pixel(bmp, pixels, x))
+				x++;
+			if (runs != NULL) {
+				/* Safe: the width fits in 16 bits. */
+				runs->x[n] = (unsigned short) x0;
+				runs->len[n] = (unsigned short) (x - x0);
+			}
+			n++;
+		}
+	}
+	if (runs != NULL)
+		runs->row[y] = n;
+
+	return n;
+}
+
+int encode_bmp_runs(struct bmp *bmp)
+{
+	int n;
+	size_t sz;
+	struct bmp_runs *runs;
+
+	if (kassert_fails(bmp != NULL && bmp->use_key_color))
+		return E_BMP_ERROR;
+
+	if (bmp->w > USHRT_MAX)
+		return E_BMP_BIG;
+
+	/*
+	 * All in one block: the struct, the row indexes and the runs.
+	 * Safe: there are less runs than pixels, and the bitmaps we make
+	 * have less than INT_MAX / 4 pixels.
+	 */
+	n = find_runs(bmp, NULL);
+	sz = sizeof(*runs) + (bmp->h + 1) * sizeof(int) +
+		n * 2 * sizeof(unsigned short);
+	runs = malloc(sz);
+	if (runs == NULL)
+		return E_BMP_MEM;
+
+	runs->row = (int *) (runs + 1);
+	runs->x = (unsigned short *) (runs->row + bmp->h + 1);
+	runs->len = runs->x + n;
+	find_runs(bmp, runs);
+
+	free(bmp->runs);
+	bmp->runs = runs;
+	return E_BMP_OK;
+}
+
 void free_bmp(struct bmp *bmp, int free_pal)
 {
 	if (bmp == NULL)
 		return;
 
+	if (bmp->runs != NULL) {
+		free(bmp->runs);
+		bmp->runs = NULL;
+	}
 	if (bmp->pixels != NULL) {
 		free(bmp->pixels);
 		bmp->pixels = NULL;
@@ -36,7 +36,8 @@ enum {
 	E_BMP_COMPRESS_COMPAT,
 	E_BMP_COMPRESS_SUPPORT,
 	E_BMP_BPP_SUPPORT,
-	E_BMP_ERROR
+	E_BMP_ERROR,
+	E_BMP_PAL_FULL
 };
 
 /**
@@ -54,6 +55,15 @@ enum {
  * 'key_color' is a 32 bit xrgb color used for transparency.
  * 'use_key_color' is true if 'key'color' should be used as the transparent
  * color for drawing algorithms.
+ *
+ * If 'use_alpha' is true, 'pal' is NULL and the high byte of each color is
+ * its alpha, 0 transparent to 255 opaque, and the color is already
+ * multiplied by it. Drawing algorithms then blend with the alpha instead
+ * of using the key color. Only 32 bpp bitmaps with an alpha mask are
+ * loaded like this.
+ *
+ * 'runs' is NULL or the pixels not of the key color, as made by
+ * encode_bmp_runs. When drawing with the key color, only those are visited.
  */
 struct bmp {
 	unsigned char *pixels;
@@ -62,7 +72,21 @@ struct bmp {
 	unsigned int *pal;
 	short palsz;
 	signed char use_key_color;
+	signed char use_alpha;
 	unsigned int key_color;
+	struct bmp_runs *runs;
+};
+
+/**
+ * The runs of consecutive pixels not of the key color of a bitmap.
+ *
+ * The runs of row 'y' are the indexes [row[y], row[y + 1]), sorted by
+ * column. Run 'i' starts at column x[i] and has len[i] pixels.
+ */
+struct bmp_runs {
+	int *row;
+	unsigned short *x;
+	unsigned short *len;
 };
 
 #ifdef __cplusplus
@@ -83,6 +107,39 @@ extern "C" {
  */
 struct bmp *load_bmp_fp(FILE *fp, int *ecode);
 
+/*
+ * Returns a new 32 bpp copy of 'bmp', with the palette indexes, if any,
+ * expanded to their colors.
+ *
+ * Returns NULL on error.
+ * In that case *ecode will contain the error code.
+ * ecode can be NULL.
+ */
+struct bmp *expand_bmp32(const struct bmp *bmp, int *ecode);
+
+/*
+ * Returns a new 8 bpp copy of 'bmp' that uses the palette 'pal', which
+ * has '*palsz' colors and room for 256. The colors of 'bmp' not found in
+ * 'pal' are added to it, updating '*palsz'. 'pal' is shared, so free the
+ * copy with a false 'free_pal'.
+ *
+ * Returns NULL on error, E_BMP_PAL_FULL if the colors do not fit in 'pal'.
+ * In that case *ecode will contain the error code.
+ * ecode can be NULL.
+ */
+struct bmp *remap_bmp8(const struct bmp *bmp, unsigned int *pal, int *palsz,
+		       int *ecode);
+
+/*
+ * Makes the 'runs' of 'bmp', that must use a key color, so it is drawn in
+ * time proportional to the pixels not of the key color. Good for sprites
+ * that are mostly transparent.
+ *
+ * Returns E_BMP_OK, E_BMP_MEM if no memory, E_BMP_BIG if 'bmp' is wider
+ * than 65535 pixels or E_BMP_ERROR.
+ */
+int encode_bmp_runs(struct bmp *bmp);
+
 /*
  * Frees a bmp and all its data.
  * Call with false 'free_pal' to not free the palette in case it is shared
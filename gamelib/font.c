@@ -0,0 +1,568 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "font.h"
+#include "cbase/kassert.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/* Strings whose layout we keep, a power of 2. */
+	LAYOUT_CACHE_SIZE = 32,
+	/* Size of the builtin font. */
+	BUILTIN_W = 3,
+	BUILTIN_H = 5,
+	BUILTIN_FIRST = ' ',
+	BUILTIN_NCHARS = 64,
+};
+
+/* The builtin glyphs from ' ' to '_', 3 bits per row from the top, the
+ * high bit on the left.
+ */
+static const unsigned short s_builtin_glyphs[BUILTIN_NCHARS] = {
+	0x0000, 0x2482, 0x5a00, 0x5f7d, 0x3c9e, 0x52a5, 0x2aab, 0x2400,
+	0x1491, 0x4494, 0x0aa8, 0x05d0, 0x0014, 0x01c0, 0x0002, 0x12a4,
+	0x7b6f, 0x2c97, 0x73e7, 0x72cf, 0x5bc9, 0x79cf, 0x79ef, 0x7252,
+	0x7bef, 0x7bcf, 0x0410, 0x0414, 0x1511, 0x0e38, 0x4454, 0x72c2,
+	0x7be3, 0x2bed, 0x6bae, 0x3923, 0x6b6e, 0x79a7, 0x79a4, 0x396b,
+	0x5bed, 0x7497, 0x126a, 0x5bad, 0x4927, 0x5fed, 0x6b6d, 0x2b6a,
+	0x6ba4, 0x2b7b, 0x6bad, 0x388e, 0x7492, 0x5b6f, 0x5b6a, 0x5bfd,
+	0x5aad, 0x5a92, 0x72a7, 0x3493, 0x4889, 0x6496, 0x2a00, 0x0007,
+};
+
+/* A glyph in the atlas.
+ * x, y: where its pixels start, from the pen position.
+ * sy: its first row in the atlas.
+ * w, h: size of its pixels; 0 if it has none.
+ * adv: how much the pen moves after it.
+ */
+struct glyph {
+	short x, y;
+	short sy;
+	short w, h;
+	short adv;
+};
+
+/* A glyph of a text: draw 'sr' of the atlas at (x, y) from the corner of
+ * the text.
+ */
+struct placed_glyph {
+	int x, y;
+	struct rect sr;
+};
+
+/* The layout of 'text', which has 'len' characters, or nothing if 'len'
+ * is negative. 'w' and 'h' is the size of the text.
+ */
+struct layout {
+	unsigned int hash;
+	int len;
+	char *text;
+	int text_cap;
+	struct placed_glyph *glyphs;
+	int nglyphs;
+	int glyphs_cap;
+	int w, h;
+};
+
+/* map: the glyph of each character, or -1.
+ * line_h: distance between lines.
+ * layouts: the cache, by hash.
+ */
+struct font {
+	struct bmp *atlas;
+	struct glyph *glyphs;
+	short map[256];
+	int line_h;
+	struct layout layouts[LAYOUT_CACHE_SIZE];
+};
+
+static int is_ink(const struct bmp *sheet, int x, int y)
+{
+	const unsigned char *row;
+
+	row = sheet->pixels + y * sheet->pitch;
+	if (sheet->pal != NULL)
+		return sheet->pal[row[x]] != sheet->key_color;
+	else
+		return ((const unsigned int *) row)[x] != sheet->key_color;
+}
+
+/* Finds the pixels of the glyph in the cell at (cx, cy) of 'sheet' and
+ * puts their rect in 'r', empty if none.
+ */
+static void find_ink(const struct bmp *sheet, int cx, int cy, int cell_w,
+		     int cell_h, struct rect *r)
+{
+	int x, y, x0, y0, x1, y1;
+
+	x0 = cell_w;
+	y0 = cell_h;
+	x1 = -1;
+	y1 = -1;
+	for (y = 0; y < cell_h; y++) {
+		for (x = 0; x < cell_w; x++) {
+			if (!is_ink(sheet, cx + x, cy + y))
+				continue;
+			if (x < x0)
+				x0 = x;
+			if (x > x1)
+				x1 = x;
+			if (y < y0)
+				y0 = y;
+			if (y > y1)
+				y1 = y;
+		}
+	}
+
+	if (x1 < 0) {
+		memset(r, 0, sizeof(*r));
+	} else {
+		r->x = x0;
+		r->y = y0;
+		r->w = x1 - x0 + 1;
+		r->h = y1 - y0 + 1;
+	}
+}
+
+/* Makes an empty 8 bpp atlas of w x h. Returns NULL if no memory. */
+static struct bmp *create_atlas(int w, int h)
+{
+	struct bmp *atlas;
+
+	atlas = calloc(1, sizeof(*atlas));
+	if (atlas == NULL)
+		return NULL;
+
+	atlas->w = w;
+	atlas->h = h;
+	atlas->pitch = w;
+	atlas->palsz = 2;
+	atlas->use_key_color = 1;
+	atlas->pixels = calloc(w * h, 1);
+	atlas->pal = calloc(256, sizeof(*atlas->pal));
+	if (atlas->pixels == NULL || atlas->pal == NULL) {
+		free_bmp(atlas, 1);
+		return NULL;
+	}
+
+	return atlas;
+}
+
+/* Puts in the atlas the glyphs of 'font' from 'sheet'.
+ * Returns 0 if no memory.
+ */
+static int make_atlas(struct font *font, const struct bmp *sheet,
+		      int cell_w, int cell_h, int nchars, int fixed_width)
+{
+	int i, x, y, cx, cy, cols, w, h;
+	struct rect r;
+	struct glyph *g;
+	unsigned char *row;
+
+	/* Crop the glyphs and find the size of the atlas. */
+	cols = sheet->w / cell_w;
+	w = 1;
+	h = 0;
+	for (i = 0; i < nchars; i++) {
+		g = &font->glyphs[i];
+		cx = (i % cols) * cell_w;
+		cy = (i / cols) * cell_h;
+		if (cy + cell_h > sheet->h) {
+			memset(&r, 0, sizeof(r));
+		} else {
+			find_ink(sheet, cx, cy, cell_w, cell_h, &r);
+		}
+
+		g->x = r.x;
+		g->y = r.y;
+		g->sy = h;
+		g->w = r.w;
+		g->h = r.h;
+		if (fixed_width)
+			g->adv = cell_w;
+		else if (r.w > 0)
+			g->adv = r.w + 1;
+		else
+			g->adv = (cell_w + 1) / 2;
+
+		if (r.w > w)
+			w = r.w;
+		h += r.h;
+	}
+
+	font->atlas = create_atlas(w, h > 0 ? h : 1);
+	if (font->atlas == NULL)
+		return 0;
+
+	for (i = 0; i < nchars; i++) {
+		g = &font->glyphs[i];
+		if (g->w == 0)
+			continue;
+
+		cx = (i % cols) * cell_w + g->x;
+		cy = (i / cols) * cell_h + g->y;
+		for (y = 0; y < g->h; y++) {
+			row = font->atlas->pixels + (g->sy + y) * w;
+			for (x = 0; x < g->w; x++) {
+				row[x] = (unsigned char) is_ink(sheet, cx + x,
+								cy + y);
+			}
+		}
+
+		/* Proportional: the pixels start at the pen. */
+		if (!fixed_width)
+			g->x = 0;
+	}
+
+	/* The runs need the key color. Without them it is only slower. */
+	set_font_color(font, 0xffffff);
+	encode_bmp_runs(font->atlas);
+	return 1;
+}
+
+struct font *create_font(const struct bmp *sheet, int cell_w, int cell_h,
+			 int first_char, int nchars, int fixed_width)
+{
+	int i, c;
+	struct font *font;
+
+	if (kassert_fails(sheet != NULL && sheet->use_key_color))
+		return NULL;
+
+	if (kassert_fails(cell_w > 0 && cell_w <= sheet->w &&
+			  cell_h > 0 && cell_h <= sheet->h))
+	{
+		return NULL;
+	}
+
+	if (kassert_fails(first_char >= 0 && nchars > 0 &&
+			  first_char + nchars <= 256))
+	{
+		return NULL;
+	}
+
+	font = calloc(1, sizeof(*font));
+	if (font == NULL)
+		return NULL;
+
+	font->glyphs = malloc(nchars * sizeof(*font->glyphs));
+	if (font->glyphs == NULL ||
+	    !make_atlas(font, sheet, cell_w, cell_h, nchars, fixed_width))
+	{
+		free_font(font);
+		return NULL;
+	}
+
+	for (c = 0; c < 256; c++) {
+		font->map[c] = -1;
+	}
+	for (i = 0; i < nchars; i++) {
+		font->map[first_char + i] = i;
+	}
+	for (c = 'a'; c <= 'z'; c++) {
+		if (font->map[c] < 0)
+			font->map[c] = font->map[c - 'a' + 'A'];
+	}
+
+	font->line_h = cell_h;
+	return font;
+}
+
+struct font *create_builtin_font(void)
+{
+	enum {
+		CELL_W = BUILTIN_W + 1,
+		CELL_H = BUILTIN_H + 1,
+		SHEET_W = CELL_W * BUILTIN_NCHARS,
+	};
+
+	unsigned char pixels[SHEET_W * CELL_H];
+	unsigned int pal[256];
+	struct bmp sheet;
+	int i, x, y, bits;
+
+	memset(pixels, 0, sizeof(pixels));
+	for (i = 0; i < BUILTIN_NCHARS; i++) {
+		bits = s_builtin_glyphs[i];
+		for (y = 0; y < BUILTIN_H; y++) {
+			for (x = 0; x < BUILTIN_W; x++) {
+				if (bits & (1 << (BUILTIN_W * BUILTIN_H - 1 -
+						  y * BUILTIN_W - x)))
+				{
+					pixels[y * SHEET_W + i * CELL_W + x] = 1;
+				}
+			}
+		}
+	}
+
+	memset(pal, 0, sizeof(pal));
+	pal[1] = 0xffffff;
+	memset(&sheet, 0, sizeof(sheet));
+	sheet.pixels = pixels;
+	sheet.w = SHEET_W;
+	sheet.h = CELL_H;
+	sheet.pitch = SHEET_W;
+	sheet.pal = pal;
+	sheet.palsz = 2;
+	sheet.use_key_color = 1;
+	sheet.key_color = pal[0];
+	return create_font(&sheet, CELL_W, CELL_H, BUILTIN_FIRST,
+			   BUILTIN_NCHARS, 1);
+}
+
+void free_font(struct font *font)
+{
+	int i;
+
+	if (font == NULL)
+		return;
+
+	for (i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+		free(font->layouts[i].text);
+		free(font->layouts[i].glyphs);
+	}
+	if (font->atlas != NULL)
+		free_bmp(font->atlas, 1);
+	free(font->glyphs);
+	free(font);
+}
+
+/*
+ * The key color is any color but 'color'.
+ */
+void set_font_color(struct font *font, unsigned int color)
+{
+	if (kassert_fails(font != NULL))
+		return;
+
+	font->atlas->pal[1] = color;
+	font->atlas->pal[0] = color ^ 0xffffff;
+	font->atlas->key_color = font->atlas->pal[0];
+}
+
+/* FNV-1a. Puts the length of 'text' in '*len'. */
+static unsigned int hash_text(const char *text, int *len)
+{
+	unsigned int h;
+	const char *p;
+
+	h = 2166136261u;
+	for (p = text; *p != '\0'; p++) {
+		h = (h ^ (unsigned char) *p) * 16777619u;
+	}
+	*len = (int) (p - text);
+	return h;
+}
+
+/* Lays out 'text' into 'lay', which has room. */
+static void lay_out(const struct font *font, const char *text,
+		    struct layout *lay)
+{
+	int x, y, gi;
+	const struct glyph *g;
+	struct placed_glyph *p;
+
+	x = 0;
+	y = 0;
+	lay->w = 0;
+	lay->nglyphs = 0;
+	for (; *text != '\0'; text++) {
+		if (*text == '\n') {
+			if (x > lay->w)
+				lay->w = x;
+			x = 0;
+			y += font->line_h;
+			continue;
+		}
+
+		gi = font->map[(unsigned char) *text];
+		if (gi < 0)
+			gi = font->map['?'];
+		if (gi < 0)
+			continue;
+
+		g = &font->glyphs[gi];
+		if (g->w > 0) {
+			p = &lay->glyphs[lay->nglyphs++];
+			p->x = x + g->x;
+			p->y = y + g->y;
+			p->sr.x = 0;
+			p->sr.y = g->sy;
+			p->sr.w = g->w;
+			p->sr.h = g->h;
+		}
+		x += g->adv;
+	}
+
+	if (x > lay->w)
+		lay->w = x;
+	lay->h = lay->len > 0 ? y + font->line_h : 0;
+}
+
+/* Returns the layout of 'text' from the cache, making it if it is not
+ * there. Returns NULL if no memory.
+ */
+static const struct layout *get_layout(struct font *font, const char *text)
+{
+	int len, n;
+	unsigned int h;
+	struct layout *lay;
+	void *p;
+
+	h = hash_text(text, &len);
+	lay = &font->layouts[h & (LAYOUT_CACHE_SIZE - 1)];
+	if (lay->len == len && lay->hash == h && lay->text != NULL &&
+	    memcmp(lay->text, text, len) == 0)
+	{
+		return lay;
+	}
+
+	lay->len = -1;
+	if (len + 1 > lay->text_cap) {
+		p = realloc(lay->text, len + 1);
+		if (p == NULL)
+			goto nomem;
+		lay->text = p;
+		lay->text_cap = len + 1;
+	}
+
+	n = len > 0 ? len : 1;
+	if (n > lay->glyphs_cap) {
+		p = realloc(lay->glyphs, n * sizeof(*lay->glyphs));
+		if (p == NULL)
+			goto nomem;
+		lay->glyphs = p;
+		lay->glyphs_cap = n;
+	}
+
+	memcpy(lay->text, text, len + 1);
+	lay->hash = h;
+	lay->len = len;
+	lay_out(font, text, lay);
+	return lay;
+
+nomem:	ktrace("no memory for text layout");
+	return NULL;
+}
+
+void text_size(struct font *font, const char *text, int *w, int *h)
+{
+	const struct layout *lay;
+
+	*w = 0;
+	*h = 0;
+	if (kassert_fails(font != NULL && text != NULL))
+		return;
+
+	lay = get_layout(font, text);
+	*w = lay != NULL ? lay->w : 0;
+	*h = lay != NULL ? lay->h : 0;
+}
+
+/* Paints with 'color' the runs of the 'h' rows of the atlas from 'sy', at
+ * (x, y) of 'dst', inside 'clip', which is inside 'dst'.
+ */
+static void fill_runs(const struct bmp_runs *runs, int sy, int h,
+		      struct bmp *dst, int x, int y, const struct rect *clip,
+		      unsigned int color)
+{
+	int r, r1, i, end, a, b, xmin, xmax;
+	unsigned int *row;
+
+	r = y < clip->y ? clip->y - y : 0;
+	r1 = y + h > clip->y + clip->h ? clip->y + clip->h - y : h;
+	xmin = clip->x - x;
+	xmax = clip->x + clip->w - x;
+	for (; r < r1; r++) {
+		row = (unsigned int *) (dst->pixels + (y + r) * dst->pitch) + x;
+		end = runs->row[sy + r + 1];
+		for (i = runs->row[sy + r]; i < end; i++) {
+			a = runs->x[i];
+			b = a + runs->len[i];
+			if (a < xmin)
+				a = xmin;
+			if (b > xmax)
+				b = xmax;
+			while (a < b)
+				row[a++] = color;
+		}
+	}
+}
+
+/*
+ * The whole text is added to the dirty rects at once, and the glyphs are
+ * drawn with the clip taken only once. As all the pixels of a glyph have
+ * the same color, we only fill its runs.
+ */
+void draw_text(struct font *font, struct bmp *dst, int x, int y,
+	       const char *text)
+{
+	int i;
+	unsigned int color;
+	struct rect clip, r;
+	const struct layout *lay;
+	const struct placed_glyph *p;
+	const struct bmp_runs *runs;
+
+	if (kassert_fails(font != NULL && dst != NULL && text != NULL))
+		return;
+
+	/*
+	 * Drawing to palettized bitmaps is not supported yet.
+	 */
+	if (kassert_fails(dst->pal == NULL))
+		return;
+
+	lay = get_layout(font, text);
+	if (lay == NULL || lay->nglyphs == 0)
+		return;
+
+	get_clip(&clip);
+	r.x = 0;
+	r.y = 0;
+	r.w = dst->w;
+	r.h = dst->h;
+	rect_intersect(&clip, &r, &clip);
+	r.x = x;
+	r.y = y;
+	r.w = lay->w;
+	r.h = lay->h;
+	rect_intersect(&clip, &r, &r);
+	if (r.w <= 0)
+		return;
+
+	add_dirty_rect(dst, &r);
+	runs = font->atlas->runs;
+	color = font->atlas->pal[1];
+	p = lay->glyphs;
+	for (i = 0; i < lay->nglyphs; i++, p++) {
+		if (runs != NULL) {
+			fill_runs(runs, p->sr.y, p->sr.h, dst, x + p->x,
+				  y + p->y, &r, color);
+		} else {
+			draw_bmp_kct_clip(font->atlas, x + p->x, y + p->y,
+					  dst, &p->sr, 1, 0, &r);
+		}
+	}
+}
@@ -0,0 +1,91 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef FONT_H
+#define FONT_H
+
+#ifndef BMP_H
+#include "bmp.h"
+#endif
+
+/*
+ * Bitmap fonts.
+ *
+ * The glyphs are kept cropped to their pixels, one below the other, in an
+ * atlas bitmap with runs (see encode_bmp_runs), so drawing a glyph only
+ * visits its own pixels. The layout of the last strings drawn is cached,
+ * so drawing the same text each frame only does the blits.
+ *
+ * The characters are bytes; '\n' starts a new line. The characters
+ * without a glyph use the one of their uppercase letter, or '?', or are
+ * skipped.
+ */
+struct font;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Makes a font from the glyphs in 'sheet', which must use a key color:
+ * cells of 'cell_w' x 'cell_h' pixels, left to right and top to bottom,
+ * for the 'nchars' characters starting at 'first_char'. The pixels not of
+ * the key color are the glyph.
+ * If 'fixed_width', all the characters advance 'cell_w' pixels; if not,
+ * the width of their pixels plus one.
+ * The lines are 'cell_h' pixels apart. The color is white.
+ *
+ * Returns NULL if no memory.
+ */
+struct font *create_font(const struct bmp *sheet, int cell_w, int cell_h,
+			 int first_char, int nchars, int fixed_width);
+
+/*
+ * Makes a small fixed width font of 3 x 5 pixels in cells of 4 x 6, with
+ * the characters from ' ' to '_', for debug text.
+ *
+ * Returns NULL if no memory.
+ */
+struct font *create_builtin_font(void);
+
+void free_font(struct font *font);
+
+void set_font_color(struct font *font, unsigned int color);
+
+/*
+ * Puts in '*w' and '*h' the size of 'text' when drawn.
+ */
+void text_size(struct font *font, const char *text, int *w, int *h);
+
+/*
+ * Draws 'text' with its top left corner at (x, y) of 'dst'.
+ * Applies the current global clipping.
+ */
+void draw_text(struct font *font, struct bmp *dst, int x, int y,
+	       const char *text);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -56,14 +56,20 @@ void switch_to_state(const struct state *new_state)
 
 /*
  * Calls update() on the current state.
- * Then calls draw() on the current state after update() has been called.
- * Note that the state for update() can be different than the state on
- * draw() if switch_to_state() has been called in update().
+ * Call draw_state() after to draw it; note that the state can be
+ * different if switch_to_state() has been called in update().
  */
 void update_state(void)
 {
 	if (g_state != NULL && g_state->update != NULL)
 		g_state->update();
+}
+
+/*
+ * Calls draw() on the current state.
+ */
+void draw_state(void)
+{
 	if (g_state != NULL && g_state->draw != NULL)
 		g_state->draw();
 }
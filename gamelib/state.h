@@ -36,6 +36,7 @@ extern const struct state *g_state;
 
 void switch_to_state(const struct state *new_state);
 void update_state(void);
+void draw_state(void);
 void end_state(void);
 
 void state_init(void);
@@ -23,6 +23,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "kernel.h"
 #include "kernel_snd.h"
+#include "upscale.h"
 #include "cbase/cbase.h"
 #include "cbase/kassert.h"
 #include "cfg/cfg.h"
@@ -61,6 +62,9 @@ enum {
 
 #define MAX_FRAME_EVENTS	16
 
+/* Frames we run at most to catch up before drawing, when on_draw is set. */
+#define MAX_CATCHUP_FRAMES	4
+
 static int key_down(int key_scan_code);
 static int key_first_pressed(int key_scan_code);
 static int key_repeating(int key_scan_code);
@@ -71,12 +75,30 @@ static SDL_Texture *s_backtex;
 static SDL_Renderer *s_renderer;
 static SDL_Window *s_win;
 static struct kernel_canvas s_kcanvas;
+
+/* The rects of the canvas to send on the next present(), or all if
+ * s_ndirty < 0. s_backtex_valid is 0 if s_backtex has lost what it had.
+ */
+static struct kernel_rect s_dirty[KERNEL_MAX_DIRTY_RECTS];
+static int s_ndirty = -1;
+static int s_backtex_valid;
+
+/* If s_upfactor > 1, the canvas is sent s_upfactor times bigger to
+ * s_uptex, with s_upscale (a KERNEL_UPSCALE), and drawn at s_updst, 1:1.
+ * s_uptex_valid as s_backtex_valid.
+ */
+static SDL_Texture *s_uptex;
+static SDL_Rect s_updst;
+static int s_upscale;
+static int s_upfactor = 1;
+static int s_uptex_valid;
 static void *s_data;
 static char *s_data_path;
 static char *s_prog_data_path;
 static int s_fullscreen;
 
 static void (*on_frame)(void *data);
+static void (*on_draw)(void *data, double alpha);
 static void (*on_sound)(void *data, unsigned char *ptr, int nsamples);
 
 static unsigned char s_key_first_pressed[KERNEL_NKEYS];
@@ -825,6 +847,11 @@ static void handle_event(const SDL_Event *ev)
 {
 	switch (ev->type) {
 	case SDL_QUIT: s_running = 0; break;
+	case SDL_RENDER_TARGETS_RESET:
+	case SDL_RENDER_DEVICE_RESET:
+		s_backtex_valid = 0;
+		s_uptex_valid = 0;
+		break;
 	case SDL_KEYDOWN: handle_keydown(&ev->key); break;
 	case SDL_KEYUP: handle_keyup(&ev->key); break;
 	case SDL_CONTROLLERDEVICEADDED:
@@ -909,21 +936,186 @@ static void check_fullscreen(void)
 	}
 }
 
-static void update(void)
+static void tick(void)
 {
-	SDL_Rect sr;
-
 	check_fullscreen();
 	kernel_snd_update();
 	if (on_frame != NULL) {
 		on_frame(s_data);
 	}
-	sr.x = sr.y = 0;
-	sr.w = s_backbuf->w;
-	sr.h = s_backbuf->h;
-	SDL_UpdateTexture(s_backtex, &sr, s_backbuf->pixels, s_backbuf->pitch);
+	clean_first_pressed_keys();
+	clean_released_fingers();
+}
+
+/* Sends the dirty rects of the canvas to the texture, or all of it. */
+static void update_backtex(void)
+{
+	int i;
+	SDL_Rect r;
+	const unsigned char *pixels;
+
+	if (s_ndirty < 0 || !s_backtex_valid) {
+		r.x = r.y = 0;
+		r.w = s_backbuf->w;
+		r.h = s_backbuf->h;
+		SDL_UpdateTexture(s_backtex, &r, s_backbuf->pixels,
+				  s_backbuf->pitch);
+		s_backtex_valid = 1;
+	} else {
+		for (i = 0; i < s_ndirty; i++) {
+			r.x = s_dirty[i].x;
+			r.y = s_dirty[i].y;
+			r.w = s_dirty[i].w;
+			r.h = s_dirty[i].h;
+			pixels = (const unsigned char *) s_backbuf->pixels +
+				 r.y * s_backbuf->pitch + r.x * 4;
+			SDL_UpdateTexture(s_backtex, &r, pixels,
+					  s_backbuf->pitch);
+		}
+	}
+	s_ndirty = -1;
+}
+
+/* Draws the rect (x, y, w, h) of the canvas s_upfactor times bigger in
+ * s_uptex.
+ */
+static void upscale_rect(int x, int y, int w, int h)
+{
+	int pitch, ok;
+	SDL_Rect r;
+	void *pixels;
+
+	r.x = x * s_upfactor;
+	r.y = y * s_upfactor;
+	r.w = w * s_upfactor;
+	r.h = h * s_upfactor;
+	if (SDL_LockTexture(s_uptex, &r, &pixels, &pitch) != 0) {
+		return;
+	}
+
+	if (s_upscale == KERNEL_UPSCALE_SCALE2X) {
+		ok = upscale_scale2x(s_backbuf->pixels, s_backbuf->pitch,
+				     s_backbuf->w, s_backbuf->h, x, y, w, h,
+				     pixels, pitch, s_upfactor);
+	} else {
+		ok = upscale_nearest(s_backbuf->pixels, s_backbuf->pitch,
+				     x, y, w, h, pixels, pitch, s_upfactor);
+	}
+	SDL_UnlockTexture(s_uptex);
+	if (!ok) {
+		ktrace("no memory to upscale");
+	}
+}
+
+/* Like update_backtex(), for s_uptex. */
+static void update_uptex(void)
+{
+	int i, x0, y0, x1, y1, d;
+
+	if (s_ndirty < 0 || !s_uptex_valid) {
+		upscale_rect(0, 0, s_backbuf->w, s_backbuf->h);
+		s_uptex_valid = 1;
+	} else {
+		/* scale2x looks at the pixels around. */
+		d = s_upscale == KERNEL_UPSCALE_SCALE2X;
+		for (i = 0; i < s_ndirty; i++) {
+			x0 = s_dirty[i].x - d;
+			y0 = s_dirty[i].y - d;
+			x1 = s_dirty[i].x + s_dirty[i].w + d;
+			y1 = s_dirty[i].y + s_dirty[i].h + d;
+			x0 = x0 < 0 ? 0 : x0;
+			y0 = y0 < 0 ? 0 : y0;
+			x1 = x1 > s_backbuf->w ? s_backbuf->w : x1;
+			y1 = y1 > s_backbuf->h ? s_backbuf->h : y1;
+			upscale_rect(x0, y0, x1 - x0, y1 - y0);
+		}
+	}
+	s_ndirty = -1;
+}
+
+/* Chooses the upscale factor for the size of the output and makes
+ * s_uptex for it. With factor 1 the renderer scales s_backtex.
+ */
+static void check_upfactor(void)
+{
+	int w, h, f;
+
+	if (s_upscale == KERNEL_UPSCALE_OFF ||
+	    SDL_GetRendererOutputSize(s_renderer, &w, &h) != 0)
+	{
+		return;
+	}
+
+	f = w / s_backbuf->w;
+	if (h / s_backbuf->h < f) {
+		f = h / s_backbuf->h;
+	}
+	if (f > 4) {
+		f = 4;
+	}
+	if (s_upscale == KERNEL_UPSCALE_SCALE2X) {
+		f &= ~1;
+	}
+	if (f < 2) {
+		f = 1;
+	}
+
+	if (f != s_upfactor) {
+		if (s_uptex != NULL) {
+			SDL_DestroyTexture(s_uptex);
+			s_uptex = NULL;
+		}
+		if (f > 1) {
+			s_uptex = SDL_CreateTexture(s_renderer,
+					SDL_PIXELFORMAT_ARGB8888,
+					SDL_TEXTUREACCESS_STREAMING,
+					s_backbuf->w * f, s_backbuf->h * f);
+			if (s_uptex == NULL) {
+				ktrace("cannot create the upscale texture");
+				s_upscale = KERNEL_UPSCALE_OFF;
+				f = 1;
+			}
+		}
+		if (f > 1) {
+			/* Old versions of SDL keep the scale when the
+			 * logical size is removed. */
+			SDL_RenderSetLogicalSize(s_renderer, 0, 0);
+			SDL_RenderSetViewport(s_renderer, NULL);
+			SDL_RenderSetScale(s_renderer, 1, 1);
+		} else {
+			SDL_RenderSetLogicalSize(s_renderer, s_backbuf->w,
+						 s_backbuf->h);
+		}
+		s_upfactor = f;
+		s_uptex_valid = 0;
+		s_backtex_valid = 0;
+	}
+
+	s_updst.w = s_backbuf->w * f;
+	s_updst.h = s_backbuf->h * f;
+	s_updst.x = (w - s_updst.w) / 2;
+	s_updst.y = (h - s_updst.h) / 2;
+}
+
+static void present(void)
+{
+	SDL_Rect sr;
+
+	check_upfactor();
 	SDL_RenderClear(s_renderer);
-	SDL_RenderCopy(s_renderer, s_backtex, &sr, NULL);
+	if (s_upfactor > 1) {
+		sr.x = sr.y = 0;
+		sr.w = s_updst.w;
+		sr.h = s_updst.h;
+		update_uptex();
+		SDL_RenderCopy(s_renderer, s_uptex, &sr, &s_updst);
+	} else {
+		sr.x = sr.y = 0;
+		sr.w = s_backbuf->w;
+		sr.h = s_backbuf->h;
+		update_backtex();
+		SDL_RenderCopy(s_renderer, s_backtex, &sr, NULL);
+	}
 	SDL_RenderPresent(s_renderer);
 }
 
@@ -963,7 +1155,7 @@ static void kernel_on_sound(unsigned char *ptr, int nsamples)
 
 static int run_loop(const struct kernel_config *kcfg)
 {
-	int nevents;
+	int nevents, nframes;
 	SDL_Event ev;
 	Uint64 t;
 	double frame_ms, passed;
@@ -973,6 +1165,7 @@ static int run_loop(const struct kernel_config *kcfg)
 	s_kcanvas.w = s_backbuf->w;
 	s_kcanvas.h = s_backbuf->h;
 	on_frame = kcfg->on_frame;
+	on_draw = kcfg->on_draw;
 	on_sound = kcfg->on_sound;
 
 	if (kcfg->fullscreen) {
@@ -998,7 +1191,24 @@ static int run_loop(const struct kernel_config *kcfg)
 	nevents = 0;
 	while (s_running) {
 		t = SDL_GetPerformanceCounter();
-		if (passed >= frame_ms) {
+		if (on_draw != NULL) {
+			nframes = 0;
+			while (s_running && passed >= frame_ms &&
+			       nframes < MAX_CATCHUP_FRAMES)
+			{
+				passed -= frame_ms;
+				tick();
+				nframes++;
+			}
+			/* Too slow, drop the frames we cannot do. */
+			while (passed >= frame_ms) {
+				passed -= frame_ms;
+			}
+			if (s_running) {
+				on_draw(s_data, passed / frame_ms);
+				present();
+			}
+		} else if (passed >= frame_ms) {
 #if 0
 			SDL_LogDebug(SDL_LOG_CATEGORY_APPLICATION,
 				     "ms %f\n", passed);
@@ -1006,9 +1216,8 @@ static int run_loop(const struct kernel_config *kcfg)
 			while (passed >= frame_ms) {
 				passed -= frame_ms;
 			}
-			update();
-			clean_first_pressed_keys();
-			clean_released_fingers();
+			tick();
+			present();
 		}
 		if (s_running) {
 			nevents = 0;
@@ -1061,7 +1270,16 @@ static int run_backtex(const struct kernel_config *kcfg)
 	if (s_backtex == NULL) {
 		ret = KERNEL_E_ERROR;
 	} else {
+		s_backtex_valid = 0;
+		s_ndirty = -1;
+		upscale_init();
 		ret = run_backbuf(kcfg);
+		if (s_uptex != NULL) {
+			SDL_DestroyTexture(s_uptex);
+			s_uptex = NULL;
+		}
+		s_upfactor = 1;
+		upscale_done();
 		SDL_DestroyTexture(s_backtex);
 		s_backtex = NULL;
 	}
@@ -1069,6 +1287,24 @@ static int run_backtex(const struct kernel_config *kcfg)
 	return ret;
 }
 
+/* Resolves KERNEL_UPSCALE_AUTO for s_renderer. */
+static int choose_upscale(int upscale)
+{
+	SDL_RendererInfo info;
+
+	if (upscale != KERNEL_UPSCALE_AUTO) {
+		return upscale;
+	}
+
+	if (SDL_GetRendererInfo(s_renderer, &info) == 0 &&
+	    (info.flags & SDL_RENDERER_SOFTWARE))
+	{
+		return KERNEL_UPSCALE_NEAREST;
+	}
+
+	return KERNEL_UPSCALE_OFF;
+}
+
 static int run_renderer(const struct kernel_config *kcfg)
 {
 	int ret;
@@ -1090,6 +1326,7 @@ static int run_renderer(const struct kernel_config *kcfg)
 		SDL_SetRenderDrawColor(s_renderer, r, g, b, SDL_ALPHA_OPAQUE);
 		SDL_RenderSetLogicalSize(s_renderer, kcfg->canvas_width,
 					 kcfg->canvas_height);
+		s_upscale = choose_upscale(kcfg->upscale);
 		ret = run_backtex(kcfg);
 		SDL_DestroyRenderer(s_renderer);
 		s_renderer = NULL;
@@ -1243,6 +1480,36 @@ static struct kernel_canvas *get_canvas(void)
 	return &s_kcanvas;
 }
 
+static void set_dirty_rects(const struct kernel_rect *rects, int n)
+{
+	int i, x0, y0, x1, y1;
+
+	if (n < 0 || n > KERNEL_MAX_DIRTY_RECTS) {
+		s_ndirty = -1;
+		return;
+	}
+
+	/* Keep them inside the canvas. */
+	s_ndirty = 0;
+	for (i = 0; i < n; i++) {
+		x0 = rects[i].x < 0 ? 0 : rects[i].x;
+		y0 = rects[i].y < 0 ? 0 : rects[i].y;
+		x1 = rects[i].x + rects[i].w;
+		y1 = rects[i].y + rects[i].h;
+		if (x1 > s_kcanvas.w)
+			x1 = s_kcanvas.w;
+		if (y1 > s_kcanvas.h)
+			y1 = s_kcanvas.h;
+		if (x0 < x1 && y0 < y1) {
+			s_dirty[s_ndirty].x = x0;
+			s_dirty[s_ndirty].y = y0;
+			s_dirty[s_ndirty].w = x1 - x0;
+			s_dirty[s_ndirty].h = y1 - y0;
+			s_ndirty++;
+		}
+	}
+}
+
 static int key_down(int key_scan_code)
 {
 	if (key_scan_code < 0 || key_scan_code >= KERNEL_NKEYS)
@@ -1278,6 +1545,12 @@ static int get_axis_value(int ipad, int iaxis)
 	return s_pads[ipad].axis[iaxis];
 }
 
+static double get_time_ms(void)
+{
+	return SDL_GetPerformanceCounter() * 1000.0 /
+		SDL_GetPerformanceFrequency();
+}
+
 static const char *get_data_path(void)
 {
 	return s_data_path;
@@ -1352,14 +1625,72 @@ static void open_url(const char *url)
 
 #endif
 
+static struct kernel_thread *create_thread(int (*fn)(void *data),
+					   void *data, const char *name)
+{
+	SDL_Thread *thread;
+
+	thread = SDL_CreateThread(fn, name, data);
+	if (thread == NULL) {
+		ktrace("cannot create thread %s: %s", name, SDL_GetError());
+	}
+
+	return (struct kernel_thread *) thread;
+}
+
+static int wait_thread(struct kernel_thread *thread)
+{
+	int r;
+
+	r = 0;
+	SDL_WaitThread((SDL_Thread *) thread, &r);
+	return r;
+}
+
+static struct kernel_sem *create_sem(int value)
+{
+	SDL_sem *sem;
+
+	sem = SDL_CreateSemaphore(value);
+	if (sem == NULL) {
+		ktrace("cannot create semaphore: %s", SDL_GetError());
+	}
+
+	return (struct kernel_sem *) sem;
+}
+
+static void destroy_sem(struct kernel_sem *sem)
+{
+	if (sem != NULL) {
+		SDL_DestroySemaphore((SDL_sem *) sem);
+	}
+}
+
+static void wait_sem(struct kernel_sem *sem)
+{
+	SDL_SemWait((SDL_sem *) sem);
+}
+
+static void post_sem(struct kernel_sem *sem)
+{
+	SDL_SemPost((SDL_sem *) sem);
+}
+
+static int get_cpu_count(void)
+{
+	return SDL_GetCPUCount();
+}
+
 static const struct kernel_device s_device = {
 	.run = run,
 	.stop = stop,
 	.get_canvas = get_canvas,
+	.set_dirty_rects = set_dirty_rects,
 	.key_down = key_down,
 	.key_first_pressed = key_first_pressed,
 	.key_repeating = key_repeating,
 	.get_axis_value = get_axis_value,
+	.get_time_ms = get_time_ms,
 	.get_data_path = get_data_path,
 	.clear_first_pressed_keys = clean_first_pressed_keys,
 	.clear_down_keys = clean_key_states,
@@ -1369,6 +1700,13 @@ static const struct kernel_device s_device = {
 	.insert_pad_event = insert_pad_event,
 	.get_finger = get_finger,
 	.open_url = open_url,
+	.create_thread = create_thread,
+	.wait_thread = wait_thread,
+	.create_sem = create_sem,
+	.destroy_sem = destroy_sem,
+	.sem_wait = wait_sem,
+	.sem_post = post_sem,
+	.get_cpu_count = get_cpu_count,
 };
 
 const struct kernel_device *kernel_get_device(void)
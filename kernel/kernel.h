@@ -166,6 +166,17 @@ enum {
 	KERNEL_SND_44K = KERNEL_SND_22K * 2,
 };
 
+/*
+ * How the canvas is scaled to the window, see kernel_config.upscale.
+ */
+enum {
+	KERNEL_UPSCALE_AUTO,		/* NEAREST if the renderer is software,
+					 * else OFF. */
+	KERNEL_UPSCALE_OFF,		/* The renderer scales. */
+	KERNEL_UPSCALE_NEAREST,		/* We repeat the pixels. */
+	KERNEL_UPSCALE_SCALE2X,		/* We use scale2x. */
+};
+
 /*
  * If new error codes are added here, KERNEL_E_MEM must be always the last
  * since it is used by drivers to select their own error codes.
@@ -194,6 +205,17 @@ struct kernel_canvas {
 	int pitch;		/* Distance between each row in bytes. */
 };
 
+/*
+ * A rect of the canvas that has changed, see set_dirty_rects().
+ */
+struct kernel_rect {
+	int x, y, w, h;
+};
+
+enum {
+	KERNEL_MAX_DIRTY_RECTS = 16
+};
+
 struct kernel_config {
 	/*
 	 * Title for the window, UTF-8, can be NULL.
@@ -236,6 +258,15 @@ struct kernel_config {
 	 */
 	int hint_scale_quality;
 
+	/*
+	 * One of KERNEL_UPSCALE. If not OFF, the canvas is scaled by the
+	 * biggest integer factor that fits the window, up to 4 (even for
+	 * SCALE2X), before sending it to the renderer, and shown centered
+	 * without more scaling. If the factor would be 1, the renderer
+	 * scales as with OFF.
+	 */
+	int upscale;
+
 	/*
 	 * If we wait for VSYNC or not.
 	 */
@@ -262,6 +293,17 @@ struct kernel_config {
 	 */
 	void (*on_frame)(void *data);
 
+	/*
+	 * Function that will be called to paint the canvas, can be NULL.
+	 * If NULL, paint in on_frame() and the canvas is shown after each
+	 * frame. If not NULL, on_frame() is still called frames_per_second
+	 * times per second, but the canvas is painted with on_draw() and
+	 * shown as often as the display allows. 'alpha', in range [0..1],
+	 * is the fraction of a frame passed since the last on_frame(), to
+	 * interpolate between the last two frames.
+	 */
+	void (*on_draw)(void *data, double alpha);
+
 	/*
 	 * Function that will be called to fill sound data, can be NULL.
 	 */
@@ -284,6 +326,10 @@ struct kernel_config {
 				 */
 };
 
+/* Opaque thread and semaphore handles, see struct kernel_device. */
+struct kernel_thread;
+struct kernel_sem;
+
 struct kernel_device {
 
 	/*
@@ -321,6 +367,15 @@ struct kernel_device {
 	 */
 	struct kernel_canvas *(*get_canvas)(void);
 
+	/*
+	 * Tells that only the 'n' rects of the canvas have changed since
+	 * the last frame shown, so only those are sent to the screen.
+	 * It is for the next frame shown only: call it on each on_draw(), or
+	 * on each on_frame() if there is no on_draw(). If not called or if
+	 * 'n' > KERNEL_MAX_DIRTY_RECTS, all the canvas is sent.
+	 */
+	void (*set_dirty_rects)(const struct kernel_rect *rects, int n);
+
 	/*
 	 * Returns true if a key (by scan code) is down.
 	 * Only valid inside the on_frame() call.
@@ -353,6 +408,12 @@ struct kernel_device {
 	 */
 	int (*get_axis_value)(int npad, int axis);
 
+	/*
+	 * Milliseconds passed since some unspecified point in time, with
+	 * sub-millisecond precision. Use it to measure intervals.
+	 */
+	double (*get_time_ms)(void);
+
 	void (*get_window_size)(int *w, int *h);
 	void (*insert_pad_event)(int down, int ksc);
 	const struct kernel_finger * (*get_finger)(int i);
@@ -377,6 +438,29 @@ struct kernel_device {
 
 	/* Opens a url on the web browser */
 	void (*open_url)(const char *url);
+
+	/*
+	 * Starts a thread that runs fn(data). 'name' is for debugging.
+	 * Returns NULL on error.
+	 */
+	struct kernel_thread *(*create_thread)(int (*fn)(void *data),
+					       void *data, const char *name);
+
+	/* Waits for the thread to end and returns what its fn returned. */
+	int (*wait_thread)(struct kernel_thread *thread);
+
+	/*
+	 * Semaphores to synchronize threads. create_sem() returns NULL on
+	 * error. sem_wait() blocks until the value is greater than 0 and
+	 * decrements it; sem_post() increments it.
+	 */
+	struct kernel_sem *(*create_sem)(int value);
+	void (*destroy_sem)(struct kernel_sem *sem);
+	void (*sem_wait)(struct kernel_sem *sem);
+	void (*sem_post)(struct kernel_sem *sem);
+
+	/* Number of logical CPU cores. */
+	int (*get_cpu_count)(void);
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,393 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "upscale.h"
+#include "cbase/kassert.h"
+#include "cfg/cfg.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if PP_SIMD && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define USE_X86_SIMD 0
+#endif
+
+/* Puts each of the 'n' pixels of 'src' 'k' times in 'dst', k in [1..4]. */
+static void (*s_expand_row)(const unsigned int *src, unsigned int *dst,
+			    int n, int k);
+
+/* Puts in 'd0' and 'd1' the two rows of scale2x for the columns
+ * [x0, x1[ of the row 'e' of 'w' pixels, with the row 'b' above and 'h'
+ * below.
+ */
+static void (*s_scale2x_row)(const unsigned int *b, const unsigned int *e,
+			     const unsigned int *h, unsigned int *d0,
+			     unsigned int *d1, int x0, int x1, int w);
+
+/* Rows where we draw before copying to the destination, that can be
+ * slow to read. */
+static unsigned int *s_rows;
+static int s_rows_cap;
+
+static void expand_row(const unsigned int *src, unsigned int *dst, int n,
+		       int k)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < k; j++) {
+			*dst++ = src[i];
+		}
+	}
+}
+
+/*
+ * For each pixel E, with B above, D left, F right and H below, the four
+ * pixels are:
+ *
+ *	E0 E1	E0 = D == B ? D : E	E1 = B == F ? F : E
+ *	E2 E3	E2 = D == H ? D : E	E3 = H == F ? F : E
+ *
+ * but all E if B == H or D == F. Out of the bitmap we repeat the border.
+ */
+static void scale2x_row(const unsigned int *b, const unsigned int *e,
+			const unsigned int *h, unsigned int *d0,
+			unsigned int *d1, int x0, int x1, int w)
+{
+	int x;
+	unsigned int pb, pd, pe, pf, ph;
+
+	for (x = x0; x < x1; x++) {
+		pb = b[x];
+		pe = e[x];
+		ph = h[x];
+		pd = x > 0 ? e[x - 1] : pe;
+		pf = x < w - 1 ? e[x + 1] : pe;
+		if (pb != ph && pd != pf) {
+			*d0++ = pd == pb ? pd : pe;
+			*d0++ = pb == pf ? pf : pe;
+			*d1++ = pd == ph ? pd : pe;
+			*d1++ = ph == pf ? pf : pe;
+		} else {
+			*d0++ = pe;
+			*d0++ = pe;
+			*d1++ = pe;
+			*d1++ = pe;
+		}
+	}
+}
+
+#if USE_X86_SIMD
+
+__attribute__((target("sse2")))
+static void expand_row_sse2(const unsigned int *src, unsigned int *dst,
+			    int n, int k)
+{
+	int i;
+	__m128i p, *d;
+
+	d = (__m128i *) dst;
+	i = 0;
+	switch (k) {
+	case 2:
+		for (; i + 4 <= n; i += 4, d += 2) {
+			p = _mm_loadu_si128((const __m128i *) (src + i));
+			_mm_storeu_si128(d, _mm_unpacklo_epi32(p, p));
+			_mm_storeu_si128(d + 1, _mm_unpackhi_epi32(p, p));
+		}
+		break;
+	case 3:
+		for (; i + 4 <= n; i += 4, d += 3) {
+			p = _mm_loadu_si128((const __m128i *) (src + i));
+			_mm_storeu_si128(d, _mm_shuffle_epi32(p,
+					 _MM_SHUFFLE(1, 0, 0, 0)));
+			_mm_storeu_si128(d + 1, _mm_shuffle_epi32(p,
+					 _MM_SHUFFLE(2, 2, 1, 1)));
+			_mm_storeu_si128(d + 2, _mm_shuffle_epi32(p,
+					 _MM_SHUFFLE(3, 3, 3, 2)));
+		}
+		break;
+	case 4:
+		for (; i + 4 <= n; i += 4, d += 4) {
+			p = _mm_loadu_si128((const __m128i *) (src + i));
+			_mm_storeu_si128(d, _mm_shuffle_epi32(p, 0x00));
+			_mm_storeu_si128(d + 1, _mm_shuffle_epi32(p, 0x55));
+			_mm_storeu_si128(d + 2, _mm_shuffle_epi32(p, 0xaa));
+			_mm_storeu_si128(d + 3, _mm_shuffle_epi32(p, 0xff));
+		}
+		break;
+	}
+	expand_row(src + i, dst + i * k, n - i, k);
+}
+
+/* mask ? a : b */
+__attribute__((target("sse2")))
+static __m128i select_sse2(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* The columns 0 and w - 1 are left to scale2x_row. */
+__attribute__((target("sse2")))
+static void scale2x_row_sse2(const unsigned int *b, const unsigned int *e,
+			     const unsigned int *h, unsigned int *d0,
+			     unsigned int *d1, int x0, int x1, int w)
+{
+	int x, xe;
+	__m128i pb, pd, pe, pf, ph, c, e0, e1, e2, e3;
+
+	x = x0 > 0 ? x0 : 1;
+	if (x > x1)
+		x = x1;
+	scale2x_row(b, e, h, d0, d1, x0, x, w);
+	xe = x1 < w - 1 ? x1 : w - 1;
+	for (; x + 4 <= xe; x += 4) {
+		pb = _mm_loadu_si128((const __m128i *) (b + x));
+		pe = _mm_loadu_si128((const __m128i *) (e + x));
+		ph = _mm_loadu_si128((const __m128i *) (h + x));
+		pd = _mm_loadu_si128((const __m128i *) (e + x - 1));
+		pf = _mm_loadu_si128((const __m128i *) (e + x + 1));
+		c = _mm_or_si128(_mm_cmpeq_epi32(pb, ph),
+				 _mm_cmpeq_epi32(pd, pf));
+		e0 = select_sse2(_mm_andnot_si128(c, _mm_cmpeq_epi32(pd, pb)),
+				 pd, pe);
+		e1 = select_sse2(_mm_andnot_si128(c, _mm_cmpeq_epi32(pb, pf)),
+				 pf, pe);
+		e2 = select_sse2(_mm_andnot_si128(c, _mm_cmpeq_epi32(pd, ph)),
+				 pd, pe);
+		e3 = select_sse2(_mm_andnot_si128(c, _mm_cmpeq_epi32(ph, pf)),
+				 pf, pe);
+		_mm_storeu_si128((__m128i *) (d0 + 2 * (x - x0)),
+				 _mm_unpacklo_epi32(e0, e1));
+		_mm_storeu_si128((__m128i *) (d0 + 2 * (x - x0) + 4),
+				 _mm_unpackhi_epi32(e0, e1));
+		_mm_storeu_si128((__m128i *) (d1 + 2 * (x - x0)),
+				 _mm_unpacklo_epi32(e2, e3));
+		_mm_storeu_si128((__m128i *) (d1 + 2 * (x - x0) + 4),
+				 _mm_unpackhi_epi32(e2, e3));
+	}
+	scale2x_row(b, e, h, d0 + 2 * (x - x0), d1 + 2 * (x - x0), x, x1, w);
+}
+
+__attribute__((target("avx2")))
+static void expand_row_avx2(const unsigned int *src, unsigned int *dst,
+			    int n, int k)
+{
+	int i, j, l;
+	int tab[8];
+	__m256i p, idx[4], *d;
+
+	/* Output vector j takes the pixels (j * 8 + l) / k. */
+	for (j = 0; j < k; j++) {
+		for (l = 0; l < 8; l++) {
+			tab[l] = (j * 8 + l) / k;
+		}
+		idx[j] = _mm256_loadu_si256((const __m256i *) tab);
+	}
+
+	d = (__m256i *) dst;
+	for (i = 0; i + 8 <= n; i += 8) {
+		p = _mm256_loadu_si256((const __m256i *) (src + i));
+		for (j = 0; j < k; j++) {
+			_mm256_storeu_si256(d++,
+					    _mm256_permutevar8x32_epi32(p, idx[j]));
+		}
+	}
+	expand_row(src + i, dst + i * k, n - i, k);
+}
+
+__attribute__((target("avx2")))
+static __m256i select_avx2(__m256i mask, __m256i a, __m256i b)
+{
+	return _mm256_blendv_epi8(b, a, mask);
+}
+
+/* Same as scale2x_row_sse2. */
+__attribute__((target("avx2")))
+static void scale2x_row_avx2(const unsigned int *b, const unsigned int *e,
+			     const unsigned int *h, unsigned int *d0,
+			     unsigned int *d1, int x0, int x1, int w)
+{
+	int x, xe;
+	__m256i pb, pd, pe, pf, ph, c, e0, e1, e2, e3, lo, hi;
+
+	x = x0 > 0 ? x0 : 1;
+	if (x > x1)
+		x = x1;
+	scale2x_row(b, e, h, d0, d1, x0, x, w);
+	xe = x1 < w - 1 ? x1 : w - 1;
+	for (; x + 8 <= xe; x += 8) {
+		pb = _mm256_loadu_si256((const __m256i *) (b + x));
+		pe = _mm256_loadu_si256((const __m256i *) (e + x));
+		ph = _mm256_loadu_si256((const __m256i *) (h + x));
+		pd = _mm256_loadu_si256((const __m256i *) (e + x - 1));
+		pf = _mm256_loadu_si256((const __m256i *) (e + x + 1));
+		c = _mm256_or_si256(_mm256_cmpeq_epi32(pb, ph),
+				    _mm256_cmpeq_epi32(pd, pf));
+		e0 = select_avx2(_mm256_andnot_si256(c,
+				 _mm256_cmpeq_epi32(pd, pb)), pd, pe);
+		e1 = select_avx2(_mm256_andnot_si256(c,
+				 _mm256_cmpeq_epi32(pb, pf)), pf, pe);
+		e2 = select_avx2(_mm256_andnot_si256(c,
+				 _mm256_cmpeq_epi32(pd, ph)), pd, pe);
+		e3 = select_avx2(_mm256_andnot_si256(c,
+				 _mm256_cmpeq_epi32(ph, pf)), pf, pe);
+
+		/* unpack works in each half, so we put the halves in
+		 * order after. */
+		lo = _mm256_unpacklo_epi32(e0, e1);
+		hi = _mm256_unpackhi_epi32(e0, e1);
+		_mm256_storeu_si256((__m256i *) (d0 + 2 * (x - x0)),
+				    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *) (d0 + 2 * (x - x0) + 8),
+				    _mm256_permute2x128_si256(lo, hi, 0x31));
+		lo = _mm256_unpacklo_epi32(e2, e3);
+		hi = _mm256_unpackhi_epi32(e2, e3);
+		_mm256_storeu_si256((__m256i *) (d1 + 2 * (x - x0)),
+				    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *) (d1 + 2 * (x - x0) + 8),
+				    _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	scale2x_row(b, e, h, d0 + 2 * (x - x0), d1 + 2 * (x - x0), x, x1, w);
+}
+
+#endif
+
+/* Makes room for 'n' pixels in s_rows. Returns 0 if no memory. */
+static int grow_rows(int n)
+{
+	unsigned int *p;
+
+	if (n <= s_rows_cap)
+		return 1;
+
+	p = realloc(s_rows, n * sizeof(*p));
+	if (p == NULL)
+		return 0;
+
+	s_rows = p;
+	s_rows_cap = n;
+	return 1;
+}
+
+/* Copies the 'n' pixels of 'row' into 'k' rows of 'dst'. Returns where
+ * the next row goes.
+ */
+static unsigned int *copy_rows(const unsigned int *row, int n,
+			       unsigned int *dst, int dst_pitch, int k)
+{
+	while (k-- > 0) {
+		memcpy(dst, row, n * sizeof(*row));
+		dst = (unsigned int *) ((unsigned char *) dst + dst_pitch);
+	}
+	return dst;
+}
+
+int upscale_nearest(const unsigned int *src, int pitch, int x, int y,
+		    int w, int h, unsigned int *dst, int dst_pitch,
+		    int factor)
+{
+	int r;
+	const unsigned int *s;
+
+	if (kassert_fails(factor >= 2 && factor <= 4))
+		return 1;
+
+	if (!grow_rows(w * factor))
+		return 0;
+
+	for (r = y; r < y + h; r++) {
+		s = (const unsigned int *) ((const unsigned char *) src +
+					    r * pitch) + x;
+		s_expand_row(s, s_rows, w, factor);
+		dst = copy_rows(s_rows, w * factor, dst, dst_pitch, factor);
+	}
+
+	return 1;
+}
+
+int upscale_scale2x(const unsigned int *src, int pitch, int cw, int ch,
+		    int x, int y, int w, int h, unsigned int *dst,
+		    int dst_pitch, int factor)
+{
+	int r, k, n;
+	const unsigned int *b, *e, *s;
+	unsigned int *d0, *d1, *big;
+
+	if (kassert_fails(factor == 2 || factor == 4))
+		return 1;
+
+	k = factor / 2;
+	n = 2 * w;
+	if (!grow_rows(n * (2 + k)))
+		return 0;
+
+	d0 = s_rows;
+	d1 = s_rows + n;
+	big = s_rows + 2 * n;
+	for (r = y; r < y + h; r++) {
+		e = (const unsigned int *) ((const unsigned char *) src +
+					    r * pitch);
+		b = r > 0 ? (const unsigned int *)
+			    ((const unsigned char *) e - pitch) : e;
+		s = r < ch - 1 ? (const unsigned int *)
+			    ((const unsigned char *) e + pitch) : e;
+		s_scale2x_row(b, e, s, d0, d1, x, x + w, cw);
+		if (k == 1) {
+			dst = copy_rows(d0, n, dst, dst_pitch, 1);
+			dst = copy_rows(d1, n, dst, dst_pitch, 1);
+		} else {
+			s_expand_row(d0, big, n, k);
+			dst = copy_rows(big, n * k, dst, dst_pitch, k);
+			s_expand_row(d1, big, n, k);
+			dst = copy_rows(big, n * k, dst, dst_pitch, k);
+		}
+	}
+
+	return 1;
+}
+
+void upscale_init(void)
+{
+	s_expand_row = expand_row;
+	s_scale2x_row = scale2x_row;
+#if USE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		s_expand_row = expand_row_avx2;
+		s_scale2x_row = scale2x_row_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		s_expand_row = expand_row_sse2;
+		s_scale2x_row = scale2x_row_sse2;
+	}
+#endif
+}
+
+void upscale_done(void)
+{
+	free(s_rows);
+	s_rows = NULL;
+	s_rows_cap = 0;
+}
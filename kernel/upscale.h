@@ -0,0 +1,55 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef UPSCALE_H
+#define UPSCALE_H
+
+/*
+ * Upscaling of the canvas by integer factors, for when the renderer would
+ * do it slowly. The pitches are in bytes. 'dst' is where the pixel
+ * (x * factor, y * factor) goes.
+ */
+
+void upscale_init(void);
+void upscale_done(void);
+
+/*
+ * Draws the rect (x, y, w, h) of 'src' 'factor' times bigger, from 2 to
+ * 4, repeating the pixels.
+ * Returns 0 if no memory.
+ */
+int upscale_nearest(const unsigned int *src, int pitch, int x, int y,
+		    int w, int h, unsigned int *dst, int dst_pitch,
+		    int factor);
+
+/*
+ * Same, with factor 2 or 4, but with scale2x, that rounds the diagonals;
+ * with 4 each pixel of scale2x is repeated. 'src' has 'ch' rows of 'cw'
+ * pixels, as the pixels around the rect are also looked at.
+ * Returns 0 if no memory.
+ */
+int upscale_scale2x(const unsigned int *src, int pitch, int cw, int ch,
+		    int x, int y, int w, int h, unsigned int *dst,
+		    int dst_pitch, int factor);
+
+#endif
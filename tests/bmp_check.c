@@ -0,0 +1,378 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Checks that the SIMD blitters draw the same as the plain ones, and that
+ * the drawing recorded by drawcmd.c is the same as the one done at once.
+ * We include bmp_draw.c to reach its blitters.
+ */
+
+#include "gamelib/bmp_draw.c"
+#include "engine/drawcmd.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* drawcmd.c draws alone here, without the engine and the kernel. */
+int s_serial_mode = 1;
+
+int engine_take_helpers(int n)
+{
+	return 0;
+}
+
+void engine_give_helpers(int n)
+{
+}
+
+const struct kernel_device *kernel_get_device(void)
+{
+	return NULL;
+}
+
+#if USE_X86_SIMD
+
+/* The random numbers of check_blitters(), in [0, n), so rand() is left
+ * alone.
+ */
+static int check_rand(unsigned int *seed, int n)
+{
+	*seed = *seed * 1103515245u + 12345u;
+	return (int) ((*seed >> 16) % (unsigned int) n);
+}
+
+/* Fills the pixels of 'bmp', 8 bpp if it has a palette, with runs of
+ * random length, about a third of them of the key color (index 0), so
+ * the SIMD groups can be all, some or none of the key color.
+ */
+static void check_fill(struct bmp *bmp, unsigned int *seed)
+{
+	int i, n, len;
+	unsigned int c;
+
+	n = bmp->w * bmp->h;
+	i = 0;
+	while (i < n) {
+		len = 1 + check_rand(seed, 12);
+		c = check_rand(seed, 3) == 0 ? 0 : 1 + check_rand(seed, 255);
+		for (; len > 0 && i < n; len--, i++) {
+			if (bmp->pal != NULL) {
+				bmp->pixels[i] = (unsigned char) c;
+			} else {
+				((unsigned int *) bmp->pixels)[i] =
+					c == 0 ? bmp->key_color : c * 0x010101;
+			}
+		}
+	}
+}
+
+/* Draws 'n' random rects of 'src' at random places of 'ref' with the
+ * plain blitters and of 'out' with 'rows' and 'pal_row'. Returns the
+ * number of draws that differ.
+ */
+static int check_draws(const struct bmp *src, struct bmp *ref,
+		       struct bmp *out, const struct kc_rows *rows,
+		       void (*pal_row_fn)(const unsigned char *,
+					  unsigned int *, int,
+					  const unsigned int *),
+		       int n, unsigned int *seed)
+{
+	int i, dx, dy, kc, transform, bad;
+	struct rect r, clip;
+
+	clip.x = clip.y = 0;
+	clip.w = ref->w;
+	clip.h = ref->h;
+	bad = 0;
+	for (i = 0; i < n; i++) {
+		/* Widths from 1, so there are tails shorter than a group. */
+		r.w = 1 + check_rand(seed, src->w);
+		r.h = 1 + check_rand(seed, src->h);
+		r.x = check_rand(seed, src->w - r.w + 1);
+		r.y = check_rand(seed, src->h - r.h + 1);
+		dx = check_rand(seed, ref->w + 16) - 8;
+		dy = check_rand(seed, ref->h + 16) - 8;
+		kc = check_rand(seed, 2);
+		transform = check_rand(seed, 4);
+
+		check_fill(ref, seed);
+		memcpy(out->pixels, ref->pixels, ref->h * ref->pitch);
+
+		s_kc_rows = NULL;
+		s_pal_row = pal_row;
+		draw_bmp_kct_clip(src, dx, dy, ref, &r, kc, transform, &clip);
+		s_kc_rows = rows;
+		s_pal_row = pal_row_fn;
+		draw_bmp_kct_clip(src, dx, dy, out, &r, kc, transform, &clip);
+
+		if (memcmp(ref->pixels, out->pixels, ref->h * ref->pitch) != 0)
+		{
+			ktrace("draw %d differs: rect %d %d %d %d at %d %d, "
+			       "%d bpp, key color %d, transform %d", i,
+			       r.x, r.y, r.w, r.h, dx, dy,
+			       src->pal != NULL ? 8 : 32, kc, transform);
+			bad++;
+		}
+	}
+
+	return bad;
+}
+
+/*
+ * Draws random rects of random bitmaps, with each flip and with and
+ * without key color, with the plain blitters and with each SIMD blitter
+ * set this CPU has, and compares the results.
+ * Returns the number of draws that differ, 0 if all is well or there is
+ * no SIMD.
+ * Call after bmp_draw_init(); the blitters in use are kept.
+ */
+static int check_blitters(void)
+{
+	enum {
+		SRC_W = 45, SRC_H = 13, DST_W = 61, DST_H = 29,
+		NDRAWS = 2000,
+	};
+	static unsigned char pix8[SRC_W * SRC_H];
+	static unsigned int pal[256], pix32[SRC_W * SRC_H];
+	static unsigned int ref_pix[DST_W * DST_H], out_pix[DST_W * DST_H];
+	int i, bad;
+	unsigned int seed;
+	struct bmp src8, src32, ref, out;
+	const struct kc_rows *kc_rows;
+	void (*pal_row_fn)(const unsigned char *, unsigned int *, int,
+			   const unsigned int *);
+
+	seed = 1;
+	for (i = 0; i < 256; i++) {
+		pal[i] = i * 0x010101;
+	}
+	memset(&src8, 0, sizeof(src8));
+	src8.pixels = pix8;
+	src8.w = SRC_W;
+	src8.h = SRC_H;
+	src8.pitch = SRC_W;
+	src8.pal = pal;
+	src8.palsz = 256;
+	src8.use_key_color = 1;
+	src8.key_color = pal[0];
+	src32 = src8;
+	src32.pixels = (unsigned char *) pix32;
+	src32.pitch = SRC_W * 4;
+	src32.pal = NULL;
+	src32.palsz = 0;
+	src32.key_color = 0xff00ff;
+	check_fill(&src8, &seed);
+	check_fill(&src32, &seed);
+
+	memset(&ref, 0, sizeof(ref));
+	ref.w = DST_W;
+	ref.h = DST_H;
+	ref.pitch = DST_W * 4;
+	ref.key_color = 0xff00ff;
+	out = ref;
+	ref.pixels = (unsigned char *) ref_pix;
+	out.pixels = (unsigned char *) out_pix;
+
+	kc_rows = s_kc_rows;
+	pal_row_fn = s_pal_row;
+	bad = 0;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		bad += check_draws(&src8, &ref, &out, &s_kc_rows_sse2, pal_row,
+				   NDRAWS, &seed);
+		bad += check_draws(&src32, &ref, &out, &s_kc_rows_sse2,
+				   pal_row, NDRAWS, &seed);
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		bad += check_draws(&src8, &ref, &out, &s_kc_rows_avx2,
+				   pal_row_avx2, NDRAWS, &seed);
+		bad += check_draws(&src32, &ref, &out, &s_kc_rows_avx2,
+				   pal_row_avx2, NDRAWS, &seed);
+	}
+	s_kc_rows = kc_rows;
+	s_pal_row = pal_row_fn;
+	return bad;
+}
+
+#else
+
+static int check_blitters(void)
+{
+	return 0;
+}
+
+#endif
+
+/* The random numbers of check_recorded(), as check_rand() but for any
+ * build.
+ */
+static int rec_rand(unsigned int *seed, int n)
+{
+	*seed = *seed * 1103515245u + 12345u;
+	return (int) ((*seed >> 16) % (unsigned int) n);
+}
+
+/* Draws to 'dst' 'n' random rects of 'src8' or 'src32', masks and lines,
+ * each with a random clip, from 'seed'. Some are drawn with alpha, which
+ * is not recorded.
+ */
+static void random_draws(struct bmp *dst, const struct bmp *src8,
+			 const struct bmp *src32, int n, unsigned int seed)
+{
+	int i, dx, dy;
+	struct rect r, clip;
+	const struct bmp *src;
+
+	for (i = 0; i < n; i++) {
+		clip.x = rec_rand(&seed, dst->w + 16) - 8;
+		clip.y = rec_rand(&seed, dst->h + 16) - 8;
+		clip.w = 1 + rec_rand(&seed, dst->w + 16);
+		clip.h = 1 + rec_rand(&seed, dst->h + 16);
+		reset_clip(dst->w, dst->h);
+		add_clip(&clip);
+
+		src = rec_rand(&seed, 2) ? src8 : src32;
+		r.w = 1 + rec_rand(&seed, src->w);
+		r.h = 1 + rec_rand(&seed, src->h);
+		r.x = rec_rand(&seed, src->w - r.w + 1);
+		r.y = rec_rand(&seed, src->h - r.h + 1);
+		dx = rec_rand(&seed, dst->w + 16) - 8;
+		dy = rec_rand(&seed, dst->h + 16) - 8;
+		switch (rec_rand(&seed, 8)) {
+		case 0:
+		case 1:
+		case 2:
+			draw_bmp_kct(src, dx, dy, dst, &r, rec_rand(&seed, 2),
+				     rec_rand(&seed, 4));
+			break;
+		case 3:
+		case 4:
+			draw_mask_bmp(src, dx, dy, dst, &r,
+				      rec_rand(&seed, 4));
+			break;
+		case 5:
+		case 6:
+			set_draw_color(rec_rand(&seed, 0x1000000));
+			draw_line(dst, dx, dy,
+				  rec_rand(&seed, dst->w + 64) - 32,
+				  rec_rand(&seed, dst->h + 64) - 32);
+			break;
+		default:
+			draw_bmp_alpha(src, dx, dy, dst, &r,
+				       rec_rand(&seed, 256));
+			break;
+		}
+	}
+	reset_clip(dst->w, dst->h);
+}
+
+/*
+ * Draws random things to a bitmap of several tiles, at once and recorded
+ * with drawcmd, and compares. Returns the number of rounds that differ.
+ */
+static int check_recorded(void)
+{
+	enum {
+		SRC_W = 45, SRC_H = 70, DST_W = 150, DST_H = 140,
+		NROUNDS = 200, NDRAWS = 40,
+	};
+	static unsigned char pix8[SRC_W * SRC_H];
+	static unsigned int pal[256], pix32[SRC_W * SRC_H];
+	static unsigned int ref_pix[DST_W * DST_H], out_pix[DST_W * DST_H];
+	int i, bad;
+	unsigned int seed;
+	struct bmp src8, src32, ref, out;
+
+	seed = 1;
+	for (i = 0; i < 256; i++) {
+		pal[i] = rec_rand(&seed, 0x1000000);
+	}
+	memset(&src8, 0, sizeof(src8));
+	src8.pixels = pix8;
+	src8.w = SRC_W;
+	src8.h = SRC_H;
+	src8.pitch = SRC_W;
+	src8.pal = pal;
+	src8.palsz = 256;
+	src8.use_key_color = 1;
+	src8.key_color = pal[0];
+	src32 = src8;
+	src32.pixels = (unsigned char *) pix32;
+	src32.pitch = SRC_W * 4;
+	src32.pal = NULL;
+	src32.palsz = 0;
+	src32.key_color = 0xff00ff;
+	for (i = 0; i < SRC_W * SRC_H; i++) {
+		pix8[i] = rec_rand(&seed, 3) == 0 ? 0 : rec_rand(&seed, 256);
+		pix32[i] = rec_rand(&seed, 3) == 0 ? src32.key_color :
+			   (unsigned int) rec_rand(&seed, 0x1000000);
+	}
+
+	memset(&ref, 0, sizeof(ref));
+	ref.w = DST_W;
+	ref.h = DST_H;
+	ref.pitch = DST_W * 4;
+	ref.use_key_color = 1;
+	ref.key_color = 0xff00ff;
+	out = ref;
+	ref.pixels = (unsigned char *) ref_pix;
+	out.pixels = (unsigned char *) out_pix;
+
+	bad = 0;
+	for (i = 0; i < NROUNDS; i++) {
+		memset(ref_pix, 0, sizeof(ref_pix));
+		memset(out_pix, 0, sizeof(out_pix));
+		random_draws(&ref, &src8, &src32, NDRAWS, seed);
+		drawcmd_begin(&out);
+		random_draws(&out, &src8, &src32, NDRAWS, seed);
+		drawcmd_end();
+		if (memcmp(ref_pix, out_pix, sizeof(ref_pix)) != 0) {
+			ktrace("recorded round %d differs", i);
+			bad++;
+		}
+		seed = seed * 69069u + 1;
+	}
+	drawcmd_done();
+
+	return bad;
+}
+
+int main(void)
+{
+	int bad;
+
+	kassert_init();
+	kassert_set_log_file(stderr);
+	bmp_draw_init();
+	bad = check_blitters();
+	if (bad != 0) {
+		ktrace("%d draws differ", bad);
+		return EXIT_FAILURE;
+	}
+	bad = check_recorded();
+	if (bad != 0) {
+		ktrace("%d recorded rounds differ", bad);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
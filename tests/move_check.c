@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2020 Jorge Giner Cordero
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+ * Checks that circles moved into the wedges between a diagonal and a wall
+ * end up out of both, or stay where they were.
+ * We include raycast.c to reach its map.
+ */
+
+#include "game/raycast.c"
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+	/* The tile of the diagonal. */
+	CHECK_TX = 7,
+	CHECK_TY = 4,
+	NMOVES = 500,
+};
+
+static const double s_radii[] = { 0.1, 0.14, 0.25, 0.33, 0.45 };
+
+/* The random numbers of this check, in [0, 1), so rand() is left
+ * alone.
+ */
+static double check_rand(unsigned int *seed)
+{
+	*seed = *seed * 1103515245u + 12345u;
+	return (double) (*seed >> 8) / (1u << 24);
+}
+
+/* If the circle at (x, y) of radius 'r' is in something. */
+static int overlaps(double x, double y, double r)
+{
+	double x1, y1;
+
+	x1 = x;
+	y1 = y;
+	return push_circle(x, y, &x1, &y1, r);
+}
+
+/* Moves NMOVES circles of radius 'r' around CHECK_TX, CHECK_TY. Returns
+ * the number that end up in something.
+ */
+static int check_moves(double r, unsigned int *seed)
+{
+	int i, bad;
+	double x, y, x1, y1, dx, dy;
+
+	bad = 0;
+	for (i = 0; i < NMOVES; i++) {
+		do {
+			x = CHECK_TX - 1.5 + 4 * check_rand(seed);
+			y = CHECK_TY - 1.5 + 4 * check_rand(seed);
+		} while (overlaps(x, y, r));
+
+		/* Towards the wedge, and a bit further. */
+		dx = CHECK_TX + 0.5 - x + check_rand(seed) - 0.5;
+		dy = CHECK_TY + 0.5 - y + check_rand(seed) - 0.5;
+		x1 = x;
+		y1 = y;
+		move_circle(&x1, &y1, dx, dy, r);
+		if (overlaps(x1, y1, r)) {
+			ktrace("radius %g from %g %g by %g %g ends in "
+			       "something at %g %g", r, x, y, dx, dy, x1, y1);
+			bad++;
+		}
+	}
+
+	return bad;
+}
+
+int main(void)
+{
+	static const int nbs[4][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 },
+				       { 0, -1 } };
+	int i, j, k, bad;
+	unsigned int seed;
+
+	kassert_init();
+	kassert_set_log_file(stderr);
+
+	seed = 1;
+	bad = 0;
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < 4; j++) {
+			memset(s_map, 0, sizeof(s_map));
+			s_map[CHECK_TY * MAPW + CHECK_TX] =
+				DIAG_TILE | (i << 12) | 1;
+			s_map[(CHECK_TY + nbs[j][1]) * MAPW + CHECK_TX +
+			      nbs[j][0]] = WALL_TILE | 1;
+			for (k = 0; k < NELEMS(s_radii); k++) {
+				bad += check_moves(s_radii[k], &seed);
+			}
+		}
+	}
+	if (bad != 0) {
+		ktrace("%d moves end in something", bad);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}